@@ -26,10 +26,13 @@
 #include <time.h>
 #include <float.h>
 
-static char input_line[INPUT_LEN_MAX];
+#define OTHER_SHARD -3          // category of a row belongs to an other category shard (--shard)
+
 static int first = 1;
-static char *float_format = "%.*f";
-static int nearest_needed = 1;                // if non true, then skip nearest analysis temporarily for cases where it is not necessary needed, spees up things
+static char *forest_score_ready = NULL;      // forests having forest score calculated in analysis
+static int analyze_forest_count = 0;         // forests existing when analysis started, forests created while learning in analysis are not scored
+static THREAD_LOCAL char *row_file_name = "-";  // input file name of the row being analyzed, printed with %f
+static THREAD_LOCAL int nearest_needed = 1;                // if non true, then skip nearest analysis temporarily for cases where it is not necessary needed, spees up things
 
 /* User given RGB colors for low and high score values,
  * colors for values between 0 and 1 are gradient */
@@ -76,7 +79,7 @@ int do_nearest()
  *
  * check filter and update analyzed only if filter_on is set
  * 
- * returns index to forest table, -1 if not found
+ * returns index to forest table, -1 if not found, OTHER_SHARD if the category is handled by an other process (--shard)
  */
 static 
 int find_forest(int value_count,char **values, int filter_on)
@@ -86,6 +89,8 @@ int find_forest(int value_count,char **values, int filter_on)
 
     category_string = make_category_string(value_count,values);
 
+    if(!own_category(category_string)) return OTHER_SHARD;
+
     i = search_forest_hash(category_string);
 
     if(filter_on)
@@ -99,6 +104,49 @@ int find_forest(int value_count,char **values, int filter_on)
 } 
 
 
+/* calculate the squared distance of a and sparse sample s.
+   Samples are scaled using scale_factor and scale_offset of the forest, so the distance is
+   the squared distance a_norm of a from the scaled zero sample adjusted by the non zero values of s
+ */
+static
+double sparse_dist_nosqrt(double *a,struct sample *s,struct forest *f,double a_norm)
+{
+    int i,j;
+    double d = a_norm;
+    double t;
+
+    for(i = 0;i < s->nz_count;i++)
+    {
+        j = SAMPLE_NZ_IDX(s)[i];
+
+        if(f->scale_factor != NULL)
+        {
+            t = a[j] - f->scale_offset[j];
+            d += POW2(t - f->scale_factor[j] * s->nz_value[i]) - POW2(t);
+        } else
+        {
+            d += POW2(a[j] - s->nz_value[i]) - POW2(a[j]);
+        }
+    }
+
+    return d > 0.0 ? d : 0.0;
+}
+
+/* calculate the squared distance of a and the zero sample of forest f, used as a_norm in sparse_dist_nosqrt
+ */
+static
+double sparse_norm(double *a,struct forest *f)
+{
+    int j;
+    double d = 0.0;
+
+    if(f->scale_factor == NULL) return dot(a,a);
+
+    for(j = 0;j < dimensions;j++) d += POW2(a[j] - f->scale_offset[j]);
+
+    return d;
+}
+
 /* Search the nearest training sample for a analyzed point a
    returns the shortest relative distance
 
@@ -107,20 +155,47 @@ int find_forest(int value_count,char **values, int filter_on)
    relative distance > 1 if the actual distance is larger than forest average sample distance
 
    a is assumed be scaled in case auto scaling (auto_weigth)
+   a_norm is the distance of a from the zero sample, used with sparse samples
  */
 #define MIN_REL_DIST 0.05
-double nearest_rel_distance(double *a, int sample_count,int *samples,struct forest *f)
+double nearest_rel_distance(double *a, struct node *leaf,struct forest *f,double a_norm)
 {
     int i;
+    int sample_count = leaf->sample_count;
+    int *samples = leaf->samples;
+    struct sample *X = f->X;
     double distance,d; 
 
-    distance = v_dist_nosqrt(a,sample_dimension(&f->X[samples[0]]));
+    if(sparse_fields)
+    {
+        distance = sparse_dist_nosqrt(a,&X[samples[0]],f,a_norm);
+
+        for(i = 1;i < sample_count;i++)
+        {
+            d = sparse_dist_nosqrt(a,&X[samples[i]],f,a_norm);
+
+            if(d < distance) distance = d;
+        }
+    } else if(auto_weigth)
+    {
+        distance = v_dist_nosqrt(a,X[samples[0]].scaled_dimension);
+
+        for(i = 1;i < sample_count;i++)
+        {
+            d = v_dist_nosqrt(a,X[samples[i]].scaled_dimension);
 
-    for(i = 1;i < sample_count;i++)
+            if(d < distance) distance = d;
+        }
+    } else
     {
-        d = v_dist_nosqrt(a,sample_dimension(&f->X[samples[i]]));
+        distance = v_dist_nosqrt(a,X[samples[0]].dimension);
+
+        for(i = 1;i < sample_count;i++)
+        {
+            d = v_dist_nosqrt(a,X[samples[i]].dimension);
 
-        if(d < distance) distance = d;
+            if(d < distance) distance = d;
+        }
     }
 
     distance = sqrt(distance) / f->avg_sample_dist + MIN_REL_DIST;
@@ -138,7 +213,7 @@ double nearest_rel_distance(double *a, int sample_count,int *samples,struct fore
  *
  */
 static 
-double search_last_node(struct forest *f,int this_idx,struct node *n,double *dimension,int heigth)
+double search_last_node(struct forest *f,int this_idx,struct node *n,double *dimension,double a_norm,int heigth)
 {
     struct node *this = &n[this_idx];
 
@@ -147,7 +222,7 @@ double search_last_node(struct forest *f,int this_idx,struct node *n,double *dim
         DEBUG("\n    Reached a leaf node at heigth %d with %d samples",heigth,this->sample_count);
         if(do_nearest() && nearest && f->avg_sample_dist > 0.0)
         {
-            double rel_dist = nearest_rel_distance(dimension,this->sample_count,this->samples,f);
+            double rel_dist = nearest_rel_distance(dimension,this,f,a_norm);
 
             DEBUG(", Calculated nearest relative distance to be: %f\n",rel_dist); 
             return (double) heigth + c((double) this->sample_count / rel_dist);
@@ -158,14 +233,14 @@ double search_last_node(struct forest *f,int this_idx,struct node *n,double *dim
 
     DEBUG("    Reached a node at heigth %d with %d samples\n",heigth,this->sample_count);
 
-    if(dot(dimension,this->n) < this->pdotn)
+    if(node_dot(dimension,this) < this->pdotn)
     {
         if(this->left == -1) return (double) heigth;
-        return search_last_node(f,this->left,n,dimension,heigth + 1);
+        return search_last_node(f,this->left,n,dimension,a_norm,heigth + 1);
     } else
     {
         if(this->rigth == -1) return (double) heigth;
-        return search_last_node(f,this->rigth,n,dimension,heigth + 1);
+        return search_last_node(f,this->rigth,n,dimension,a_norm,heigth + 1);
     }
 }
     
@@ -175,9 +250,9 @@ double search_last_node(struct forest *f,int this_idx,struct node *n,double *dim
  * return the path length
  */
 static 
-double calculate_path_length(struct forest *f,struct tree *t,double *dimension)
+double calculate_path_length(struct forest *f,struct tree *t,double *dimension,double a_norm)
 {
-    return search_last_node(f,t->first,t->n,dimension,0);
+    return search_last_node(f,t->first,t->n,dimension,a_norm,0);
 }
 
 
@@ -189,6 +264,7 @@ double _score(int forest_idx,double *dimension)
     int i;
     struct forest *f = &forest[forest_idx];
     double path_length = 0.0;
+    double a_norm = sparse_fields && nearest && do_nearest() ? sparse_norm(dimension,f) : 0.0;   // used in nearest distance of sparse samples
 
     DEBUG("\n Calculating score in forest %s for values: ",f->category);
     DEBUG_ARRAY(dimensions,dimension);
@@ -199,7 +275,7 @@ double _score(int forest_idx,double *dimension)
         for(i = 0;i < tree_count;i++)
         {
             DEBUG("\n    Scan tree %d\n",i + 1);
-            path_length += calculate_path_length(f,&f->t[i],dimension);
+            path_length += calculate_path_length(f,&f->t[i],dimension,a_norm);
             DEBUG("    Average path length now: %f\n",path_length / (i + 1));
         }
     }
@@ -310,23 +386,28 @@ double calculate_score(int forest_idx,double *dimension)
  *
  * Returns the result array
  */
-static
 double * get_dim_attr_scores(int forest_idx,double *dimension)
 {
-    static double result[DIM_MAX];
-    static double test[DIM_MAX];
+    static THREAD_LOCAL double *result = NULL;
+    static THREAD_LOCAL double *test = NULL;
     double min,score;
     struct forest *f;
     int i,j;
 
     f = &forest[forest_idx];
 
+    if(result == NULL)
+    {
+        result = xmalloc(dimensions * sizeof(double));
+        test = xmalloc(dimensions * sizeof(double));
+    }
+
     for(i = 0;i < dimensions;i++)
     {
         min = 1.0;
         for(j = 0;j < f->cluster_count;j++)
         {
-            v_copy(test,f->X[f->cluster_center[j]].dimension);
+            v_copy(test,sample_values(&f->X[f->cluster_center[j]]));
 
             test[i] = dimension[i];
             score = calculate_score(forest_idx,test);
@@ -352,7 +433,7 @@ double * get_dim_attr_scores(int forest_idx,double *dimension)
 double get_dim_score(int forest_idx,double *dimension)
 {
     struct forest *f = &forest[forest_idx];
-    static double test[DIM_MAX];
+    static THREAD_LOCAL double *test = NULL;
     double score,min;
     int i,j;
 
@@ -360,11 +441,13 @@ double get_dim_score(int forest_idx,double *dimension)
 
     if(score_idx_count)
     {
+        if(test == NULL) test = xmalloc(dimensions * sizeof(double));
+
         for(i = 0;i < f->cluster_count;i++)
         {
-            v_copy(test,f->X[f->cluster_center[i]].dimension);
+            v_copy(test,sample_values(&f->X[f->cluster_center[i]]));
 
-            for(j = 0;j < dimensions;j++) if(check_idx(j,score_idx_count,score_idx)) test[j] = dimension[j];
+            for(j = 0;j < score_idx_count;j++) if(score_idx[j] < dimensions) test[score_idx[j]] = dimension[score_idx[j]];
 
             score = calculate_score(forest_idx,test);
             if(score < min) min = score;
@@ -379,7 +462,7 @@ double get_dim_score(int forest_idx,double *dimension)
  */
 double sample_score_scale(int forest_idx,struct sample *s)
 {
-    double *dim = sample_dimension(s);
+    double *dim = sample_dimension(s,&forest[forest_idx]);
 
     return scale_score ? calculate_score_scale(forest_idx,dim) :  _score(forest_idx,dim);
 }
@@ -389,7 +472,7 @@ double sample_score_scale(int forest_idx,struct sample *s)
  */
 double sample_score(int forest_idx,struct sample *s)
 {
-    return _score(forest_idx,sample_dimension(s));
+    return _score(forest_idx,sample_dimension(s,&forest[forest_idx]));
 }
 
 /* Making smooth linear gradient colors
@@ -464,7 +547,7 @@ static
 unsigned int score_to_rgb(double score)
 {
     int i;
-    static double color[3];
+    static THREAD_LOCAL double color[3];
 
     if(score == 0.0) return 0;
 
@@ -528,394 +611,635 @@ char *make_category_string(int value_count,char **values)
     return category;
 }
 
-/* prints escaped char
- * returns number of characters consumed
+/* Print templates.
+ * Format strings (-p, -j, -v, -M, -N) are compiled once to a list of operations: literal text with escapes
+ * resolved, or a directive. A template is compiled for a format and the directive characters accepted by the caller.
+ * Templates are shared by all threads, new ones are added under the shared lock.
  */
-static 
-size_t print_escaped(FILE *outs, char *esc)
+#define PRINT_TEMPLATES_MAX 32
+#define PRINT_BUFFER_SIZE 8192
+
+struct print_op
+{
+    char directive;                     // directive character, 0 = literal text
+    int len;                            // length of literal text
+    char *text;                         // literal text
+};
+
+struct print_template
 {
-    size_t consumed = 0;
+    char *format;                       // format string and directive characters the template is compiled for
+    char *directives;
+    int op_count;
+    struct print_op *op;
+};
+
+static struct print_template print_templates[PRINT_TEMPLATES_MAX];
+static int print_template_count = 0;
+
+/* Text of a printed row is collected to a buffer which is written to output stream in one block
+ */
+struct print_buffer
+{
+    FILE *outs;
+    size_t len;
+    char data[PRINT_BUFFER_SIZE];
+};
 
-    if(*esc == '\\' && esc[1] != '\000')
+/* returns escaped char, or 0 if esc is not a known escape
+ */
+static 
+char escaped_char(char *esc)
+{
+    if(*esc == '\\')
     {
-        esc++;
-        consumed = 2;
-        switch(*esc)
+        switch(esc[1])
         {
             case 't':
-                fprintf(outs,"%c",'\t');
-                break;
+                return '\t';
             case 'n':
-                fprintf(outs,"%c",'\n');
-                break;
+                return '\n';
             case '\\':
-                fprintf(outs,"%c",'\\');
-                break;
+                return '\\';
             case '"':
-                fprintf(outs,"%c",'"');
-                break;
+                return '"';
             case '\'':
-                fprintf(outs,"%c",'\'');
-                break;
-            default:
-                consumed = 0;
-                break;
+                return '\'';
         }
     }
-    return consumed;
+    return 0;
 }
 
-/* print list separator for dimension list
+/* add one character of literal text to template, consecutive characters are joined to one operation
  */
-static 
-void print_dim_list_separator(FILE *outs,int index)
+static
+void add_template_text(struct print_template *t,char **text,char c)
 {
-    if(index < dimensions - 1) fputc(list_separator,outs);
-}
+    struct print_op *o = t->op_count ? &t->op[t->op_count - 1] : NULL;
 
+    if(o == NULL || o->directive)
+    {
+        o = &t->op[t->op_count++];
+        o->directive = 0;
+        o->text = *text;
+        o->len = 0;
+    }
 
-/* Print something
- * printing is done using printf style string and %-directives
+    *(*text)++ = c;
+    o->len++;
+}
+
+/* compile format to template t, directives are the accepted directive characters.
+ * Dimension format (-j) is printed for each dimension, it does not have directives %:, %. and %% nor the ending newline
  */
-void print_(FILE *outs, double score, int lines,int forest_idx,int value_count,char **values,double *dimension,char *format,char *directives)
+static
+void compile_template(struct print_template *t,char *format,char *directives,int dimension_format)
 {
-    int i;
-    size_t consumed;
+    char *specials = dimension_format ? "" : ":.%";
     char *c = format;
-    char *d;
-    char outstr[100];
-    struct tm *tmp;
-    double *earray = NULL,dim_score = -1.0;
+    char *text,e;
+
+    t->op = xmalloc((strlen(format) + 1) * sizeof(struct print_op));    // at most one operation per character and newline
+    text = xmalloc(strlen(format) + 1);
+    t->op_count = 0;
 
     while(*c != '\000')
     {
-        if(*c == '%' && c[1] != '\000' && (strchr(directives,c[1]) != NULL || strchr(":.%",c[1]) != NULL))
+        if(*c == '%' && c[1] != '\000' && (strchr(directives,c[1]) != NULL || strchr(specials,c[1]) != NULL))
         {
-            c++;
-            switch(*c)
+            if(c[1] == '%')
             {
-                case 'r':
-                    fprintf(outs,"%d",lines);
-                    break;
-                case 'n':
-                    fprintf(outs,"%d",forest[forest_idx].total_rows);
-                    break;
-                case 'o':
-                    fprintf(outs,"%d",forest[forest_idx].analyzed_rows);
-                    break;
-                case 'h':
-                    fprintf(outs,"%d",forest[forest_idx].high_analyzed_rows);
-                    break;
-                case 's':
-                    fprintf(outs,"%f",score);
-                    break;
-                case 'g':
-                    if(dim_score < 0.0) dim_score = get_dim_score(forest_idx,dimension);
-                    if(dim_score >= 0 && dim_score <= 1.0) fprintf(outs,"%f",dim_score);
-                    break;
-                case 'S':
-                    fprintf(outs,"%f",forest[forest_idx].test_average_score);
-                    break;
-                case 'c':
-                    fprintf(outs,"%s",make_category_string(value_count,values));
-                    break;
-                case 'l':
-                    fprintf(outs,"%s",make_label_string(value_count,values));
-                    break;
-                case 'm':
-                    if(print_dimension != NULL)
-                    {
-                        for(i = 0;i < dimensions;i++)
-                        {
-                            d = print_dimension;
-                            while(*d != '\000')
-                            {
-                                if(*d == '%' && d[1] != '\000' && strchr("daei",d[1]) != NULL)
-                                {
-                                    d++;
-                                    switch(*d)
-                                    {
-                                        case 'd':
-                                            if(check_idx(dim_idx[i],text_idx_count,text_idx))
-                                            {
-                                                if(values != NULL) fprintf(outs,"%s",values[dim_idx[i]]);
-                                            } else
-                                            {
-                                                if(dimension != NULL) *printf_format != '\000' ? fprintf(outs,printf_format,dimension[i]) : fprintf(outs,float_format,decimals,dimension[i]);
-                                            }
-                                            break;
-                                        case 'a':
-                                            if(forest_idx > -1) *printf_format != '\000' ? fprintf(outs,printf_format,forest[forest_idx].avg[i]) : fprintf(outs,float_format,decimals,forest[forest_idx].avg[i]);
-                                            break;
-                                        case 'e':
-                                            if(forest_idx > -1 && !forest[forest_idx].filter && forest[forest_idx].cluster_count && dimension != NULL)
-                                            {
-                                                if(earray == NULL) earray = get_dim_attr_scores(forest_idx,dimension);
-                                                fprintf(outs,"%f",earray[i]);
-                                            }
-                                            break;
-                                        case 'i':
-                                            fprintf(outs,"%d",i + 1);
-                                            break;
-                                    }
-                                    d++;
-                                } else if((consumed = print_escaped(outs,d))) // yes, it's an assignment
-                                {
-                                    d += consumed;
-                                }  else
-                                {
-                                    fprintf(outs,"%c",*d);
-                                    d++;
-                                }
-                            }
-                            print_dim_list_separator(outs,i);
-                        }
-                    }
-                    break;
-                case 'd':
-                case 'u':
-                    for(i = 0;i < dimensions;i++)
-                    {
-                        if(*c == 'd' && check_idx(dim_idx[i],text_idx_count,text_idx) && values != NULL)
-                        {
-                            fprintf(outs,"%s",values[dim_idx[i]]);
-                        } else
-                        {
-                            *printf_format != '\000' ? fprintf(outs,printf_format,dimension[i]) : fprintf(outs,float_format,decimals,dimension[i]);
-                        }
-                        print_dim_list_separator(outs,i);
-                    }
-                    break;
-                case 'e':
-                    if(forest[forest_idx].cluster_count)
-                    {
-                        if(earray == NULL) earray = get_dim_attr_scores(forest_idx,dimension);
-                        for(i = 0;i < dimensions;i++)
-                        {
-                            fprintf(outs,"%f",earray[i]);
-                            print_dim_list_separator(outs,i);
-                        }
-                    }
-                    break;
-                case 'a':
-                    for(i = 0;i < dimensions;i++)
-                    {
-                        *printf_format != '\000' ? fprintf(outs,printf_format,forest[forest_idx].avg[i]) : fprintf(outs,float_format,decimals,forest[forest_idx].avg[i]);
-                        print_dim_list_separator(outs,i);
-                    }
-                    break;
-                case 'v':
-                    for(i = 0;i < value_count;i++)
-                    {
-                        fprintf(outs,"%s",values[i]);
-                        if(i < value_count - 1) fputc(list_separator,outs);
-                    }
-                    break;
-                case 'x':
-                    fprintf(outs,"%06X",score_to_rgb(score));
-                    break;
-                case 'X':
-                    if(score == 0.0)  // print black dot
-                    {
-                        fprintf(outs,"%06X",score_to_rgb(score));
-                    } else
-                    {
-                        if(dim_score < 0.0) dim_score = get_dim_score(forest_idx,dimension);
-                        if(dim_score >= 0 && dim_score <= 1.0) fprintf(outs,"%06X",score_to_rgb(dim_score));
-                    }
-                    break;
-                case 'C':
-                    fprintf(outs,"%s",forest[forest_idx].category);
-                    break;
-                case 't':
-                    tmp = localtime(&forest[forest_idx].last_updated);
-
-                    if(tmp != NULL)
-                    {
-                        outstr[0] = '\000';
-                        strftime(outstr, sizeof(outstr), "%c", tmp);
-                        fprintf(outs,"%s",outstr);
-                    }
-                    break;
-                case ':':
-                    fprintf(outs,"%c",category_separator);
-                    break;
-                case '.':
-                    fprintf(outs,"%c",label_separator);
-                    break;
-                case '%':
-                    fprintf(outs,"%c",'%');
-                    break;
+                add_template_text(t,&text,'%');
+            } else
+            {
+                t->op[t->op_count].directive = c[1];
+                t->op[t->op_count].len = 0;
+                t->op[t->op_count].text = NULL;
+                t->op_count++;
             }
-            c++;
-        } else if((consumed = print_escaped(outs,c))) // yes, it's an assignment
+            c += 2;
+        } else if((e = escaped_char(c)))   // yes, it's an assignment
         {
-            c += consumed;
+            add_template_text(t,&text,e);
+            c += 2;
         } else
         {
-            fprintf(outs,"%c",*c);
+            add_template_text(t,&text,*c);
             c++;
         }
     }
-    if(*format) fprintf(outs,"%c",'\n');
-}
 
+    if(*format && !dimension_format) add_template_text(t,&text,'\n');
+}
 
-/* check if index is in a index table.
+/* find the template for format and directives, compile it if not yet done
  */
-int check_idx(int index,int index_count, int *idx_table)
+static
+struct print_template *get_template(char *format,char *directives,int dimension_format)
 {
-    register int i;
-
-    for(i = 0;i < index_count;i++) if(index == idx_table[i]) return 1;
-
-    return 0;
-}
+    int i,count = __atomic_load_n(&print_template_count,__ATOMIC_ACQUIRE);
 
+    for(i = 0;i < count;i++)
+    {
+        if(print_templates[i].format == format && print_templates[i].directives == directives) return &print_templates[i];
+    }
 
-/*  mark category and label dims as non dimensions dims  and populate dim_idx and
- *  category_idx tables
- *  */
-void
-init_dims(int value_count)
-{
-    int i,d;
+    lock_shared();
 
-    d = 0;
+    for(i = 0;i < print_template_count;i++)
+    {
+        if(print_templates[i].format == format && print_templates[i].directives == directives) break;
+    }
 
-    for(i = 0;i < value_count;i++) 
+    if(i == print_template_count)
     {
-        if((!check_idx(i,ignore_idx_count,ignore_idx) || check_idx(i,include_idx_count,include_idx)) &&
-            !check_idx(i,category_idx_count,category_idx) && 
-            !check_idx(i,label_idx_count,label_idx) &&
-            d < DIM_MAX)
-        {
-            dim_idx[d] = i;
-            d++;
-        }
+        if(i == PRINT_TEMPLATES_MAX) panic("Too many print formats",NULL,NULL);
+        print_templates[i].format = format;
+        print_templates[i].directives = directives;
+        compile_template(&print_templates[i],format,directives,dimension_format);
+        __atomic_store_n(&print_template_count,i + 1,__ATOMIC_RELEASE);
     }
 
-    if(!dimensions) dimensions = d;   // If number of dims allready read from saved file, dont mess that
+    unlock_shared();
+
+    return &print_templates[i];
 }
 
-/* aggregate values to forest summary
+/* write buffered text to output stream
  */
-static 
-void aggregate_values(int forest_idx,double *sample)
+static
+void flush_print_buffer(struct print_buffer *b)
 {
-    int i;
-    struct forest *f = &forest[forest_idx];
-
-    if(f->summary == NULL)
-    {
-        f->summary = xmalloc(dimensions * sizeof(double));
-        for(i = 0;i < dimensions;i++) f->summary[i] = sample[i];
-    } else
+    if(b->len)
     {
-        for(i = 0;i < dimensions;i++) f->summary[i] += sample[i];
+        fwrite(b->data,1,b->len,b->outs);
+        b->len = 0;
     }
 }
 
-/* comparison function for score table sorting
+/* make space for len characters, returns the write position
  */
 static
-int pscore_cmp(const void * a, const void * b)
+char *print_space(struct print_buffer *b,size_t len)
 {
-    if(*(double*)a < *(double*)b) return -1;
-    if(*(double*)a > *(double*)b) return 1;
-    return 0;
+    if(b->len + len > PRINT_BUFFER_SIZE) flush_print_buffer(b);
+    return &b->data[b->len];
 }
 
-/* calculate percentage based score for a forest
- * first all sample scores are calculated and sorted
- * the forest score is the score at point x% of sorted scores, 
- */
-void calculate_forest_percentage_score(int forest_idx)
+static
+void print_text(struct print_buffer *b,char *text,size_t len)
 {
-    double *all_scores;
-    int i;
-    struct forest *f;
-
-    f = &forest[forest_idx];
-        
-    if(f->filter) return;
-
-    all_scores = xmalloc(sizeof(double) *  f->X_count);
+    size_t n;
 
-    for(i = 0;i < f->X_count;i++) all_scores[i] = sample_score(forest_idx,&f->X[i]);
+    while(len)
+    {
+        n = PRINT_BUFFER_SIZE - b->len;
+        if(n == 0)
+        {
+            flush_print_buffer(b);
+            n = PRINT_BUFFER_SIZE;
+        }
+        if(n > len) n = len;
+        memcpy(&b->data[b->len],text,n);
+        b->len += n;
+        text += n;
+        len -= n;
+    }
+}
 
-    qsort(all_scores,f->X_count,sizeof(double),pscore_cmp);
+static
+void print_str(struct print_buffer *b,char *s)
+{
+    print_text(b,s,strlen(s));
+}
 
-    f->percentage_score = all_scores[(size_t) ((double) (f->X_count - 1) * (outlier_score / 100.0))];
+static
+void print_char(struct print_buffer *b,char c)
+{
+    *print_space(b,1) = c;
+    b->len++;
+}
 
-    free(all_scores);
+static
+void print_int(struct print_buffer *b,int n)
+{
+    b->len += sprintf(print_space(b,12),"%d",n);
 }
-    
-    
 
+static
+void print_rgb(struct print_buffer *b,double score)
+{
+    b->len += sprintf(print_space(b,12),"%06X",score_to_rgb(score));
+}
 
-/* remove outlier
- * For each non filterd forest the sample with the highest  score is removed from 
- * samples.
- *
- * Forest must be saved with option -w if the if cleaned forest data is need afterwards
+/* print a double with given number of decimals, same as "%.*f"
  */
-void remove_outlier()
+static
+void print_fixed(struct print_buffer *b,double d,int decimals)
 {
-    int forest_idx,i,outlier_idx;
-    double score,max_score;
-    struct forest *f;
+    size_t len = 350 + (decimals > 0 ? decimals : 6);       // large enough for "%.*f" of any double
 
-    for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
+    if(len > PRINT_BUFFER_SIZE)
     {
-        f = &forest[forest_idx];
-
-        if(f->filter || f->X_count <= SAMPLES_MIN) continue;    // Do not remove samples below limit, renders forest filtered
+        flush_print_buffer(b);
+        fprintf(b->outs,"%.*f",decimals,d);
+    } else
+    {
+        b->len += format_fixed(print_space(b,len),d,decimals);
+    }
+}
 
-        outlier_idx = -1;
-        max_score = 0.0;
+/* print a dimension value using user given printf format (-m) or output decimals
+ */
+static
+void print_value(struct print_buffer *b,double d)
+{
+    size_t space;
+    int len;
 
-        for(i = 0;i < f->X_count;i++)
-        {
-            score = sample_score(forest_idx,&f->X[i]);
-            if(score > max_score)
-            {
-                max_score = score;
-                outlier_idx = i;
-            }
-        }
+    if(*printf_format != '\000')
+    {
+        space = PRINT_BUFFER_SIZE - b->len;
+        len = snprintf(&b->data[b->len],space,printf_format,d);
 
-        if(outlier_idx >= 0)
+        if(len >= 0 && (size_t) len >= space)
         {
-            free(f->X[outlier_idx].dimension);
-
-            for(i = outlier_idx;i < f->X_count - 1;i++)
+            flush_print_buffer(b);
+            len = snprintf(b->data,PRINT_BUFFER_SIZE,printf_format,d);
+            if(len >= PRINT_BUFFER_SIZE)
             {
-                f->X[i] = f->X[i + 1];
+                fprintf(b->outs,printf_format,d);
+                len = 0;
             }
-            f->X_count--;
         }
+        if(len > 0) b->len += len;
+    } else
+    {
+        print_fixed(b,d,decimals);
     }
 }
 
-/* calculate the range of scores for a forest this is used to scale scores to 0..1 range in analysis
- * Min score is considered to be the smallest score among samples
- * Max score is tested using huge values for each dimension attributes (calculate_max_score)
- * and in order to make sure that max score is really max adjust it by MAX_SCORE_ADJUST
- *
+/* print list separator for dimension list
  */
-#define MAX_SCORE_ADJUST 1.01
-void calculate_sample_score_range(int forest_idx)
+static 
+void print_dim_list_separator(struct print_buffer *b,int index)
 {
-    int i;
-    struct forest *f;
-    double score;
-
-    f = &forest[forest_idx];
+    if(index < dimensions - 1) print_char(b,list_separator);
+}
 
-    if(f->filter || f->min_score < 1.0) return;   // Range is calculated if f->min_score < 1.0
-     
-    f->min_score = 1.0;
+
+/* Print something
+ * printing is done using printf style string and %-directives, directives are the accepted directive characters.
+ * The format is compiled to a template when printed first time.
+ */
+void print_(FILE *outs, double score, int lines,int forest_idx,int value_count,char **values,double *dimension,char *format,char *directives)
+{
+    int i,j;
+    struct print_template *t = get_template(format,directives,0);
+    struct print_template *dt = NULL;
+    struct print_op *o,*d;
+    struct print_buffer b;
+    char outstr[100];
+    struct tm tmbuf,*tmp;
+    double *earray = NULL,dim_score = -1.0;
+
+    b.outs = outs;
+    b.len = 0;
+
+    for(o = t->op;o < &t->op[t->op_count];o++)
+    {
+        switch(o->directive)
+        {
+            case 0:
+                print_text(&b,o->text,o->len);
+                break;
+            case 'r':
+                print_int(&b,lines);
+                break;
+            case 'n':
+                print_int(&b,forest[forest_idx].total_rows);
+                break;
+            case 'o':
+                print_int(&b,forest[forest_idx].analyzed_rows);
+                break;
+            case 'h':
+                print_int(&b,forest[forest_idx].high_analyzed_rows);
+                break;
+            case 's':
+                print_fixed(&b,score,6);
+                break;
+            case 'g':
+                if(dim_score < 0.0) dim_score = get_dim_score(forest_idx,dimension);
+                if(dim_score >= 0 && dim_score <= 1.0) print_fixed(&b,dim_score,6);
+                break;
+            case 'S':
+                print_fixed(&b,forest[forest_idx].test_average_score,6);
+                break;
+            case 'c':
+                print_str(&b,make_category_string(value_count,values));
+                break;
+            case 'l':
+                print_str(&b,make_label_string(value_count,values));
+                break;
+            case 'm':
+                if(print_dimension != NULL)
+                {
+                    if(dt == NULL) dt = get_template(print_dimension,"daei",1);
+
+                    for(i = 0;i < dimensions;i++)
+                    {
+                        for(j = 0;j < dt->op_count;j++)
+                        {
+                            d = &dt->op[j];
+                            switch(d->directive)
+                            {
+                                case 0:
+                                    print_text(&b,d->text,d->len);
+                                    break;
+                                case 'd':
+                                    if(!projection_dims && (column_role[dim_idx[i]] & COLUMN_TEXT))
+                                    {
+                                        if(values != NULL) print_str(&b,values[dim_idx[i]]);
+                                    } else
+                                    {
+                                        if(dimension != NULL) print_value(&b,dimension[i]);
+                                    }
+                                    break;
+                                case 'a':
+                                    if(forest_idx > -1) print_value(&b,forest[forest_idx].avg[i]);
+                                    break;
+                                case 'e':
+                                    if(forest_idx > -1 && !forest[forest_idx].filter && forest[forest_idx].cluster_count && dimension != NULL)
+                                    {
+                                        if(earray == NULL) earray = get_dim_attr_scores(forest_idx,dimension);
+                                        print_fixed(&b,earray[i],6);
+                                    }
+                                    break;
+                                case 'i':
+                                    print_int(&b,i + 1);
+                                    break;
+                            }
+                        }
+                        print_dim_list_separator(&b,i);
+                    }
+                }
+                break;
+            case 'd':
+            case 'u':
+                for(i = 0;i < dimensions;i++)
+                {
+                    if(o->directive == 'd' && !projection_dims && (column_role[dim_idx[i]] & COLUMN_TEXT) && values != NULL)
+                    {
+                        print_str(&b,values[dim_idx[i]]);
+                    } else
+                    {
+                        print_value(&b,dimension[i]);
+                    }
+                    print_dim_list_separator(&b,i);
+                }
+                break;
+            case 'e':
+                if(forest[forest_idx].cluster_count)
+                {
+                    if(earray == NULL) earray = get_dim_attr_scores(forest_idx,dimension);
+                    for(i = 0;i < dimensions;i++)
+                    {
+                        print_fixed(&b,earray[i],6);
+                        print_dim_list_separator(&b,i);
+                    }
+                }
+                break;
+            case 'a':
+                for(i = 0;i < dimensions;i++)
+                {
+                    print_value(&b,forest[forest_idx].avg[i]);
+                    print_dim_list_separator(&b,i);
+                }
+                break;
+            case 'v':
+                for(i = 0;i < value_count;i++)
+                {
+                    print_str(&b,column_value(values,i));   // text of columnar input is made when needed
+                    if(i < value_count - 1) print_char(&b,list_separator);
+                }
+                break;
+            case 'x':
+                print_rgb(&b,score);
+                break;
+            case 'X':
+                if(score == 0.0)  // print black dot
+                {
+                    print_rgb(&b,score);
+                } else
+                {
+                    if(dim_score < 0.0) dim_score = get_dim_score(forest_idx,dimension);
+                    if(dim_score >= 0 && dim_score <= 1.0) print_rgb(&b,dim_score);
+                }
+                break;
+            case 'C':
+                print_str(&b,forest[forest_idx].category);
+                break;
+            case 'f':
+                print_str(&b,row_file_name);
+                break;
+            case 't':
+                tmp = localtime_r(&forest[forest_idx].last_updated,&tmbuf);
+
+                if(tmp != NULL)
+                {
+                    outstr[0] = '\000';
+                    strftime(outstr, sizeof(outstr), "%c", tmp);
+                    print_str(&b,outstr);
+                }
+                break;
+            case ':':
+                print_char(&b,category_separator);
+                break;
+            case '.':
+                print_char(&b,label_separator);
+                break;
+        }
+    }
+
+    flush_print_buffer(&b);
+}
+
+
+/* check if index is in a index table.
+ */
+int check_idx(int index,int index_count, int *idx_table)
+{
+    register int i;
+
+    for(i = 0;i < index_count;i++) if(index == idx_table[i]) return 1;
+
+    return 0;
+}
+
+
+/* set role bits for all input fields, row handling uses column_role instead of scanning the index tables
+ */
+static
+void init_column_roles()
+{
+    int i;
+
+    memset(column_role,0,dim_max * sizeof(column_role[0]));
+
+    for(i = 0;i < text_idx_count;i++) column_role[text_idx[i]] |= COLUMN_TEXT;
+    for(i = 0;i < category_idx_count;i++) column_role[category_idx[i]] |= COLUMN_CATEGORY;
+    for(i = 0;i < label_idx_count;i++) column_role[label_idx[i]] |= COLUMN_LABEL;
+    for(i = 0;i < ignore_idx_count;i++) column_role[ignore_idx[i]] |= COLUMN_IGNORED;
+    for(i = 0;i < include_idx_count;i++) column_role[include_idx[i]] &= ~COLUMN_IGNORED;
+    for(i = 0;i < formulas;i++) if(formula[i].target_data_idx < dim_max) column_role[formula[i].target_data_idx] |= COLUMN_EXPRESSION;
+}
+
+/*  mark category and label dims as non dimensions dims  and populate dim_idx and
+ *  category_idx tables
+ *  */
+void
+init_dims(int value_count)
+{
+    int i,d;
+
+    d = 0;
+
+    init_column_roles();
+
+    for(i = 0;i < value_count;i++) 
+    {
+        if(!(column_role[i] & (COLUMN_IGNORED | COLUMN_CATEGORY | COLUMN_LABEL)) && d < dim_max)
+        {
+            column_role[i] |= COLUMN_DIMENSION;
+            dim_idx[d] = i;
+            d++;
+        }
+    }
+
+    if(projection_dims) d = init_projection(d);   // dimension attributes are projected to projection_dims dimensions
+
+    if(!dimensions) dimensions = d;   // If number of dims allready read from saved file, dont mess that
+}
+
+/* aggregate values to forest summary
+ */
+static 
+void aggregate_values(int forest_idx,double *sample)
+{
+    int i;
+    struct forest *f = &forest[forest_idx];
+
+    if(f->summary == NULL)
+    {
+        f->summary = xmalloc(dimensions * sizeof(double));
+        for(i = 0;i < dimensions;i++) f->summary[i] = sample[i];
+    } else
+    {
+        for(i = 0;i < dimensions;i++) f->summary[i] += sample[i];
+    }
+}
+
+/* comparison function for score table sorting
+ */
+static
+int pscore_cmp(const void * a, const void * b)
+{
+    if(*(double*)a < *(double*)b) return -1;
+    if(*(double*)a > *(double*)b) return 1;
+    return 0;
+}
+
+/* calculate percentage based score for a forest
+ * first all sample scores are calculated and sorted
+ * the forest score is the score at point x% of sorted scores, 
+ */
+void calculate_forest_percentage_score(int forest_idx)
+{
+    double *all_scores;
+    int i;
+    struct forest *f;
+
+    f = &forest[forest_idx];
+        
+    if(f->filter) return;
+
+    all_scores = xmalloc(sizeof(double) *  f->X_count);
+
+    for(i = 0;i < f->X_count;i++) all_scores[i] = sample_score(forest_idx,&f->X[i]);
+
+    qsort(all_scores,f->X_count,sizeof(double),pscore_cmp);
+
+    f->percentage_score = all_scores[(size_t) ((double) (f->X_count - 1) * (outlier_score / 100.0))];
+
+    free(all_scores);
+}
+    
+    
+
+
+/* remove outlier
+ * For each non filterd forest the sample with the highest  score is removed from 
+ * samples.
+ *
+ * Forest must be saved with option -w if the if cleaned forest data is need afterwards
+ */
+void remove_outlier()
+{
+    int forest_idx,i,outlier_idx;
+    double score,max_score;
+    struct forest *f;
+
+    for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
+    {
+        f = &forest[forest_idx];
+
+        if(f->filter || f->X_count <= SAMPLES_MIN) continue;    // Do not remove samples below limit, renders forest filtered
+
+        outlier_idx = -1;
+        max_score = 0.0;
+
+        for(i = 0;i < f->X_count;i++)
+        {
+            score = sample_score(forest_idx,&f->X[i]);
+            if(score > max_score)
+            {
+                max_score = score;
+                outlier_idx = i;
+            }
+        }
+
+        if(outlier_idx >= 0)
+        {
+            free_sample(&f->X[outlier_idx]);
+
+            for(i = outlier_idx;i < f->X_count - 1;i++)
+            {
+                f->X[i] = f->X[i + 1];
+            }
+            f->X_count--;
+            f->dirty = 1;
+        }
+    }
+}
+
+/* calculate the range of scores for a forest this is used to scale scores to 0..1 range in analysis
+ * Min score is considered to be the smallest score among samples
+ * Max score is tested using huge values for each dimension attributes (calculate_max_score)
+ * and in order to make sure that max score is really max adjust it by MAX_SCORE_ADJUST
+ *
+ */
+#define MAX_SCORE_ADJUST 1.01
+void calculate_sample_score_range(int forest_idx)
+{
+    int i;
+    struct forest *f;
+    double score;
+
+    f = &forest[forest_idx];
+
+    if(f->filter || f->min_score < 1.0) return;   // Range is calculated if f->min_score < 1.0
+     
+    f->min_score = 1.0;
 
     for(i = 0;i < f->X_count;i++)
     {
@@ -1027,7 +1351,7 @@ void find_cluster_centers(int forest_idx)
 
     for(i = 1;i < samples_to_analyze;i++)
     {
-        dist = v_dist_nosqrt(f->X[samples[0].idx].dimension,f->X[samples[i].idx].dimension);
+        dist = sample_dist_nosqrt(&f->X[samples[0].idx],&f->X[samples[i].idx]);
         if(dist > longest_dist) longest_dist = dist;
     }
 
@@ -1048,7 +1372,7 @@ void find_cluster_centers(int forest_idx)
     for(i = 1;i < samples_to_analyze && f->cluster_count < CLUSTER_MAX;i++)
     {
         for(j = 0;j < f->cluster_count;j++) 
-            if(v_dist_nosqrt(f->X[f->cluster_center[j]].dimension,f->X[samples[i].idx].dimension) < 4.0 * same_cluster_dist) break;   // Break if this sample is allready in some cluster
+            if(sample_dist_nosqrt(&f->X[f->cluster_center[j]],&f->X[samples[i].idx]) < 4.0 * same_cluster_dist) break;   // Break if this sample is allready in some cluster
 
         if(j == f->cluster_count) // if distance to all centers is long enough (2 * cluster radius)
         {
@@ -1062,7 +1386,7 @@ void find_cluster_centers(int forest_idx)
     {
         for(j = 0;j < f->cluster_count;j++) 
         {
-            dist = v_dist_nosqrt(f->X[f->cluster_center[j]].dimension,f->X[samples[i].idx].dimension);    // check distance
+            dist = sample_dist_nosqrt(&f->X[f->cluster_center[j]],&f->X[samples[i].idx]);    // check distance
             if(dist <= same_cluster_dist)                                                                 // sample inside this cluster
             {
                 f->X[samples[i].idx].cluster_center_idx = f->cluster_center[j];
@@ -1107,80 +1431,496 @@ int take_this_row(int total_rows)
     if(analyze_sampling_count && total_rows > analyze_sampling_count && ri(1,total_rows) > analyze_sampling_count) return 0;
     return 1;
 }
-/* analyze data from file. 
- * All lines are analyzed against loaded forest/tree data
- * and print anomalies (having score > outlier_score) using printing mask
+/* Init dimension tables using the first data row.
+ * Several files can be analyzed at the same time, so dimensions are initialized under a lock
  */
-void
-analyze(FILE *in_stream, FILE *outs,char *not_found_format,char *average_format)
+void check_first_row(int value_count)
 {
-    int value_count;
-    int lines = 0;
-    int forest_idx;
-    char *values[DIM_MAX];
-    double *dimension = NULL;
-    double score,forest_score;
-    
-    if(!first) dimension =  xmalloc(dimensions * sizeof(double));
+    if(!value_count || !__atomic_load_n(&first,__ATOMIC_ACQUIRE)) return;
 
-    DEBUG("*** Starting analysis\n");
-        
-    while(fgets(input_line,INPUT_LEN_MAX,in_stream) != NULL) 
+    lock_shared();
+
+    if(first) 
     {
-        lines++;
+        init_dims(value_count);
+        __atomic_store_n(&first,0,__ATOMIC_RELEASE);
+    }
 
-        if(header && lines == 1) continue;
+    unlock_shared();
+}
 
-        value_count = parse_csv_line(values,DIM_MAX,input_line,input_separator);
+/* Calculate forest score when the forest is used first time in analysis.
+ * Rows can be analyzed by several threads, so the calculation is done only once under a lock
+ */
+static
+void init_forest_score(int forest_idx)
+{
+    if(__atomic_load_n(&forest_score_ready[forest_idx],__ATOMIC_ACQUIRE)) return;
 
-        if(first && value_count) 
+    lock_shared();
+
+    if(!forest_score_ready[forest_idx])
+    {
+        calculate_forest_score(forest_idx);
+        __atomic_store_n(&forest_score_ready[forest_idx],1,__ATOMIC_RELEASE);
+    }
+
+    unlock_shared();
+}
+
+#define ROW_SKIP -2             // row is not scored, it is sampled out or aggregated
+
+/* find the forest for a row and parse row values if the row is used, forest counters are updated atomically
+ * Category is resolved and sampling is done before parsing, so unknown, filtered and sampled out rows are not parsed
+ * (dimension is always parsed when learning at the same time, because all rows are learned)
+ * returns the forest index if the row should be scored, -1 for unknown categories and ROW_SKIP for rows not to be scored
+ */
+static
+int select_row(int value_count,char **values,double *dimension)
+{
+    int forest_idx;
+    int total_rows;
+
+    forest_idx = find_forest(value_count,values,1);
+
+    if(forest_idx == OTHER_SHARD) return ROW_SKIP;
+
+    if(learn_analyze && !aggregate) parse_values(dimension,values,value_count,0);
+
+    if(forest_idx >= analyze_forest_count || forest_idx < 0) return -1;
+
+    init_forest_score(forest_idx);
+
+    total_rows = __sync_add_and_fetch(&forest[forest_idx].total_rows,1);
+
+    if(aggregate)
+    {
+        parse_values(dimension,values,value_count,0);
+        aggregate_values(forest_idx,dimension);
+        return ROW_SKIP;
+    } 
+
+    if(!take_this_row(total_rows)) return ROW_SKIP;  // check if analyzed rows are reservoir sampled
+
+    __sync_add_and_fetch(&forest[forest_idx].analyzed_rows,1);
+
+    if(!learn_analyze) parse_values(dimension,values,value_count,0);
+
+    return forest_idx;
+}
+
+/* print an outlier or categorized row using print_string, or as a result record (--results)
+ */
+static
+void print_row(FILE *outs,double score,int lines,int forest_idx,int value_count,char **values,double *dimension,char *directives)
+{
+    if(result_format == RESULT_TEXT)
+    {
+        print_(outs,score,lines,forest_idx,value_count,values,dimension,print_string,directives);
+    } else
+    {
+        write_result(outs,score,lines,forest_idx,dimension);
+    }
+}
+
+/* print a row using print_string if it is an outlier, or using not_found_format if the category is unknown
+ * forest_idx is the value returned by select_row
+ */
+static
+void report_row(FILE *outs,int lines,int forest_idx,double score,int value_count,char **values,double *dimension,char *not_found_format,char *average_format)
+{
+    double forest_score;
+
+    if(forest_idx >= 0)
+    {
+        if(average_format != NULL) 
         {
-            init_dims(value_count);
-            dimension =  xmalloc(dimensions * sizeof(double));
-            first = 0;
+            lock_shared();
+            forest[forest_idx].test_average_score += score;
+            unlock_shared();
+        }
+
+        forest_score =  get_forest_score(forest_idx);
+
+        if(score > forest_score && get_dim_score(forest_idx,dimension) > forest_score)
+        {
+            __sync_add_and_fetch(&forest[forest_idx].high_analyzed_rows,1);
+            print_row(outs,score,lines,forest_idx,value_count,values,dimension,"rsclduavxCtnohemgXf");
+        }
+    } else if(forest_idx == -1)
+    {
+        if(not_found_format != NULL && ((forest_idx = find_forest(value_count,values,0)) == -1 || forest_idx >= analyze_forest_count))
+        {
+            if(!learn_analyze || aggregate) parse_values(dimension,values,value_count,0);   // not parsed by select_row
+            print_(outs,0,lines,-1,value_count,values,dimension,not_found_format,"duvclmf");
+        }
+    }
+}
+
+/* analyze one data row and print it using print_string if it is an outlier
+ * Can be called from several threads at the same time, forest counters are updated atomically.
+ * Aggregation is done only when analyzing in one thread.
+ */
+void
+analyze_row(FILE *outs,char *file_name,int lines,int value_count,char **values,double *dimension,char *not_found_format,char *average_format)
+{
+    int forest_idx;
+    double score = 0.0;
+
+    row_file_name = file_name;
+
+    forest_idx = select_row(value_count,values,dimension);
+
+    if(forest_idx >= 0)
+    {
+        DEBUG("\n *Calculate score for a dimension\n");
+
+        score = calculate_score(forest_idx,dimension);
+    }
+
+    report_row(outs,lines,forest_idx,score,value_count,values,dimension,not_found_format,average_format);
+}
+
+/* Rows of an analysis window
+ */
+struct window_row
+{
+    int lines;              // input line number
+    int value_count;
+    int value_start;        // index of the first value in window values
+    int forest_idx;         // result of select_row
+    double score;
+};
+
+/* Scoring order of window rows
+ */
+struct window_order
+{
+    int forest_idx;
+    int row;
+};
+
+/* Work space for window analysis, one for each thread
+ */
+struct window_space
+{
+    int row_cap;
+    int value_cap;
+    struct window_row *row;
+    struct window_order *order;
+    char **values;
+    double *dimension;
+};
+
+static THREAD_LOCAL struct window_space ws;
+
+static
+int compare_window_order(const void *a,const void *b)
+{
+    const struct window_order *x = a;
+    const struct window_order *y = b;
+
+    if(x->forest_idx != y->forest_idx) return x->forest_idx < y->forest_idx ? -1 : 1;
+    return x->row - y->row;
+}
+
+/* Analyze a window of rows. Rows are scored grouped by forest, so the data of one forest
+ * is used for several rows in a row. Results are printed in input order.
+ * rows are the input lines, lines the input line numbers
+ */
+void
+analyze_grouped(FILE *outs,char *file_name,int count,int *lines,char **rows,char *not_found_format,char *average_format)
+{
+    int i,j,n = 0;
+    int value_count,value_pos = 0;
+    static THREAD_LOCAL char **values = NULL;
+    static THREAD_LOCAL int values_cap = 0;
+    struct window_row *r;
+
+    DIM_BUFFER(values,values_cap);
+
+    row_file_name = file_name;
+
+    if(count > ws.row_cap)
+    {
+        ws.row_cap = count;
+        ws.row = xrealloc(ws.row,ws.row_cap * sizeof(struct window_row));
+        ws.order = xrealloc(ws.order,ws.row_cap * sizeof(struct window_order));
+        if(ws.dimension != NULL) ws.dimension = xrealloc(ws.dimension,ws.row_cap * dimensions * sizeof(double));
+    }
+
+    for(i = 0;i < count;i++)
+    {
+        r = &ws.row[i];
+        r->lines = lines[i];
+        r->forest_idx = ROW_SKIP;
+
+        r->value_count = value_count = parse_input_line(values,rows[i]);
+
+        if(!value_count) continue;
+
+        check_first_row(value_count);
+
+        if(ws.dimension == NULL) ws.dimension = xmalloc(ws.row_cap * dimensions * sizeof(double));
+
+        if(value_pos + value_count > ws.value_cap)
+        {
+            ws.value_cap = value_pos + value_count + dim_max;
+            ws.values = xrealloc(ws.values,ws.value_cap * sizeof(char *));
+        }
+
+        r->value_start = value_pos;
+        for(j = 0;j < value_count;j++) ws.values[value_pos++] = values[j];
+
+        r->forest_idx = select_row(value_count,&ws.values[r->value_start],&ws.dimension[i * dimensions]);
+
+        if(r->forest_idx >= 0)
+        {
+            ws.order[n].forest_idx = r->forest_idx;
+            ws.order[n].row = i;
+            n++;
         }
+    }
+
+    qsort(ws.order,n,sizeof(struct window_order),compare_window_order);
+
+    for(j = 0;j < n;j++)
+    {
+        r = &ws.row[ws.order[j].row];
+        r->score = calculate_score(r->forest_idx,&ws.dimension[ws.order[j].row * dimensions]);
+    }
+
+    for(i = 0;i < count;i++)
+    {
+        r = &ws.row[i];
+
+        if(!r->value_count) continue;
+
+        report_row(outs,r->lines,r->forest_idx,r->score,r->value_count,&ws.values[r->value_start],&ws.dimension[i * dimensions],not_found_format,average_format);
+
+        if(learn_analyze) learn_row(r->value_count,&ws.values[r->value_start],&ws.dimension[i * dimensions]);
+    }
+}
+
+/* analyze rows from in in windows of analyze_window rows
+ * returns the number of lines read
+ */
+static
+int analyze_stream_window(struct input *in,char *file_name,FILE *outs,char *not_found_format,char *average_format)
+{
+    int i,count = 0;
+    int lines = 0;
+    size_t len,data_len = 0,data_cap = INPUT_LEN_MAX;
+    char *line;
+    char *data = xmalloc(data_cap);
+    size_t *offset = xmalloc(analyze_window * sizeof(size_t));
+    int *line_number = xmalloc(analyze_window * sizeof(int));
+    char **rows = xmalloc(analyze_window * sizeof(char *));
+
+    for(;;)
+    {
+        if(count == analyze_window || (line = input_next(in)) == NULL)
+        {
+            for(i = 0;i < count;i++) rows[i] = &data[offset[i]];
+
+            if(count) analyze_grouped(outs,file_name,count,line_number,rows,not_found_format,average_format);
+
+            if(count < analyze_window) break;
+
+            count = 0;
+            data_len = 0;
+            continue;
+        }
+
+        lines++;
+
+        if(header && lines == 1) continue;
+
+        len = strlen(line) + 1;
+
+        if(data_len + len > data_cap)
+        {
+            data_cap = 2 * (data_len + len);
+            data = xrealloc(data,data_cap);
+        }
+
+        memcpy(&data[data_len],line,len);
+        offset[count] = data_len;
+        line_number[count] = lines;
+        count++;
+        data_len += len;
+    }
+
+    free(data);
+    free(offset);
+    free(line_number);
+    free(rows);
+
+    return lines;
+}
+
+/* analyze all rows from in_stream, file_name is the name of the input file
+ * If pipeline is true and several threads are available the rows are analyzed in a pipeline (see pipeline.c)
+ * If analyze_window is set, rows are scored in windows grouped by forest
+ * returns the number of lines read
+ */
+static
+int analyze_stream(FILE *in_stream,char *file_name,FILE *outs,char *not_found_format,char *average_format,int pipeline)
+{
+    int value_count;
+    int lines = 0;
+    static THREAD_LOCAL char **values = NULL;
+    static THREAD_LOCAL int values_cap = 0;
+    double *dimension = NULL;
+    struct input *in;
+
+    DEBUG("*** Analyzing file %s\n",file_name);
+
+    DIM_BUFFER(values,values_cap);
+
+    in = input_open(in_stream,file_name);
+
+    // rows are given to the cache writer by input_row, so pipeline and windows are not used while writing a cache
+    if(pipeline && thread_count > 1 && !aggregate && !learn_analyze && !input_caching(in) && analyze_pipeline(in,file_name,outs,not_found_format,average_format,&lines))
+    {
+        input_close(in);
+        return lines;
+    }
+
+    if(analyze_window > 1 && !aggregate && !input_caching(in) && !input_columnar(in))
+    {
+        lines = analyze_stream_window(in,file_name,outs,not_found_format,average_format);
+        input_close(in);
+        return lines;
+    }
+
+    while((value_count = input_row(in,values)) != -1) 
+    {
+        lines++;
+
+        if(header && lines == 1) continue;
 
         if(value_count)
-        { 
-            parse_values(dimension,values,value_count,0);
+        {
+            check_first_row(value_count);
 
-            forest_idx = find_forest(value_count,values,1);
+            if(dimension == NULL) dimension =  xmalloc(dimensions * sizeof(double));
 
-            if(forest_idx >= 0)
-            {
-                if(!forest[forest_idx].total_rows) calculate_forest_score(forest_idx);
+            analyze_row(outs,file_name,lines,value_count,values,dimension,not_found_format,average_format);
+
+            if(learn_analyze) learn_row(value_count,values,dimension);
+        }
+    }
 
-                forest[forest_idx].total_rows++;
+    input_close(in);
+    if(dimension != NULL) free(dimension);
 
-                if(aggregate)
-                {
-                    aggregate_values(forest_idx,dimension);
-                } else
-                {
-                    if(take_this_row(forest[forest_idx].total_rows))   // check if analyzed rows are reservoir sampled
-                    {
-                        forest[forest_idx].analyzed_rows++;
-                        
-                        DEBUG("\n *Calculate score for a dimension\n");
+    return lines;
+}
 
-                        score = calculate_score(forest_idx,dimension);
+/* Input files and temporary outputs when analyzing several files at the same time
+ */
+struct analyze_files_job
+{
+    char **files;
+    FILE **outs;            // output for each file, copied to actual output in file order 
+    int *lines;             // number of lines read from each file
+    char *not_found_format;
+    char *average_format;
+};
 
-                        if(average_format != NULL) forest[forest_idx].test_average_score += score;
+/* analyze one file to a temporary output, called by run_parallel
+ */
+static
+void analyze_one_file(int i,void *arg)
+{
+    struct analyze_files_job *j = arg;
+    FILE *in_stream;
 
-                        forest_score =  get_forest_score(forest_idx);
+    in_stream = xfopen(j->files[i],"r",'a');
 
-                        if(score > forest_score && get_dim_score(forest_idx,dimension) > forest_score)
-                        {
-                            forest[forest_idx].high_analyzed_rows++;
-                            print_(outs,score,lines,forest_idx,value_count,values,dimension,print_string,"rsclduavxCtnohemgX");
-                        }
-                    }
-                }
-            } else
-            {
-                if(not_found_format != NULL && find_forest(value_count,values,0) == -1) print_(outs,0,lines,-1,value_count,values,dimension,not_found_format,"duvclm");
-            }
+    j->outs[i] = tmpfile();
+    if(j->outs[i] == NULL) panic("Cannot create temporary file",NULL,strerror(errno));
+
+    j->lines[i] = analyze_stream(in_stream,j->files[i],j->outs[i],j->not_found_format,j->average_format,0);
+
+    xfclose(in_stream);
+}
+
+/* copy temporary output to outs
+ */
+static
+void copy_output(FILE *from,FILE *outs)
+{
+    size_t n;
+    char buf[65536];
+
+    rewind(from);
+
+    while((n = fread(buf,1,sizeof(buf),from)) > 0)
+    {
+        if(fwrite(buf,1,n,outs) != n) panic("Error in writing output",NULL,strerror(errno));
+    }
+
+    fclose(from);
+}
+
+/* analyze data from files. 
+ * All lines are analyzed against loaded forest/tree data
+ * and print anomalies (having score > outlier_score) using printing mask
+ *
+ * If several files are given and several threads are available, the files are analyzed at the same time.
+ * Output is printed grouped by file in the order the files were given. Forest counters and
+ * averages are calculated over all files.
+ *
+ * If learn_analyze is set, rows are added to forest samples after they are analyzed (single pass learning).
+ * Rows are then analyzed in one thread.
+ */
+void
+analyze(int file_count,char **files,FILE *outs,char *not_found_format,char *average_format)
+{
+    int i;
+    int lines = 0;
+    int forest_idx;
+    FILE *in_stream;
+    struct analyze_files_job j;
+    double score,forest_score;
+    
+    DEBUG("*** Starting analysis\n");
+
+    // forests can be read from shards of forest data directory while analyzing, table has room for all of them
+    if(forest_score_ready == NULL) forest_score_ready = xcalloc(forest_cap + 1,sizeof(char));
+
+    // forests are created only if learning at the same time, all shards are read in that case
+    analyze_forest_count = learn_analyze ? forest_count : forest_cap;
 
+    if(learn_analyze) start_learn_pass();
+
+    if(file_count > 1 && parallel_threads() > 1 && !aggregate && !learn_analyze)
+    {
+        j.files = files;
+        j.outs = xcalloc(file_count,sizeof(FILE *));
+        j.lines = xcalloc(file_count,sizeof(int));
+        j.not_found_format = not_found_format;
+        j.average_format = average_format;
+
+        run_parallel(file_count,analyze_one_file,&j);
+
+        for(i = 0;i < file_count;i++)
+        {
+            copy_output(j.outs[i],outs);
+            lines += j.lines[i];
+        }
+
+        free(j.outs);
+        free(j.lines);
+    } else
+    {
+        for(i = 0;i < file_count;i++)
+        {
+            in_stream = xfopen(files[i],"r",'a');
+            lines += analyze_stream(in_stream,files[i],outs,not_found_format,average_format,1);
+            xfclose(in_stream);
         }
     }
 
@@ -1201,7 +1941,7 @@ analyze(FILE *in_stream, FILE *outs,char *not_found_format,char *average_format)
                 if(score > forest_score && get_dim_score(forest_idx,forest[forest_idx].summary) > forest_score)
                 {
                     forest[forest_idx].high_analyzed_rows++;
-                    print_(outs,score,0,forest_idx,0,NULL,forest[forest_idx].summary,print_string,"rsduaxCtnohemgX");
+                    print_row(outs,score,0,forest_idx,0,NULL,forest[forest_idx].summary,"rsduaxCtnohemgX");
                 }
             }
         }
@@ -1218,31 +1958,93 @@ analyze(FILE *in_stream, FILE *outs,char *not_found_format,char *average_format)
             }
         }
     }
-    
-    if(dimension != NULL) free(dimension);
+
+    if(learn_analyze) end_learn_pass();
 }
 
 
+/* Data for scoring one row against all forests in parallel
+ */
+struct categorize_job
+{
+    double *dimension;      // row to be scored
+    double *scores;         // score for each forest, indexed by forest index
+};
+
+/* Data for finding the best forest for each aggregated summary in parallel
+ */
+struct categorize_summary_job
+{
+    int *best_forest_idx;   // best forest for each forest summary
+    double *min_score;      // score of the best forest
+};
+
+/* score a row in one forest, called by run_parallel
+ */
+static
+void categorize_score_forest(int forest_idx,void *arg)
+{
+    struct categorize_job *j = arg;
+
+    if(!forest[forest_idx].filter) j->scores[forest_idx] = calculate_score(forest_idx,j->dimension);
+}
+
+/* find the forest having lowest score for a forest summary, called by run_parallel
+ */
+static
+void categorize_summary(int i,void *arg)
+{
+    struct categorize_summary_job *j = arg;
+    int forest_idx;
+    double score;
+
+    j->best_forest_idx[i] = -1;
+
+    if(forest[i].summary == NULL) return;
+
+    for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
+    {
+        if(!forest[forest_idx].filter)
+        {
+            score = calculate_score(forest_idx,forest[i].summary);
+            if(j->best_forest_idx[i] == -1 || score < j->min_score[i])
+            {
+                j->min_score[i] = score;
+                j->best_forest_idx[i] = forest_idx;
+            }
+        }
+    }
+}
+
 /* Categorize dimensions
  * All lines are analyzed against loaded forest/tree data
  * All forests are analyzed and a forest having lowest anomaly score is selected as category forest
  * If score_limit then do not print cases where lowest score is higher than forest outlier score
  * Note that scaled score is used in order to get more comparable scores between forests
+ *
+ * Forest scores for a row are calculated in parallel, the best forest is selected afterwards
+ * in forest order so the result is the same as with one thread
  */
 void
-categorize(FILE *in_stream, int score_limit, FILE *outs)
+categorize(FILE *in_stream, char *file_name, int score_limit, FILE *outs)
 {
-    int i,j;
+    int i;
     int value_count;
     int lines = 0;
     int forest_idx;
     int best_forest_idx;
     int save_scale_score = scale_score;
-    char *values[DIM_MAX];
+    static char **values = NULL;
+    static int values_cap = 0;
     double *dimension = NULL;
     double score,min_score;
+    struct input *in;
+    struct categorize_job job;
+    struct categorize_summary_job summary_job;
 
     if(!first) dimension =  xmalloc(dimensions * sizeof(double));
+
+    DIM_BUFFER(values,values_cap);
     
     DEBUG("*** Starting categorizing\n");
 
@@ -1252,14 +2054,16 @@ categorize(FILE *in_stream, int score_limit, FILE *outs)
 
     for(forest_idx = 0;forest_idx < forest_count;forest_idx++)  calculate_sample_score_range(forest_idx); // calculate score range for socre scaling
 
-    while(fgets(input_line,INPUT_LEN_MAX,in_stream) != NULL) 
+    job.scores = xmalloc((forest_count + 1) * sizeof(double));
+
+    in = input_open(in_stream,file_name);
+
+    while((value_count = input_row(in,values)) != -1) 
     {
         lines++;
 
         if(header && lines == 1) continue;
 
-        value_count = parse_csv_line(values,DIM_MAX,input_line,input_separator);
-        
         if(first && value_count) 
         {
             init_dims(value_count);
@@ -1267,27 +2071,34 @@ categorize(FILE *in_stream, int score_limit, FILE *outs)
             first = 0;
         }
 
+        if(category_shards && value_count && !own_category(make_category_string(value_count,values))) continue;     // other category shard
+
         if(value_count)
         { 
-            parse_values(dimension,values,value_count,0);
-
             if(aggregate)
             {
                 forest_idx = find_forest(value_count,values,0);
                 if(forest_idx > -1) 
                 {
+                    parse_values(dimension,values,value_count,0);
                     aggregate_values(forest_idx,dimension);
                     forest[forest_idx].total_rows++;
                 }
             } else
             {
+                parse_values(dimension,values,value_count,0);
+
+                job.dimension = dimension;
+
+                run_parallel(forest_count,categorize_score_forest,&job);
+
                 best_forest_idx = -1;
 
                 for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
                 {
                     if(!forest[forest_idx].filter)
                     {
-                            score = calculate_score(forest_idx,dimension);
+                            score = job.scores[forest_idx];
 
                             if(best_forest_idx == -1 || score <= min_score)
                             {
@@ -1299,39 +2110,37 @@ categorize(FILE *in_stream, int score_limit, FILE *outs)
                 }
 
                 if(best_forest_idx >= 0 && (!score_limit || (score_limit && min_score <= get_forest_score(best_forest_idx))))
-                    print_(outs,min_score,lines,best_forest_idx,value_count,values,dimension,print_string,"rsclduavxCtnemgX");
+                    print_row(outs,min_score,lines,best_forest_idx,value_count,values,dimension,"rsclduavxCtnemgX");
             }
         }
     }
 
+    input_close(in);
+
     if(aggregate)
     {
+        summary_job.best_forest_idx = xmalloc((forest_count + 1) * sizeof(int));
+        summary_job.min_score = xmalloc((forest_count + 1) * sizeof(double));
+
+        run_parallel(forest_count,categorize_summary,&summary_job);
+
         for(i = 0;i < forest_count;i++)
         {
-            best_forest_idx = -1;
-            if(forest[i].summary != NULL)
-            {
-                for(j = 0;j < forest_count;j++)
-                {
-                    if(!forest[j].filter)
-                    {
-                        score = calculate_score(j,forest[i].summary);
-                        if(best_forest_idx == -1 || score < min_score)
-                        {
-                            min_score = score;
-                            best_forest_idx = j;
-                        }
-                    }
-                }
-            }
+            best_forest_idx = summary_job.best_forest_idx[i];
+            min_score = summary_job.min_score[i];
+
             if(best_forest_idx >= 0 && (!score_limit || (score_limit && min_score <= get_forest_score(best_forest_idx))))
-                print_(outs,min_score,0,best_forest_idx,0,NULL,forest[i].summary,print_string,"sduaxCtnem");
+                print_row(outs,min_score,0,best_forest_idx,0,NULL,forest[i].summary,"sduaxCtnem");
         }
+
+        free(summary_job.best_forest_idx);
+        free(summary_job.min_score);
     }
 
     set_centroid_tresshold(CENTROID_TRESSHOLD);   // Set to default
     scale_score = save_scale_score;
 
+    free(job.scores);
     if(dimension != NULL) free(dimension);
 }
 
@@ -1362,6 +2171,8 @@ void remove_samples(char *forest_string)
     if(forest_idx >= 0) 
     {
         forest[forest_idx].X_count = 0;
+        forest[forest_idx].seen_rows = 0;
+        forest[forest_idx].dirty = 1;
     } else
     {
         info("No forest having string",forest_string,NULL);
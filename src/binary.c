@@ -0,0 +1,981 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+
+/* Binary forest data (-W binary, binary32, binary16)
+ *
+ * File starts with magic bytes "\211CEIF\r\n\032", format version (u32) and the sample encoding
+ * requested when the file was written (u32). Rest of the file is a sequence of blocks:
+ * block type (u32), payload length (u64), payload and CRC-32 of the payload (u32).
+ * All integers and floating point values are little endian.
+ *
+ * Block types:
+ *   'G'  global variables as a JSON object, keys are the same as in JSON forest data
+ *   'F'  one forest: category length (u32), category, last updated (i64), sample count (u32),
+ *        number of rows the samples are taken from (u64, not in version 1),
+ *        dimensions (u32), sample encoding (u32), for 16 bit encoding dimension minimums (f64) and
+ *        steps (f64), samples as f64, f32 or u16 values. Sparse samples (-x) have the number of non zero
+ *        values (u32), their dimension indices (u32) and values (f64)
+ *   'E'  end of data, no payload
+ *
+ * Encoding is selected per forest: forests having values which cannot be encoded as requested are saved using f64.
+ *
+ * Delta file FILE.delta (-Z) has segments of the same format without the globals block. Each segment has
+ * the forests changed by one run, they replace the forests having the same category when forest data is read.
+ *
+ * Forest data directory (see shard.c) has an index file having the globals block and an index block:
+ *   'I'  number of shards (u32) and the number of forests in each shard (u32)
+ * and shard files having forest blocks only. Shards can be written in parallel, so the block buffers are thread local.
+ */
+#include "ceif.h"
+#include <time.h>
+#include <math.h>
+#include <float.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BINARY_MAGIC "\211CEIF\r\n\032"
+#define BINARY_MAGIC_LEN 8
+#define BINARY_VERSION 2
+
+#define BLOCK_GLOBALS 'G'
+#define BLOCK_FOREST  'F'
+#define BLOCK_END     'E'
+#define BLOCK_INDEX   'I'
+#define BLOCK_TRUNCATED 0       // returned by read_block for a truncated delta file
+
+#define DELTA_SUFFIX ".delta"
+#define DELTA_COMPACT_PERCENT 50    // forest data is rewritten when the delta file would be larger than this percent of it
+
+#define Q16_MAX 65535
+
+static THREAD_LOCAL unsigned char *block = NULL;     // payload of the block being written or read
+static THREAD_LOCAL size_t block_len = 0;
+static THREAD_LOCAL size_t block_cap = 0;
+static THREAD_LOCAL size_t block_pos = 0;            // read position in block
+
+static THREAD_LOCAL char *binary_file_name;
+static THREAD_LOCAL uint32_t binary_version;         // version of the file being read
+static int binary_delta = 0;            // true when reading a delta file, truncated data is not an error
+
+static char *loaded_file = NULL;        // forest data file read and its state after reading, used in delta saves
+static char *loaded_globals = NULL;
+static int loaded_format;
+static int loaded_encoding;
+
+static uint32_t crc_table[256];
+
+/* CRC-32 (IEEE 802.3) of buf
+ */
+static
+uint32_t crc32_sum(unsigned char *buf,size_t len)
+{
+    uint32_t c,crc = 0xffffffff;
+    size_t i;
+    int j;
+
+    if(crc_table[1] == 0)
+    {
+        for(i = 0;i < 256;i++)
+        {
+            c = (uint32_t) i;
+            for(j = 0;j < 8;j++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+    }
+
+    for(i = 0;i < len;i++) crc = crc_table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
+static
+void block_reserve(size_t n)
+{
+    if(block_len + n > block_cap)
+    {
+        block_cap = block_cap ? 2 * block_cap : 65536;
+        while(block_len + n > block_cap) block_cap *= 2;
+        block = xrealloc(block,block_cap);
+    }
+}
+
+static
+void put_bytes(void *p,size_t n)
+{
+    block_reserve(n);
+    memcpy(&block[block_len],p,n);
+    block_len += n;
+}
+
+static
+void put_u16(uint16_t v)
+{
+    block_reserve(2);
+    block[block_len++] = (unsigned char) v;
+    block[block_len++] = (unsigned char) (v >> 8);
+}
+
+static
+void put_u32(uint32_t v)
+{
+    int i;
+
+    block_reserve(4);
+    for(i = 0;i < 4;i++) block[block_len++] = (unsigned char) (v >> (8 * i));
+}
+
+static
+void put_u64(uint64_t v)
+{
+    int i;
+
+    block_reserve(8);
+    for(i = 0;i < 8;i++) block[block_len++] = (unsigned char) (v >> (8 * i));
+}
+
+static
+void put_f32(float f)
+{
+    uint32_t v;
+
+    memcpy(&v,&f,sizeof(v));
+    put_u32(v);
+}
+
+static
+void put_f64(double d)
+{
+    uint64_t v;
+
+    memcpy(&v,&d,sizeof(v));
+    put_u64(v);
+}
+
+/* write block header, current block payload and checksum
+ */
+static
+void write_block(FILE *fp,uint32_t type)
+{
+    unsigned char header[12];
+    unsigned char crc[4];
+    uint32_t sum = crc32_sum(block,block_len);
+    int i;
+
+    for(i = 0;i < 4;i++) header[i] = (unsigned char) (type >> (8 * i));
+    for(i = 0;i < 8;i++) header[4 + i] = (unsigned char) ((uint64_t) block_len >> (8 * i));
+    for(i = 0;i < 4;i++) crc[i] = (unsigned char) (sum >> (8 * i));
+
+    if(fwrite(header,1,sizeof(header),fp) != sizeof(header) ||
+       (block_len && fwrite(block,1,block_len,fp) != block_len) ||
+       fwrite(crc,1,sizeof(crc),fp) != sizeof(crc))
+    {
+        panic("Error while saving forest data to file",binary_file_name,strerror(errno));
+    }
+
+    block_len = 0;
+}
+
+/* select the encoding for forest samples, returns ENCODING_DOUBLE if values cannot be encoded
+ * using the requested encoding. For 16 bit encoding dimension minimums and steps are set.
+ */
+static
+int forest_encoding(struct forest *f,double *min,double *step)
+{
+    int i,j;
+    double v,max;
+
+    if(sparse_fields) return ENCODING_SPARSE;
+    if(save_encoding == ENCODING_DOUBLE) return ENCODING_DOUBLE;
+
+    for(i = 0;i < f->X_count;i++)
+    {
+        for(j = 0;j < dimensions;j++)
+        {
+            v = f->X[i].dimension[j];
+            if(!isfinite(v) || (save_encoding == ENCODING_FLOAT && fabs(v) > FLT_MAX)) return ENCODING_DOUBLE;
+        }
+    }
+
+    if(save_encoding == ENCODING_Q16)
+    {
+        for(j = 0;j < dimensions;j++)
+        {
+            min[j] = f->X_count ? f->X[0].dimension[j] : 0.0;
+            max = min[j];
+
+            for(i = 1;i < f->X_count;i++)
+            {
+                v = f->X[i].dimension[j];
+                if(v < min[j]) min[j] = v;
+                if(v > max) max = v;
+            }
+
+            step[j] = (max - min[j]) / Q16_MAX;
+            if(!isfinite(step[j])) return ENCODING_DOUBLE;     // range does not fit to double
+        }
+    }
+
+    return save_encoding;
+}
+
+/* make forest block
+ */
+static
+void make_forest_block(int forest_idx,double *min,double *step)
+{
+    struct forest *f = &forest[forest_idx];
+    char *category = f->category ? f->category : "";
+    int i,j,encoding;
+    double *d;
+
+    encoding = forest_encoding(f,min,step);
+
+    put_u32((uint32_t) strlen(category));
+    put_bytes(category,strlen(category));
+    put_u64((uint64_t) (int64_t) f->last_updated);
+    put_u32((uint32_t) f->X_count);
+    put_u64((uint64_t) f->seen_rows);
+    put_u32((uint32_t) dimensions);
+    put_u32((uint32_t) encoding);
+
+    if(encoding == ENCODING_Q16)
+    {
+        for(j = 0;j < dimensions;j++) put_f64(min[j]);
+        for(j = 0;j < dimensions;j++) put_f64(step[j]);
+    }
+
+    for(i = 0;i < f->X_count;i++)
+    {
+        d = f->X[i].dimension;
+
+        switch(encoding)
+        {
+            case ENCODING_SPARSE:
+                put_u32((uint32_t) f->X[i].nz_count);
+                for(j = 0;j < f->X[i].nz_count;j++) put_u32((uint32_t) SAMPLE_NZ_IDX(&f->X[i])[j]);
+                for(j = 0;j < f->X[i].nz_count;j++) put_f64(f->X[i].nz_value[j]);
+                break;
+            case ENCODING_FLOAT:
+                for(j = 0;j < dimensions;j++) put_f32((float) d[j]);
+                break;
+            case ENCODING_Q16:
+                for(j = 0;j < dimensions;j++) put_u16(step[j] > 0.0 ? (uint16_t) nearbyint((d[j] - min[j]) / step[j]) : 0);
+                break;
+            default:
+                for(j = 0;j < dimensions;j++) put_f64(d[j]);
+                break;
+        }
+    }
+}
+
+/* write magic bytes, version and encoding
+ */
+static
+void write_header(FILE *fp)
+{
+    put_bytes(BINARY_MAGIC,BINARY_MAGIC_LEN);
+    put_u32(BINARY_VERSION);
+    put_u32((uint32_t) save_encoding);
+    if(fwrite(block,1,block_len,fp) != block_len) panic("Error while saving forest data to file",binary_file_name,strerror(errno));
+    block_len = 0;
+}
+
+/* global variables as json object text
+ */
+static
+char *globals_string(size_t *len)
+{
+    FILE *mem;
+    char *globals = NULL;
+
+    mem = open_memstream(&globals,len);
+    if(mem == NULL) panic("Cannot allocate memory",NULL,strerror(errno));
+    write_globals_json(mem);
+    fclose(mem);
+    return globals;
+}
+
+/* write forest data in binary format
+ */
+void write_forest_file_binary(char *file_name,time_t delete_interval)
+{
+    int i;
+    time_t now = time(NULL);
+    FILE *fp;
+    char *globals;
+    size_t globals_len;
+    double *min = xmalloc(dimensions * sizeof(double));
+    double *step = xmalloc(dimensions * sizeof(double));
+
+    binary_file_name = file_name;
+    block_len = 0;
+
+    fp = xfopen(file_name,"w",'b');
+
+    write_header(fp);
+
+    globals = globals_string(&globals_len);
+    put_bytes(globals,globals_len);
+    free(globals);
+    write_block(fp,BLOCK_GLOBALS);
+
+    for(i = 0;i < forest_count;i++)
+    {
+        if(delete_interval == (time_t) 0 || (delete_interval > (time_t) 0 && forest[i].last_updated >= now - delete_interval))
+        {
+            make_forest_block(i,min,step);
+            write_block(fp,BLOCK_FOREST);
+        }
+    }
+
+    write_block(fp,BLOCK_END);
+
+    if(ferror(fp) || xfclose(fp) != 0) panic("Error while saving forest data to file",file_name,"");
+
+    free(min);
+    free(step);
+}
+
+static
+void corrupted(void)
+{
+    panic("Forest data file is corrupted",binary_file_name,NULL);
+}
+
+/* read n bytes, returns 0 if a delta file is truncated
+ */
+static
+int read_exact(FILE *fp,void *p,size_t n)
+{
+    if(fread(p,1,n,fp) != n)
+    {
+        if(ferror(fp)) panic("Cannot read file: ",binary_file_name,strerror(errno));
+        if(binary_delta) return 0;
+        panic("Forest data file is truncated",binary_file_name,NULL);
+    }
+    return 1;
+}
+
+static
+uint64_t get_uint(unsigned char *p,int size)
+{
+    uint64_t v = 0;
+    int i;
+
+    for(i = size - 1;i >= 0;i--) v = (v << 8) | p[i];
+    return v;
+}
+
+/* get size bytes from block payload, returns pointer to them
+ */
+static
+unsigned char *get_bytes(size_t size)
+{
+    unsigned char *p = &block[block_pos];
+
+    if(block_len - block_pos < size) corrupted();
+    block_pos += size;
+    return p;
+}
+
+#define get_u16() ((uint16_t) get_uint(get_bytes(2),2))
+#define get_u32() ((uint32_t) get_uint(get_bytes(4),4))
+#define get_u64() get_uint(get_bytes(8),8)
+
+static
+float get_f32(void)
+{
+    uint32_t v = get_u32();
+    float f;
+
+    memcpy(&f,&v,sizeof(f));
+    return f;
+}
+
+static
+double get_f64(void)
+{
+    uint64_t v = get_u64();
+    double d;
+
+    memcpy(&d,&v,sizeof(d));
+    return d;
+}
+
+/* read next block to memory and check the checksum, returns block type
+ */
+static
+uint32_t read_block(FILE *fp)
+{
+    unsigned char header[12];
+    unsigned char crc[4];
+    uint64_t len;
+
+    if(!read_exact(fp,header,sizeof(header))) return BLOCK_TRUNCATED;
+    len = get_uint(&header[4],8);
+
+    if(len > (uint64_t) SIZE_MAX / 2) corrupted();
+
+    block_len = 0;
+    block_pos = 0;
+    block_reserve((size_t) len);
+    if(!read_exact(fp,block,(size_t) len)) return BLOCK_TRUNCATED;
+    block_len = (size_t) len;
+    if(!read_exact(fp,crc,sizeof(crc))) return BLOCK_TRUNCATED;
+
+    if(crc32_sum(block,block_len) != (uint32_t) get_uint(crc,4)) panic("Checksum error in forest data file",binary_file_name,NULL);
+
+    return (uint32_t) get_uint(header,4);
+}
+
+/* read forest block to forest forest_idx
+ */
+static
+void read_forest_block(int forest_idx)
+{
+    struct forest *f = &forest[forest_idx];
+    static double *new = NULL;
+    static int *idx = NULL;
+    static int new_cap = 0,idx_cap = 0;
+    double *min = NULL,*step = NULL,*d;
+    uint32_t len,sample_count,encoding,count;
+    uint32_t i;
+    int j;
+
+    DIM_BUFFER(new,new_cap);
+
+    init_saved_forest(forest_idx);
+
+    len = get_u32();
+    f->category = xmalloc(len + 1);
+    memcpy(f->category,get_bytes(len),len);
+    f->category[len] = '\000';
+
+    f->last_updated = (time_t) (int64_t) get_u64();
+    sample_count = get_u32();
+    f->seen_rows = binary_version >= 2 ? (long) get_u64() : (long) sample_count;
+    if(dimensions < 1 || get_u32() != (uint32_t) dimensions) corrupted();
+    encoding = get_u32();
+
+    switch(encoding)
+    {
+        case ENCODING_DOUBLE:
+            if((block_len - block_pos) / 8 / dimensions < sample_count) corrupted();
+            break;
+        case ENCODING_FLOAT:
+            if((block_len - block_pos) / 4 / dimensions < sample_count) corrupted();
+            break;
+        case ENCODING_SPARSE:
+            if(!sparse_fields) panic("Forest data has sparse samples, give option -x before reading it",binary_file_name,NULL);
+            if((block_len - block_pos) / 4 < sample_count) corrupted();
+            DIM_BUFFER(idx,idx_cap);
+            break;
+        case ENCODING_Q16:
+            min = xmalloc(dimensions * sizeof(double));
+            step = xmalloc(dimensions * sizeof(double));
+            for(j = 0;j < dimensions;j++) min[j] = get_f64();
+            for(j = 0;j < dimensions;j++) step[j] = get_f64();
+            if((block_len - block_pos) / 2 / dimensions < sample_count) corrupted();
+            break;
+        default:
+            corrupted();
+            break;
+    }
+
+    f->X_cap = (int) (samples_total < (int) sample_count ? samples_total : (int) sample_count) + 1;
+    f->X = xmalloc(f->X_cap * sizeof(struct sample));
+
+    for(i = 0;i < sample_count;i++)
+    {
+        if(encoding == ENCODING_SPARSE)
+        {
+            count = get_u32();
+            if(count > (uint32_t) dimensions || (block_len - block_pos) / 12 < count) corrupted();
+            for(j = 0;j < (int) count;j++) idx[j] = (int) get_u32();
+            for(j = 0;j < (int) count;j++) new[j] = get_f64();
+            add_sparse_to_X(f,(int) count,idx,new);
+            continue;
+        }
+
+        // saved samples are already shuffled, they are added directly until the sample table is full
+        d = f->X_count < samples_total && !sparse_fields ? xmalloc(dimensions * sizeof(double)) : new;
+
+        switch(encoding)
+        {
+            case ENCODING_FLOAT:
+                for(j = 0;j < dimensions;j++) d[j] = (double) get_f32();
+                break;
+            case ENCODING_Q16:
+                for(j = 0;j < dimensions;j++) d[j] = min[j] + get_u16() * step[j];
+                break;
+            default:
+                for(j = 0;j < dimensions;j++) d[j] = get_f64();
+                break;
+        }
+
+        if(d != new)
+        {
+            f->X[f->X_count].dimension = d;
+            f->X[f->X_count].scaled_dimension = NULL;
+            f->X[f->X_count].cluster_center_idx = -1;
+            f->X_count++;
+        } else
+        {
+            add_to_X(f,new,dimensions,1);
+        }
+    }
+
+    if(min != NULL) free(min);
+    if(step != NULL) free(step);
+}
+
+/* read and check magic bytes and version, the encoding of the file is used when saving if no format is given
+ */
+static
+void read_header(FILE *fp)
+{
+    unsigned char header[BINARY_MAGIC_LEN + 8];
+    uint32_t encoding;
+
+    read_exact(fp,header,sizeof(header));
+    if(memcmp(header,BINARY_MAGIC,BINARY_MAGIC_LEN) != 0) panic("Unknown file format: ",binary_file_name,"");
+    binary_version = (uint32_t) get_uint(&header[BINARY_MAGIC_LEN],4);
+    if(binary_version < 1 || binary_version > BINARY_VERSION) panic("Unsupported binary forest data version",binary_file_name,NULL);
+
+    encoding = (uint32_t) get_uint(&header[BINARY_MAGIC_LEN + 4],4);
+    if(!save_format && encoding <= ENCODING_Q16) save_encoding = (int) encoding;     // keep the encoding when saving again
+}
+
+/* read binary forest data into memory
+ */
+int read_forest_file_binary(char *file_name)
+{
+    FILE *fp;
+    uint32_t type;
+    int globals_read = 0;
+
+    binary_file_name = file_name;
+    binary_delta = 0;
+
+    fp = xfopen(file_name,"r",'b');
+
+    read_header(fp);
+
+    while((type = read_block(fp)) != BLOCK_END)
+    {
+        switch(type)
+        {
+            case BLOCK_GLOBALS:
+                read_globals_json((char *) block,block_len,file_name);
+                globals_read = 1;
+
+                forest_cap = forest_count + 1;
+                forest_count = 0;                                          // get actual forest count from blocks
+                forest = xmalloc(forest_cap * sizeof(struct forest));
+                break;
+            case BLOCK_FOREST:
+                if(!globals_read) corrupted();
+
+                if(forest_count >= forest_cap)
+                {
+                    forest_cap *= 2;
+                    forest = xrealloc(forest,forest_cap * sizeof(struct forest));
+                }
+                read_forest_block(forest_count);
+                add_forest_hash(forest_count,forest[forest_count].category);
+                forest_count++;
+                break;
+            default:                   // unknown blocks are skipped
+                break;
+        }
+    }
+
+    if(!globals_read) corrupted();
+
+    xfclose(fp);
+
+    return 1;
+}
+
+/* name of the delta file of forest data file
+ */
+static
+char *delta_file_name(char *file_name)
+{
+    char *name = xmalloc(strlen(file_name) + strlen(DELTA_SUFFIX) + 1);
+
+    strcpy(name,file_name);
+    strcat(name,DELTA_SUFFIX);
+    return name;
+}
+
+/* make room for one forest in forest table
+ */
+static
+void reserve_forest(void)
+{
+    if(forest_count >= forest_cap)
+    {
+        forest_cap = forest_cap ? 2 * forest_cap : 64;
+        forest = xrealloc(forest,forest_cap * sizeof(struct forest));
+    }
+}
+
+/* replace a forest with the one in forest block, or add a new forest
+ */
+static
+void replay_forest_block(void)
+{
+    int i;
+    struct forest *f;
+
+    reserve_forest();
+    read_forest_block(forest_count);
+
+    i = search_forest_hash(forest[forest_count].category);
+
+    if(i >= 0)
+    {
+        f = &forest[i];
+
+        free_forest(f);
+
+        *f = forest[forest_count];
+    } else
+    {
+        add_forest_hash(forest_count,forest[forest_count].category);
+        forest_count++;
+    }
+}
+
+/* global variables compared when deciding if delta can be written. Forest count changes
+ * when forests are added, so it is not compared
+ */
+static
+char *delta_globals_string(void)
+{
+    int count = forest_count;
+    size_t len;
+    char *globals;
+
+    forest_count = 0;
+    globals = globals_string(&len);
+    forest_count = count;
+    return globals;
+}
+
+/* Read changes from the delta file of forest data file_name, if there is one.
+ * State of the forest data is saved, so that only changed forests are written to delta file when saving.
+ */
+void read_forest_delta(char *file_name,int file_format)
+{
+    char *delta = delta_file_name(file_name);
+    unsigned char header[BINARY_MAGIC_LEN + 8];
+    size_t n;
+    uint32_t type;
+    int truncated = 0;
+    FILE *fp;
+
+    if(loaded_file != NULL) free(loaded_file);
+    if(loaded_globals != NULL) free(loaded_globals);
+    loaded_file = NULL;
+    loaded_globals = NULL;
+
+    fp = strcmp(file_name,"-") != 0 ? xfopen_test(delta,"r",'b') : NULL;
+
+    if(fp != NULL)
+    {
+        binary_file_name = delta;
+        binary_delta = 1;
+
+        while((n = fread(header,1,sizeof(header),fp)) > 0)
+        {
+            if(n < sizeof(header)) break;
+            binary_version = (uint32_t) get_uint(&header[BINARY_MAGIC_LEN],4);
+            if(memcmp(header,BINARY_MAGIC,BINARY_MAGIC_LEN) != 0 || binary_version < 1 || binary_version > BINARY_VERSION) corrupted();
+
+            while((type = read_block(fp)) != BLOCK_END && type != BLOCK_TRUNCATED)
+            {
+                if(type == BLOCK_FOREST) replay_forest_block();
+            }
+
+            if(type == BLOCK_TRUNCATED) break;
+        }
+
+        if(n > 0)
+        {
+            info("Forest data delta file is truncated, last changes are not read",delta,NULL);
+            truncated = 1;         // changes cannot be appended after truncated data, whole forest data is written
+        }
+        if(ferror(fp)) panic("Cannot read file: ",delta,strerror(errno));
+
+        xfclose(fp);
+        binary_delta = 0;
+    }
+
+    free(delta);
+
+    if(truncated) return;
+
+    loaded_file = xstrdup(file_name);
+    loaded_globals = delta_globals_string();
+    loaded_format = file_format;
+    loaded_encoding = save_encoding;
+}
+
+/* Write the forests changed after the forest data was read to the delta file (option -Z).
+ * Returns 0 if the whole forest data should be written: forest data was not read from file_name,
+ * global variables or format are changed, forests are deleted or the delta file has grown too large
+ */
+int write_forest_file_delta(char *file_name,time_t delete_interval)
+{
+    int i,changed = 0;
+    time_t now = time(NULL);
+    char *globals;
+    char *delta;
+    struct stat base_st,delta_st;
+    off_t delta_size = 0;
+    off_t change_size = 0;
+    double *min,*step;
+    FILE *fp;
+
+    if(loaded_file == NULL || strcmp(loaded_file,file_name) != 0 || strcmp(file_name,"-") == 0) return 0;
+    if(save_format != loaded_format || save_encoding != loaded_encoding) return 0;
+
+    globals = delta_globals_string();
+    changed = strcmp(globals,loaded_globals) != 0;
+    free(globals);
+    if(changed) return 0;
+
+    for(i = 0;i < forest_count;i++)
+    {
+        if(delete_interval > (time_t) 0 && forest[i].last_updated < now - delete_interval) return 0;
+        if(forest[i].dirty) change_size += (off_t) forest[i].X_count * dimensions * sizeof(double) + 100;
+    }
+
+    if(stat(file_name,&base_st) != 0) return 0;
+
+    delta = delta_file_name(file_name);
+
+    if(stat(delta,&delta_st) == 0) delta_size = delta_st.st_size;
+
+    if((delta_size + change_size) * 100 > base_st.st_size * DELTA_COMPACT_PERCENT)
+    {
+        free(delta);
+        return 0;
+    }
+
+    if(change_size > 0)
+    {
+        min = xmalloc(dimensions * sizeof(double));
+        step = xmalloc(dimensions * sizeof(double));
+
+        binary_file_name = delta;
+        block_len = 0;
+
+        fp = xfopen(delta,"a",'b');
+
+        write_header(fp);
+
+        for(i = 0;i < forest_count;i++)
+        {
+            if(!forest[i].dirty) continue;
+            make_forest_block(i,min,step);
+            write_block(fp,BLOCK_FOREST);
+            forest[i].dirty = 0;
+        }
+
+        write_block(fp,BLOCK_END);
+
+        if(ferror(fp) || xfclose(fp) != 0) panic("Error while saving forest data to file",delta,"");
+
+        free(min);
+        free(step);
+    }
+
+    free(delta);
+    return 1;
+}
+
+/* remove the delta file after the whole forest data is written
+ */
+void remove_forest_delta(char *file_name)
+{
+    char *delta;
+
+    if(strcmp(file_name,"-") == 0) return;
+
+    delta = delta_file_name(file_name);
+    if(unlink(delta) != 0 && errno != ENOENT) panic("Cannot remove file",delta,strerror(errno));
+    free(delta);
+
+    if(loaded_file != NULL && strcmp(loaded_file,file_name) == 0)
+    {
+        free(loaded_file);
+        loaded_file = NULL;
+    }
+}
+
+/* write the index of forest data directory: global variables and the number of forests in each shard.
+ * forest_total is the number of forests in all shards, all of them are not necessarily in memory
+ */
+void write_forest_index(char *file_name,int forest_total,int shards,int *shard_forests)
+{
+    int i,count = forest_count;
+    FILE *fp;
+    char *globals;
+    size_t globals_len;
+
+    binary_file_name = file_name;
+    block_len = 0;
+
+    fp = xfopen(file_name,"w",'b');
+
+    write_header(fp);
+
+    forest_count = forest_total;
+    globals = globals_string(&globals_len);
+    forest_count = count;
+    put_bytes(globals,globals_len);
+    free(globals);
+    write_block(fp,BLOCK_GLOBALS);
+
+    put_u32((uint32_t) shards);
+    for(i = 0;i < shards;i++) put_u32((uint32_t) shard_forests[i]);
+    write_block(fp,BLOCK_INDEX);
+
+    write_block(fp,BLOCK_END);
+
+    if(ferror(fp) || xfclose(fp) != 0) panic("Error while saving forest data to file",file_name,"");
+}
+
+/* read the index of forest data directory. Global variables are set and the number of forests in each shard
+ * is returned in shard_forests. Returns the number of shards
+ */
+int read_forest_index(char *file_name,int **shard_forests)
+{
+    FILE *fp;
+    uint32_t type,i,shards = 0;
+    int globals_read = 0;
+
+    binary_file_name = file_name;
+    binary_delta = 0;
+    *shard_forests = NULL;
+
+    fp = xfopen(file_name,"r",'b');
+
+    read_header(fp);
+
+    while((type = read_block(fp)) != BLOCK_END)
+    {
+        switch(type)
+        {
+            case BLOCK_GLOBALS:
+                read_globals_json((char *) block,block_len,file_name);
+                globals_read = 1;
+                break;
+            case BLOCK_INDEX:
+                shards = get_u32();
+                if(shards < 1 || shards > 1000000 || (block_len - block_pos) / 4 < shards) corrupted();
+
+                *shard_forests = xmalloc(shards * sizeof(int));
+                for(i = 0;i < shards;i++) (*shard_forests)[i] = (int) get_u32();
+                break;
+            default:                   // unknown blocks are skipped
+                break;
+        }
+    }
+
+    if(!globals_read || *shard_forests == NULL) corrupted();
+
+    xfclose(fp);
+
+    return (int) shards;
+}
+
+/* write forests in table forests to file_name without global variables, used for shards of forest data directory
+ */
+void write_forest_segment(char *file_name,int *forests,int count)
+{
+    int i;
+    FILE *fp;
+    double *min = xmalloc(dimensions * sizeof(double));
+    double *step = xmalloc(dimensions * sizeof(double));
+
+    binary_file_name = file_name;
+    block_len = 0;
+
+    fp = xfopen(file_name,"w",'b');
+
+    write_header(fp);
+
+    for(i = 0;i < count;i++)
+    {
+        make_forest_block(forests[i],min,step);
+        write_block(fp,BLOCK_FOREST);
+    }
+
+    write_block(fp,BLOCK_END);
+
+    if(ferror(fp) || xfclose(fp) != 0) panic("Error while saving forest data to file",file_name,"");
+
+    free(min);
+    free(step);
+}
+
+/* read forests written by write_forest_segment and add them to forest table, returns the number of forests read
+ */
+int read_forest_segment(char *file_name)
+{
+    FILE *fp;
+    uint32_t type;
+    int count = 0;
+    int encoding = save_encoding;
+
+    binary_file_name = file_name;
+    binary_delta = 0;
+
+    fp = xfopen(file_name,"r",'b');
+
+    read_header(fp);
+    save_encoding = encoding;      // encoding is taken from the index
+
+    while((type = read_block(fp)) != BLOCK_END)
+    {
+        if(type == BLOCK_FOREST)
+        {
+            reserve_forest();
+            read_forest_block(forest_count);
+            add_forest_hash(forest_count,forest[forest_count].category);
+            forest_count++;
+            count++;
+        }
+    }
+
+    xfclose(fp);
+
+    return count;
+}
@@ -27,27 +27,32 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <time.h>
+#ifdef HAVE_GLOB_H
+#include <glob.h>
+#endif
 
 /* Global data */
-int dim_idx[DIM_MAX];          // final table of dimension indices to be used. Index refers to input line field index
+int *dim_idx = NULL;           // final table of dimension indices to be used. Index refers to input line field index
+int dim_max = 0;               // maximum number of input fields and dimensions, size of the tables indexed by field or dimension
 int dimensions = 0;            // dimensions in current setup
+unsigned char *column_role = NULL;  // role of each input field as COLUMN_* bits, set by init_dims
 
-int text_idx[DIM_MAX];         // table of dimension indices having text based input values. Texts are mapped to hash values using hash().
+int *text_idx = NULL;          // table of dimension indices having text based input values. Texts are mapped to hash values using hash().
 int text_idx_count = 0;        // number of text based input values
 
-int ignore_idx[DIM_MAX];
+int *ignore_idx = NULL;
 int ignore_idx_count = 0;
 
-int include_idx[DIM_MAX];
+int *include_idx = NULL;
 int include_idx_count = 0;
 
-int category_idx[DIM_MAX];      // final table of category indices to be used. Index refers to input line field index
+int *category_idx = NULL;       // final table of category indices to be used. Index refers to input line field index
 int category_idx_count  = 0;             // number of category fields
 
-int label_idx[DIM_MAX];         // final table of label indices to be used. Index refers to input line field index
+int *label_idx = NULL;          // final table of label indices to be used. Index refers to input line field index
 int label_idx_count = 0;                 // number of labels fields
 
-int score_idx[DIM_MAX];        // table of dimensions indices which must have high score along total score. If none if these dims. dooes not have high score then the data is not outlier
+int *score_idx = NULL;         // table of dimensions indices which must have high score along total score. If none if these dims. dooes not have high score then the data is not outlier
 int score_idx_count = 0;
 
 char *cat_filter[FILTER_MAX];  // Category filters
@@ -71,15 +76,23 @@ int unique_samples = 0;           // accept only unique samples, in some cases t
 char *printf_format = "";       // User given printf format for dimension and average values
 char list_separator = ',';         // seprator for dimension and average values in output
 int n_vector_adjust = 0;        // should n vector to be adjust among data set
+int sparse_fields = 0;          // number of fields in sparse input rows (-x), 0 = input is not sparse
+int save_format = 0;            // format of saved forest data (-W), 0 = format of the forest data read or JSON
+int save_encoding = ENCODING_DOUBLE;   // sample encoding in binary forest data
+int delta_save = 0;             // write only changed forests to delta file when saving with -z (-Z)
 int aggregate = 0;              // should data values to be aggregated when adding new data to forest
 int scale_score = 1;               // should outlier scores be scaled between foretsts, scaled score is between 0..1
 int percentage_score = 0;          // outlier score is based on training data distribution, score is the largest score of the x% set of samples having the smallest score
 int nearest = 1;                // the shortest distance of analyzed point to nearest sample is calulated in leaf nodes. 
 int analyze_sampling_count = 0;    // number of lines / forest after sampling of analyzed lines is started, 0 = sampling disabled
+int analyze_window = 0;            // number of rows scored grouped by forest, 0 = rows are scored one by one
 int debug = 0;                     // If set print processing related info
 double cluster_relative_size = 0.125; // relative distance for samples in the same cluster, must be between 0 and 1
 int dimension_print_width = 25;   // dimension value printing width, used when printing forest info (option -q)
 int ignore_expression_errors = 0; // Ingore data value change expression errors
+int learn_analyze = 0;         // add analyzed rows to forest samples in the same pass
+int category_shard = 0;         // category shard handled by this process (--shard)
+int category_shards = 0;        // number of category shards, 0 = all categories are handled
 
 /* User given strings for dim ranges */
 char *ignore_dims = "";           // which input values are ignored, user given string
@@ -95,7 +108,11 @@ struct forest *forest = NULL;    // forest table
 
 struct forest_hash fhash[HASH_MAX];  // hash table for forest data, speeds search when number of forests is high
 
-static char short_opts[] = "o:hVd:I:t:s:f:l:a:p:w:O:r:C:HSL:U:c:F:T::i:u::m:e:M::D:N::AX:qy::Ekg:Pv:R:z:=j:G:Q:";
+#define SHARD_OPTION 256     // long option only, no free option letters left
+#define RESULTS_OPTION 257
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)   // stdio buffer of result output
+
+static char short_opts[] = "o:hVd:I:t:s:f:l:a:p:w:O:r:C:HSL:U:c:F:T::i:u::m:e:M::D:N::AX:qy::Ekg:Pv:R:z:=j:G:Q:n:YbBx:K:W:ZJ:";
 
 #ifdef HAVE_GETOPT_LONG
 static struct option long_opts[] =
@@ -144,6 +161,17 @@ static struct option long_opts[] =
   {"print-dimension", 1, 0, 'j'},
   {"score-dims", 1, 0, 'G'},
   {"expression", 1, 0, 'Q'},
+  {"threads", 1, 0, 'n'},
+  {"unordered", 0, 0, 'Y'},
+  {"learn-analyze", 0, 0, 'b'},
+  {"column-cache", 0, 0, 'B'},
+  {"sparse", 1, 0, 'x'},
+  {"projection", 1, 0, 'K'},
+  {"save-format", 1, 0, 'W'},
+  {"delta", 0, 0, 'Z'},
+  {"merge", 1, 0, 'J'},
+  {"shard", 1, 0, SHARD_OPTION},
+  {"results", 1, 0, RESULTS_OPTION},
   {NULL, 0, NULL, 0}
 };
 #endif
@@ -164,7 +192,7 @@ Options:\n\
   -s, --samples INTEGER       number of samples/tree. Default is 256\n\
   -f, --input-separator CHAR  input file field separator. Default is comma\n\
   -l, --learn FILE            file to used for training \n\
-  -a, --analyze FILE          file to analyze\n\
+  -a, --analyze FILE          file to analyze, FILE can be a glob pattern. Option can be given several times\n\
   -c, --categorize FILE       file to categorize\n\
   -p, --print STRING          outlier printing format\n\
   -j, --print-dimension STRING print format format for printing directive %m, prints joined dimension values\n\
@@ -201,6 +229,17 @@ Options:\n\
   -v, --average STRING        print average info for each forest after analysis using STRING as print format\n\
   -R, --reset-forest STRING   remove all samples for a forest read using option -r and having forest string STRING\n\
   -Q, --expression STRING     replace input data value using an expression in STRING, if STRING starts with hyphen, then the expression is removed\n\
+  -n, --threads INTEGER       number of threads to be used in scoring and analysis, default is 1\n\
+  -Y, --unordered             when analyzing with several threads, print results in completion order instead of input order\n\
+  -b, --learn-analyze         add rows of the analyzed files to forest samples after they are analyzed, input is read only once\n\
+  -B, --column-cache          read CSV input files using columnar binary caches (FILE.cbin), a cache is written if it is missing or older than FILE\n\
+  -x, --sparse INTEGER        input rows are sparse, fields INDEX:VALUE set field INDEX of rows having INTEGER fields, other fields are zero\n\
+  -K, --projection INTEGER    project dimension attributes to INTEGER dimensions using a random projection, the projection is saved in forest data\n\
+  -W, --save-format FORMAT    format of forest data saved with -w or -z: json, csv, binary, binary32 or binary16\n\
+  -Z, --delta                 when saving with -z, append only the changed forests to delta file FILE.delta\n\
+  -J, --merge FILE            merge forest data from FILE to forest data read with -r or -z\n\
+      --shard I/N             handle only the categories in category shard I (0...N-1) of N shards\n\
+      --results FORMAT        write outlier and categorized rows as text (-p), ndjson or binary, FORMAT,attributes adds attribute scores\n\
 ");
   printf ("\nSend bug reports to %s\n", PACKAGE_BUGREPORT);
   exit (status);
@@ -293,6 +332,26 @@ print_version()
 }
 
 
+/* Raise the maximum number of input fields and dimensions to n, tables indexed by field or dimension are grown.
+ * Maximum is DIM_MAX unless sparse input (-x) or forest data has more fields.
+ */
+void set_dim_max(int n)
+{
+    if(n <= dim_max) return;
+
+    dim_idx = xrealloc(dim_idx,n * sizeof(int));
+    text_idx = xrealloc(text_idx,n * sizeof(int));
+    ignore_idx = xrealloc(ignore_idx,n * sizeof(int));
+    include_idx = xrealloc(include_idx,n * sizeof(int));
+    category_idx = xrealloc(category_idx,n * sizeof(int));
+    label_idx = xrealloc(label_idx,n * sizeof(int));
+    score_idx = xrealloc(score_idx,n * sizeof(int));
+    column_role = xrealloc(column_role,n * sizeof(column_role[0]));
+    memset(&column_role[dim_max],0,(n - dim_max) * sizeof(column_role[0]));
+
+    dim_max = n;
+}
+
 /* Init forest hash table
  */
 static
@@ -308,6 +367,32 @@ void init_forest_hash()
     }
 }
 
+static char **analyze_files = NULL;     // files to be analyzed
+static int analyze_file_count = 0;
+
+/* add a file to be analyzed, name can be a glob pattern matching several files
+ */
+static
+void add_analyze_file(char *name)
+{
+#ifdef HAVE_GLOB_H
+    glob_t g;
+    size_t i;
+
+    if(strcmp(name,"-") != 0 && glob(name,0,NULL,&g) == 0)
+    {
+        analyze_files = xrealloc(analyze_files,(analyze_file_count + g.gl_pathc) * sizeof(char *));
+
+        for(i = 0;i < g.gl_pathc;i++) analyze_files[analyze_file_count++] = xstrdup(g.gl_pathv[i]);
+
+        globfree(&g);
+        return;
+    }
+#endif
+    analyze_files = xrealloc(analyze_files,(analyze_file_count + 1) * sizeof(char *));
+    analyze_files[analyze_file_count++] = xstrdup(name);
+}
+
 /* parse outlier score
  */
 void parse_user_score(char *score_str)
@@ -362,13 +447,11 @@ main (int argc, char **argv)
     double test_extension_factor = 0.0;    // extents the area from where test sample points are selected
     int score_option_given = 0;
     char *learn_file = NULL;
-    char *analyze_file = NULL;
     char *categorize_file = NULL;
     char *save_file = NULL;
     char *load_file = NULL;
     char *output_file = NULL;
     FILE *learns = NULL;            // file to read learn data
-    FILE *analyzes = NULL;          // file to analyze
     FILE *categorizes = NULL;          // file to categorize
     FILE *loads = NULL;           // file to read saved forest data
     FILE *outs = NULL;           // file to print results
@@ -379,6 +462,8 @@ main (int argc, char **argv)
 
     init_forest_hash();
 
+    set_dim_max(DIM_MAX);
+
     init_low_rgb(0xffff00);         // yellow
     init_high_rgb(0xff0000);        // red
 
@@ -418,7 +503,7 @@ main (int argc, char **argv)
                     learn_file = xstrdup(optarg);
                     break;
                 case 'a':
-                    analyze_file = xstrdup(optarg);
+                    add_analyze_file(optarg);
                     break;
                 case 'c':
                     categorize_file = xstrdup(optarg);
@@ -445,7 +530,7 @@ main (int argc, char **argv)
                     DEBUG("*** Loading forest data from %s\n",load_file);
 
                     /* load now, parameters after this take higher presence */
-                    if(forest_count == 0)
+                    if(forest_count == 0 && !forest_shards_pending)
                     {
                         if (opt == 'z')    // test file readbility
                         {
@@ -457,7 +542,7 @@ main (int argc, char **argv)
 
                         if(loads != NULL)
                         {
-                            fclose(loads);
+                            xfclose(loads);
                             if(!read_forest_file(load_file)) panic("Cannot load forest data from file",load_file,NULL);
                         }
                     } 
@@ -577,24 +662,88 @@ main (int argc, char **argv)
                 case 'Q':
                     parse_expression(optarg);
                     break;
+                case 'n':
+                    thread_count = atoi(optarg);
+                    if(thread_count < 1) panic("Give thread count larger than zero",NULL,NULL);
+                    break;
+                case 'Y':
+                    ordered_output = 0;
+                    break;
+                case 'b':
+                    learn_analyze = 1;
+                    break;
+                case 'B':
+                    column_cache = 1;
+                    break;
+                case 'x':
+                    sparse_fields = atoi(optarg);
+                    if(sparse_fields < 1) panic("Sparse field count is out of range",optarg,NULL);
+                    if(forest_count || forest_shards_pending) panic("Option -x must be given before options -r, -z and -J",NULL,NULL);
+                    set_dim_max(sparse_fields);
+                    break;
+                case 'K':
+                    if(dimensions && projection_dims != atoi(optarg)) panic("Projection cannot be changed for saved forest data",NULL,NULL);
+                    projection_dims = atoi(optarg);
+                    if(projection_dims < 1 || projection_dims > dim_max) panic("Projection dimension count is out of range",optarg,NULL);
+                    break;
+                case 'W':
+                    parse_save_format(optarg);
+                    break;
+                case 'Z':
+                    delta_save = 1;
+                    break;
+                case SHARD_OPTION:
+                    if(sscanf(optarg,"%d/%d",&category_shard,&category_shards) != 2 || category_shards < 1 || category_shard < 0 || category_shard >= category_shards)
+                    {
+                        panic("Invalid category shard, give I/N where I is 0...N-1",optarg,NULL);
+                    }
+                    if(forest_count || forest_shards_pending) panic("Option --shard must be given before options -r, -z and -J",NULL,NULL);
+                    break;
+                case RESULTS_OPTION:
+                    parse_result_format(optarg);
+                    break;
+                case 'J':
+                    if(forest_count == 0 && !forest_shards_pending)    // nothing to merge to, read as with -r
+                    {
+                        if(!read_forest_file(optarg)) panic("Cannot load forest data from file",optarg,NULL);
+                    } else
+                    {
+                        merge_forest_file(optarg);
+                    }
+                    break;
                 default:
                     usage(opt);
                     break;
             }
         }
 
+    if(projection_dims && score_idx_count) panic("Option -G cannot be used with projection (-K)",NULL,NULL);
+
+    if(result_format != RESULT_TEXT && (not_found_format != NULL || average_format != NULL || print_missing))
+    {
+        panic("Options -N, -v and -M cannot be used with structured results (--results)",NULL,NULL);
+    }
+
+    if(learn_analyze)
+    {
+        if(!analyze_file_count) panic("Option -b needs files to be analyzed using option -a",NULL,NULL);
+        if(learn_file != NULL || categorize_file != NULL) panic("Option -b cannot be used with options -l or -c",NULL,NULL);
+    }
+
     srand(time(NULL) + getpid());
 
     init_fast_n_cache();
     init_fast_c_cache();
 
+    init_threads(thread_count);
+
     if(set_locale) setlocale(LC_ALL,"");
 
     samples_total = max_total_samples ?  max_total_samples : tree_count * samples_max;   // total samples count is trees * samples/tree, this can be limited using config MAX_SAMPLES
 
     if(print_string == NULL) print_string = "%s %v";
         
-    if(analyze_file !=  NULL || categorize_file !=  NULL || run_test || make_query || print_sample_s || 
+    if(analyze_file_count || categorize_file !=  NULL || run_test || make_query || print_sample_s || 
        kill_outlier || print_correlation || print_average) make_tree = 1;  // we need tree info
 
     if(output_file != NULL)
@@ -606,17 +755,24 @@ main (int argc, char **argv)
         outs = stdout;
     }
 
-    if(forest_count) 
+    // printed rows are written in large blocks, terminal output is kept line buffered
+    if(!isatty(fileno(outs))) setvbuf(outs,NULL,_IOFBF,OUTPUT_BUFFER_SIZE);
+
+    // operations using all forests read all shards of forest data directory, otherwise shards are read when categories are found
+    if(categorize_file != NULL || run_test || make_query || print_sample_s || kill_outlier || print_correlation ||
+       print_density || print_missing || learn_analyze) read_forest_shards();
+
+    if(forest_count || forest_shards_pending) 
     {
-         train_forest(NULL,1,make_tree); // samples read allready from saved file, run training based on that
+         train_forest(NULL,NULL,1,make_tree); // samples read allready from saved file, run training based on that
     } else
     {
         if(learn_file != NULL) 
         {
             DEBUG("\n***read training data from file %s\n",learn_file);
             learns = xfopen(learn_file,"r",'a');
-            train_forest(learns,1,make_tree); 
-            fclose(learns);
+            train_forest(learns,learn_file,1,make_tree); 
+            xfclose(learns);
             free(learn_file);
             learn_file = NULL;
         } 
@@ -627,50 +783,50 @@ main (int argc, char **argv)
     if(print_density)
     {
         print_sample_density(outs,common_scale);
-        fclose(outs);
+        xfclose(outs);
         exit(0);
     }
 
-    if(analyze_file !=  NULL)
+    if(analyze_file_count || categorize_file != NULL) write_result_header(outs);
+
+    if(analyze_file_count)
     {
-        analyzes = xfopen(analyze_file,"r",'a');
-        analyze(analyzes,outs,not_found_format,average_format);
-        fclose(analyzes);
+        analyze(analyze_file_count,analyze_files,outs,not_found_format,average_format);
         if(print_missing) print_missing_categories(outs,missing_format);
     }
 
     if(categorize_file !=  NULL)
     {
         categorizes = xfopen(categorize_file,"r",'a');
-        categorize(categorizes,score_option_given,outs);
-        fclose(categorizes);
+        categorize(categorizes,categorize_file,score_option_given,outs);
+        xfclose(categorizes);
     }
 
     if(learn_file != NULL) 
     {
         learns = xfopen(learn_file,"r",'a');
-        train_forest(learns,forest_count ? 0 : 1,0); 
-        fclose(learns);
+        train_forest(learns,learn_file,forest_count ? 0 : 1,0); 
+        xfclose(learns);
     } 
 
     if(make_query)
     {
         print_forest_info(outs);
-        fclose(outs);
+        xfclose(outs);
         exit(0);
     }
     
     if(print_sample_s)
     {
         print_sample_scores(outs);
-        fclose(outs);
+        xfclose(outs);
         exit(0);
     }
 
     if(print_correlation)
     {
         print_correlation_coefficent(outs);
-        fclose(outs);
+        xfclose(outs);
         exit(0);
     }
 
@@ -686,7 +842,7 @@ main (int argc, char **argv)
         test2(outs,test_extension_factor,test_range_interval);
     }
 
-    fclose(outs);
+    xfclose(outs);
 
     exit(0) ;
 }
@@ -22,7 +22,7 @@
 
 /* Global constants */
 
-#define DIM_MAX 1024              // maximum number of dimensions attributes
+#define DIM_MAX 1024              // default maximum number of input fields and dimensions, raised at run time by sparse input (-x)
 #define INPUT_LEN_MAX 1048576     // maximum length of input line
 #define SAMPLES_MIN 24            // minimun number of samples for a forest
 #define FILTER_MAX 100            // maximun number of category filters
@@ -40,6 +40,47 @@
 /* cache size for c values (the average depth in an unsuccessful search in a Binary Search Tree) */
 #define FAST_C_SAMPLES 2048
 
+/* Static buffers used while scoring are thread local when threads are available */
+#ifdef HAVE_PTHREAD_H
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
+
+/* Work buffers having an item for each input field or dimension are allocated when first needed and grown
+ * when dim_max is raised. p is the buffer pointer and cap an int having the item count of the buffer
+ */
+#define DIM_BUFFER(p,cap) ((p) = dim_buffer((p),&(cap),sizeof(*(p))))
+
+/* Input field roles in column_role table */
+#define COLUMN_DIMENSION  1       // field is a dimension attribute
+#define COLUMN_TEXT       2       // field is hashed as text
+#define COLUMN_CATEGORY   4       // field is part of category string
+#define COLUMN_LABEL      8       // field is part of label string
+#define COLUMN_IGNORED    16      // field is ignored
+#define COLUMN_EXPRESSION 32      // field is replaced using an expression (-Q)
+
+/* Compression formats of files */
+#define COMPRESS_NONE 0
+#define COMPRESS_GZIP 1
+#define COMPRESS_ZSTD 2
+
+/* Forest data file formats (-W) */
+#define FORMAT_JSON   1
+#define FORMAT_CSV    2
+#define FORMAT_BINARY 3
+
+/* Sample encodings in binary forest data */
+#define ENCODING_DOUBLE 0       // 64 bit floating point
+#define ENCODING_FLOAT  1       // 32 bit floating point
+#define ENCODING_Q16    2       // 16 bit integer, scaled between dimension min and max
+#define ENCODING_SPARSE 3       // non zero values as index (u32) and value (f64) pairs, used with sparse input (-x)
+
+/* Result output formats (--results) */
+#define RESULT_TEXT   0         // print string (-p)
+#define RESULT_NDJSON 1         // one JSON object per line
+#define RESULT_BINARY 2         // fixed layout binary records
+
 /* Power of 2 */
 #define POW2(a) ((a)*(a))
 
@@ -49,16 +90,27 @@
 
 struct sample
 {
-    double *dimension;             // dimension array, dynamically reserved
-    double *scaled_dimension;      // scaled dimension array, dynamically reserved
+    double *dimension;             // dimension array, dynamically reserved. NULL for sparse samples
+    union {
+        double *scaled_dimension;  // scaled dimension array, dynamically reserved
+        double *nz_value;          // sparse samples (-x): non zero values followed by their sorted dimension indices
+    };
+    int nz_count;                  // sparse samples: number of non zero values
     int cluster_center_idx;        // Sample cluster center index. Index to samples table X 
 };
 
+/* sorted dimension indices of the non zero values of a sparse sample. Indices are stored after the values
+ * and sparse samples are not scaled, this keeps struct sample small for the dense sample loops
+ */
+#define SAMPLE_NZ_IDX(s) ((int *) &(s)->nz_value[(s)->nz_count])
+
 struct node
 {
     int sample_count;        // number of samples
     int *samples;         // node sample indizes to X array
-    double *n;               // random normal vector having dimensions count of coordinates
+    double *n;               // random normal vector having n_count coordinates
+    int *n_idx;              // dimension indices of n coordinates, NULL if n has all dimensions
+    int n_count;             // number of coordinates in n
     double pdotn;           // calculate p dot n for performance issues
     int left;               // first left node, -1 if not existing
     int rigth;              // first rigth node, -1 if not existing
@@ -88,11 +140,14 @@ struct forest
     double *max;            // learn data max values dimension
     double avg_sample_dist; // Average sample distance in hypercube 
     int scale_range_idx;    // dimension index to range to be used in scaling (-W). Points tomin and max arrays, -1 if no ranges (all attributes have the same value)
+    double *scale_factor;   // sparse samples: scaled value is scale_factor * value + scale_offset, NULL if values are not scaled
+    double *scale_offset;
     double *avg;            // dimension averages
     double *dim_density;    // learn data average attribute distance dimension
     double *summary;        // aggregated values when analysing or categorizing
     int analyzed;           // Is this forest used in analysis 
     time_t last_updated;    // time when the forest data was last updated in save file. Can be used clean up old forests
+    int dirty;              // true if samples or last_updated have been changed after forest data was read, used in delta saves (-Z)
     double percentage_score;   // percentage based score of saved samples
     double min_score;       // Minimum score of all saved samples
     double max_score;       // Maximum score of all saved samples
@@ -101,6 +156,7 @@ struct forest
     int analyzed_rows;      // Number of rows used in analysis
     int high_analyzed_rows; // Number of rows having score higher than avaerage score
     int extra_rows;         // Number of rows read after train file after max number of samples reached
+    long seen_rows;         // Number of rows the samples are taken from, saved in forest data. Used when merging forest data
     struct tree *t;         // Tree table, NULL if not initialized
     int cluster_count;      // Number of cluster in a forest
     size_t cluster_center[CLUSTER_MAX]; // cluster center points, indices to sample array X
@@ -142,14 +198,16 @@ struct data_value_formula
 #define DEBUG_ARRAY(count,array) do {int _i; if(debug) for(_i = 0;_i < count;_i++) {DEBUG("%f",array[_i]);DEBUG_SEPARATOR(_i,count);}} while(0)   // print double array values separated by comma
 
 /* Global data */
-extern int dim_idx[];
-extern int ignore_idx[];
-extern int include_idx[];
-extern int category_idx[];
-extern int label_idx[];
-extern int text_idx[];
-extern int score_idx[];
-
+extern int *dim_idx;
+extern unsigned char *column_role;
+extern int *ignore_idx;
+extern int *include_idx;
+extern int *category_idx;
+extern int *label_idx;
+extern int *text_idx;
+extern int *score_idx;
+
+extern int dim_max;               // maximum number of input fields and dimensions
 extern int dimensions;            // dimensions in current setup
 extern int ignore_idx_count;
 extern int include_idx_count;
@@ -178,15 +236,28 @@ extern int unique_samples;
 extern char *printf_format;
 extern char list_separator;
 extern int n_vector_adjust;
+extern int sparse_fields;
+extern int projection_dims;
+extern unsigned int projection_seed;
+extern int projection_input_dims;
+extern int save_format;
+extern int save_encoding;
+extern int delta_save;
+extern int result_format;
 extern int aggregate;
 extern int scale_score;
 extern int nearest;
 extern int percentage_score;
 extern int analyze_sampling_count;
+extern int analyze_window;
 extern int debug;
 extern double cluster_relative_size;
 extern int dimension_print_width;
 extern int ignore_expression_errors;
+extern int thread_count;
+extern int ordered_output;
+extern int learn_analyze;
+extern int column_cache;
 
 
 
@@ -202,6 +273,10 @@ extern char *score_dims;
 
 extern int forest_count;
 extern int forest_cap;
+extern int forest_shards_pending;
+extern int merge_read;
+extern int category_shard;
+extern int category_shards;
 extern struct forest *forest;           // forest table
 
 extern struct forest_hash fhash[];
@@ -216,6 +291,7 @@ void panic(char *,char *,char *);
 void info(char *,char *,char *);
 int parse_dims(char *,int *);
 void parse_user_score(char *);
+void set_dim_max(int);
 
 
 
@@ -224,13 +300,16 @@ VOID *xmalloc (size_t);
 VOID *xcalloc (size_t, size_t);
 VOID *xrealloc (VOID *, size_t);
 char *xstrdup (const char *);
+VOID *dim_buffer(VOID *,int *,size_t);
 FILE * xfopen(char *, char *, char);
 FILE * xfopen_test(char *, char *, char);
+int xfclose(FILE *);
 void print_alloc_debug(void);
 
 
 /* file.c prototypes */
 char *make_csv_line(char **,int,char);
+int parse_input_line(char **,char *);
 int parse_csv_line(char **,int,char *,char);
 void print_forest_info(FILE *);
 void print_sample_density(FILE *,int);
@@ -241,16 +320,22 @@ char * make_separated_string(char *, char);
 
 
 /* learn.c prototypes */
-void train_forest(FILE *,int,int);
+void train_forest(FILE *,char *,int,int);
 double parse_dim_attribute(char *);
 double parse_dim_hash_attribute(char *);
 double dot(double *, double *);
+double node_dot(double *, struct node *);
 double c(int);
 int dim_ok(int,int);
 void add_to_X(struct forest *,double *, int , int);
 void add_category_filter(char *);
+unsigned int category_hash(char *);
+int own_category(char *);
+void free_forest(struct forest *);
+void drop_other_shards(int);
 int search_forest_hash(char *); 
 void add_forest_hash(int, char *);
+void clear_forest_hash();
 void test2(FILE *,double,int);
 void init_fast_n_cache();
 void init_fast_c_cache();
@@ -262,20 +347,33 @@ double v_dist(double *,double *);
 double *scale_dimension(double *,struct forest *);
 void parse_values(double *,char **, int, int);
 int ri(int, int);
-double *sample_dimension(struct sample *);
+double *sample_dimension(struct sample *,struct forest *);
+double *sample_values(struct sample *);
+double sample_value(struct sample *,int);
+double sample_dist_nosqrt(struct sample *,struct sample *);
+void free_sample(struct sample *);
+void add_sparse_to_X(struct forest *,int,int *,double *);
 void set_centroid_tresshold(double);
+void start_learn_pass();
+void learn_row(int,char **,double *);
+void end_learn_pass();
+void train_shard_forests(int);
 
 
 
 
 /* analyze.c prototypes */
-void analyze(FILE *, FILE *,char *,char *);
-void categorize(FILE *, int, FILE *);
+void analyze(int,char **,FILE *,char *,char *);
+void analyze_row(FILE *,char *,int,int,char **,double *,char *,char *);
+void analyze_grouped(FILE *,char *,int,int *,char **,char *,char *);
+void check_first_row(int);
+void categorize(FILE *, char *, int, FILE *);
 void init_dims(int);
 char *make_category_string(int,char **);
 double calculate_score(int ,double *);
 void print_missing_categories(FILE *,char *);
 void print_(FILE *, double, int,int,int,char **,double *,char *,char *);
+double * get_dim_attr_scores(int,double *);
 int check_idx(int ,int , int *);
 void remove_outlier();
 void calculate_average_sample_score(int);
@@ -295,14 +393,113 @@ void init_high_rgb(unsigned int);
 /* save.c prototypes */
 void write_forest_file(char *,time_t);
 int read_forest_file(char *);
+void parse_save_format(char *);
 
 /* json.c prototypes */
 int write_forest_file_json(char *,time_t);
 int read_forest_file_json(char *);
+void write_globals_json(FILE *);
+void read_globals_json(char *,size_t,char *);
+void init_saved_forest(int);
+void json_write_string(FILE *,char *);
+
+/* binary.c prototypes */
+void write_forest_file_binary(char *,time_t);
+int read_forest_file_binary(char *);
+void read_forest_delta(char *,int);
+int write_forest_file_delta(char *,time_t);
+void remove_forest_delta(char *);
+void write_forest_index(char *,int,int,int *);
+int read_forest_index(char *,int **);
+void write_forest_segment(char *,int *,int);
+int read_forest_segment(char *);
+
+/* merge.c prototypes */
+void check_merge_globals(int,char *,char *);
+void merge_forest_file(char *);
+
+/* shard.c prototypes */
+int forest_dir(char *);
+int read_forest_shard(char *);
+void read_forest_shards();
+int read_forest_dir(char *);
+void write_forest_dir(char *,time_t);
+
+/* result.c prototypes */
+void parse_result_format(char *);
+void write_result_header(FILE *);
+void write_result(FILE *,double,int,int,double *);
+
+/* thread.c prototypes */
+struct queue;
+void init_threads(int);
+void run_parallel(int, void (*)(int,void *), void *);
+int parallel_threads();
+void lock_shared();
+void unlock_shared();
+void *start_thread(void *(*)(void *),void *);
+void join_thread(void *);
+struct queue *queue_new(int);
+void queue_push(struct queue *,void *);
+void *queue_pop(struct queue *);
+void queue_free(struct queue *);
+
+/* pipeline.c prototypes */
+struct input;
+int analyze_pipeline(struct input *,char *,FILE *,char *,char *,int *);
+
+/* input.c prototypes */
+struct column_block;
+struct input *input_open(FILE *,char *);
+char *input_next(struct input *);
+size_t input_read(struct input *,void *,size_t);
+int input_row(struct input *,char **);
+int input_columnar(struct input *);
+int input_caching(struct input *);
+int input_block(struct input *,struct column_block *);
+void input_close(struct input *);
+
+/* column.c prototypes */
+struct column_writer;
+int column_magic(char *,size_t);
+size_t column_header_size();
+FILE *column_cache_open(char *);
+struct column_writer *column_writer_open(char *);
+void column_write_row(struct column_writer *,int,char **);
+void column_writer_close(struct column_writer *,int);
+struct column_block *column_block_new();
+void column_block_free(struct column_block *);
+int column_block_read(struct input *,struct column_block *);
+int column_block_rows(struct column_block *);
+int column_block_value_count(struct column_block *,int);
+int column_block_row(struct column_block *,int,char **);
+void column_row_clear();
+int column_number(char **,int,double *);
+char *column_value(char **,int);
+
+/* compress.c prototypes */
+int compress_format(char *);
+FILE *compress_open_read(FILE *,char *);
+FILE *compress_open_write(FILE *,char *);
+int compress_close(FILE *,int *);
+size_t compress_peeked(FILE *,unsigned char *);
+
+/* projection.c prototypes */
+int init_projection(int);
+void project(double *,double *);
+char *projection_string();
+void parse_projection_string(char *);
+
+/* number.c prototypes */
+double parse_double(const char *,char **);
+double round_decimals(double,int);
+int shortest_double(char *,double);
+int format_fixed(char *,double,int);
 
 /* expr.c prototypes */
 void parse_expression(char *);
 char *evaluate_data_expression(int , int ,char **);
+double evaluate_data_value(int , int ,char **);
 
 
 
@@ -0,0 +1,770 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Columnar binary input
+ *
+ * Input rows are stored in blocks of at most COLUMN_BLOCK_ROWS rows. Each column of a block is stored either as
+ * doubles with the format reproducing the original text or as dictionary encoded strings.
+ * Reading a block needs no tokenizing and numeric attributes are given to parse_values without parsing.
+ *
+ * File layout (native byte order, all parts are padded to 8 bytes):
+ *
+ * header:      struct column_header
+ * block:       struct column_block_header
+ *              uint16 value count for each row
+ *              for each column: struct column_part followed by
+ *                  doubles for each row (STORE_SHORTEST, STORE_FIXED) or
+ *                  uint32 dictionary index for each row and NUL terminated dictionary strings (STORE_TEXT)
+ *
+ * A cache file FILE.cbin is written when CSV file FILE is read and option -B is given. The cache is used
+ * instead of FILE if it is newer than FILE and it was written from a file of the same size using the same separator.
+ */
+#include "ceif.h"
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+int column_cache = 0;            // read CSV files through columnar caches
+
+#define COLUMN_MAGIC "CEIFCOL1"
+#define COLUMN_ORDER 0x01020304  // byte order mark
+#define COLUMN_BLOCK_ROWS 1024   // max rows in a block
+#define COLUMN_CACHE_SUFFIX ".cbin"
+#define VALUE_TEXT_MAX 32        // max length of a number text stored as double
+
+#define STORE_SHORTEST 1        // doubles, text is the shortest "%.*g" representation
+#define STORE_FIXED 2           // doubles, text is "%.*f" with part decimals
+#define STORE_TEXT 3            // dictionary encoded strings
+
+#define PAD8(n) (((n) + 7) & ~(size_t) 7)
+
+struct column_header
+{
+    char magic[8];
+    uint32_t order;
+    char separator;              // input separator used in splitting the source file
+    char reserved[3];
+    uint64_t source_size;        // size of the source CSV file, 0 if not known
+};
+
+struct column_block_header
+{
+    uint32_t rows;
+    uint32_t columns;            // max value count in block
+    uint64_t size;               // bytes after this header
+};
+
+struct column_part
+{
+    uint32_t type;
+    uint32_t decimals;           // decimals for STORE_FIXED, dictionary size for STORE_TEXT
+    uint64_t size;               // bytes after this header
+};
+
+/* Block columns while reading
+ */
+struct read_column
+{
+    int type;
+    int decimals;
+    double *number;
+    uint32_t *id;
+    char **dict;
+    uint32_t dict_count;
+    uint32_t dict_cap;
+};
+
+struct column_block
+{
+    int rows;
+    int columns;
+    char *data;                  // block data after block header
+    size_t data_cap;
+    uint16_t *value_count;
+    struct read_column *col;
+    int col_cap;                 // columns allocated in col
+};
+
+/* Block columns while writing, strings are offsets to writer text
+ */
+struct write_column
+{
+    double *number;
+    uint32_t *text;
+    int shortest;                // all values can be stored as STORE_SHORTEST
+    int fixed;                   // all values can be stored as STORE_FIXED
+    int decimals;                // decimals in STORE_FIXED
+    uint32_t *id;                // dictionary index of each row
+    uint32_t *dict;              // dictionary entries
+    uint32_t dict_count;
+    size_t dict_bytes;
+};
+
+struct column_writer
+{
+    FILE *fp;
+    char *file_name;             // final name of the cache
+    char *tmp_name;              // cache is written to tmp_name and renamed after all rows are written
+    int rows;
+    int columns;
+    uint16_t value_count[COLUMN_BLOCK_ROWS];
+    struct write_column *col;
+    int col_cap;                 // columns allocated in col
+    char *text;
+    size_t text_len;
+    size_t text_cap;
+    uint32_t *hash;              // dictionary hash table used in writing a block
+};
+
+/* Numeric values of the current columnar row, one set for each thread
+ * row_values is the value table of the row, numbers are given only for the same table
+ */
+static THREAD_LOCAL char **row_values;
+static THREAD_LOCAL double *row_number;
+static THREAD_LOCAL unsigned char *row_format;    // STORE_* type of value
+static THREAD_LOCAL unsigned char *row_decimals;
+static THREAD_LOCAL char (*row_text)[VALUE_TEXT_MAX];
+static THREAD_LOCAL int row_cap = 0;
+
+/* grow column table of a block or writer to have columns items, new items are zeroed
+ */
+static
+void *grow_columns(void *col,int *cap,int columns,size_t size)
+{
+    if(columns > *cap)
+    {
+        col = xrealloc(col,columns * size);
+        memset((char *) col + *cap * size,0,(columns - *cap) * size);
+        *cap = columns;
+    }
+    return col;
+}
+
+/* write text of a number as it was in the source file
+ */
+static
+void number_text(char *buf,int type,int decimals,double d)
+{
+    if(type == STORE_FIXED)
+    {
+        snprintf(buf,VALUE_TEXT_MAX,"%.*f",decimals,d);
+    } else
+    {
+        shortest_double(buf,d);
+    }
+}
+
+/* check if source file has a header written with the same separator and source file size
+ */
+static
+int check_header(struct column_header *h,uint64_t source_size)
+{
+    if(memcmp(h->magic,COLUMN_MAGIC,sizeof(h->magic)) != 0 || h->order != COLUMN_ORDER) return 0;
+    if(h->separator != input_separator || h->source_size != source_size) return 0;
+    return 1;
+}
+
+/* check if data begins with columnar file header
+ * returns 1 if it does, 0 if it does not and -1 if more data is needed to know it
+ */
+int column_magic(char *data,size_t len)
+{
+    if(memcmp(data,COLUMN_MAGIC,len < 8 ? len : 8) != 0) return 0;
+    return len >= sizeof(struct column_header) ? 1 : -1;
+}
+
+/* return size of the file header
+ */
+size_t column_header_size()
+{
+    return sizeof(struct column_header);
+}
+
+/* open a valid cache for file name, returns NULL if there is no usable cache
+ */
+FILE *column_cache_open(char *name)
+{
+    struct stat st,cst;
+    struct column_header h;
+    char *cache_name;
+    FILE *fp;
+
+    if(stat(name,&st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    cache_name = xmalloc(strlen(name) + strlen(COLUMN_CACHE_SUFFIX) + 1);
+    strcpy(cache_name,name);
+    strcat(cache_name,COLUMN_CACHE_SUFFIX);
+
+    fp = NULL;
+
+    if(stat(cache_name,&cst) == 0 &&
+       (cst.st_mtim.tv_sec > st.st_mtim.tv_sec || (cst.st_mtim.tv_sec == st.st_mtim.tv_sec && cst.st_mtim.tv_nsec >= st.st_mtim.tv_nsec)))
+    {
+        fp = xfopen_test(cache_name,"r",'b');
+
+        if(fp != NULL && (fread(&h,sizeof(h),1,fp) != 1 || !check_header(&h,(uint64_t) st.st_size) || fseek(fp,0,SEEK_SET) != 0))
+        {
+            xfclose(fp);
+            fp = NULL;
+        }
+    }
+
+    if(fp != NULL) DEBUG("Reading %s using cache %s\n",name,cache_name);
+
+    free(cache_name);
+
+    return fp;
+}
+
+/* start writing a cache for file name, returns NULL if the cache cannot be written
+ */
+struct column_writer *column_writer_open(char *name)
+{
+    struct column_writer *w;
+    struct column_header h;
+    struct stat st;
+    int fd;
+
+    if(stat(name,&st) != 0 || !S_ISREG(st.st_mode)) return NULL;
+
+    w = xcalloc(1,sizeof(struct column_writer));
+
+    w->file_name = xmalloc(strlen(name) + strlen(COLUMN_CACHE_SUFFIX) + 1);
+    strcpy(w->file_name,name);
+    strcat(w->file_name,COLUMN_CACHE_SUFFIX);
+
+    w->tmp_name = xmalloc(strlen(w->file_name) + 8);
+    strcpy(w->tmp_name,w->file_name);
+    strcat(w->tmp_name,".XXXXXX");
+
+    if((fd = mkstemp(w->tmp_name)) == -1 || (w->fp = fdopen(fd,"w")) == NULL)
+    {
+        info("Cannot write cache file",w->file_name,strerror(errno));
+        if(fd != -1)
+        {
+            close(fd);
+            unlink(w->tmp_name);
+        }
+        free(w->file_name);
+        free(w->tmp_name);
+        free(w);
+        return NULL;
+    }
+
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,COLUMN_MAGIC,sizeof(h.magic));
+    h.order = COLUMN_ORDER;
+    h.separator = input_separator;
+    h.source_size = st.st_size;
+
+    if(fwrite(&h,sizeof(h),1,w->fp) != 1) panic("Error in writing cache file",w->tmp_name,strerror(errno));
+
+    w->hash = xmalloc(2 * COLUMN_BLOCK_ROWS * sizeof(uint32_t));
+
+    DEBUG("Writing cache %s\n",w->file_name);
+
+    return w;
+}
+
+/* write len bytes of data and padding to the next 8 byte boundary, if data is NULL only the padding is written
+ */
+static
+void write_data(struct column_writer *w,void *data,size_t len)
+{
+    static const char zero[8];
+
+    if(data != NULL && len && fwrite(data,1,len,w->fp) != len) panic("Error in writing cache file",w->tmp_name,strerror(errno));
+    if(PAD8(len) > len && fwrite(zero,1,PAD8(len) - len,w->fp) != PAD8(len) - len) panic("Error in writing cache file",w->tmp_name,strerror(errno));
+}
+
+static
+uint32_t hash_string(char *s)
+{
+    uint32_t h = 2166136261U;
+
+    while(*s) h = (h ^ (unsigned char) *s++) * 16777619U;
+
+    return h;
+}
+
+/* build dictionary of a text column, ids of rows are written to col->id
+ */
+static
+void build_dictionary(struct column_writer *w,int c)
+{
+    struct write_column *col = &w->col[c];
+    uint32_t h,mask = 2 * COLUMN_BLOCK_ROWS - 1;
+    char *s;
+    int i;
+
+    memset(w->hash,0xff,2 * COLUMN_BLOCK_ROWS * sizeof(uint32_t));
+
+    col->dict_count = 0;
+    col->dict_bytes = 0;
+
+    for(i = 0;i < w->rows;i++)
+    {
+        if(c >= w->value_count[i])
+        {
+            col->id[i] = 0;
+            continue;
+        }
+
+        s = &w->text[col->text[i]];
+        h = hash_string(s) & mask;
+
+        while(w->hash[h] != UINT32_MAX && strcmp(&w->text[col->dict[w->hash[h]]],s) != 0) h = (h + 1) & mask;
+
+        if(w->hash[h] == UINT32_MAX)
+        {
+            w->hash[h] = col->dict_count;
+            col->dict[col->dict_count++] = col->text[i];
+            col->dict_bytes += strlen(s) + 1;
+        }
+
+        col->id[i] = w->hash[h];
+    }
+}
+
+/* write collected rows as a block
+ */
+static
+void flush_block(struct column_writer *w)
+{
+    struct column_block_header bh;
+    struct column_part part;
+    struct write_column *col;
+    char *s;
+    int i,c;
+
+    if(!w->rows) return;
+
+    bh.rows = w->rows;
+    bh.columns = w->columns;
+    bh.size = PAD8(w->rows * sizeof(uint16_t));
+
+    for(c = 0;c < w->columns;c++)
+    {
+        col = &w->col[c];
+        bh.size += sizeof(part);
+
+        if(col->fixed || col->shortest)
+        {
+            for(i = 0;i < w->rows;i++) if(c >= w->value_count[i]) col->number[i] = 0.0;
+            bh.size += w->rows * sizeof(double);
+        } else
+        {
+            build_dictionary(w,c);
+            bh.size += PAD8(w->rows * sizeof(uint32_t)) + PAD8(col->dict_bytes);
+        }
+    }
+
+    write_data(w,&bh,sizeof(bh));
+    write_data(w,w->value_count,w->rows * sizeof(uint16_t));
+
+    for(c = 0;c < w->columns;c++)
+    {
+        col = &w->col[c];
+
+        if(col->fixed || col->shortest)
+        {
+            part.type = col->fixed ? STORE_FIXED : STORE_SHORTEST;
+            part.decimals = col->fixed ? col->decimals : 0;
+            part.size = w->rows * sizeof(double);
+
+            write_data(w,&part,sizeof(part));
+            write_data(w,col->number,w->rows * sizeof(double));
+        } else
+        {
+            part.type = STORE_TEXT;
+            part.decimals = col->dict_count;
+            part.size = PAD8(w->rows * sizeof(uint32_t)) + PAD8(col->dict_bytes);
+
+            write_data(w,&part,sizeof(part));
+            write_data(w,col->id,w->rows * sizeof(uint32_t));
+
+            for(i = 0;i < col->dict_count;i++)
+            {
+                s = &w->text[col->dict[i]];
+                if(fwrite(s,1,strlen(s) + 1,w->fp) != strlen(s) + 1) panic("Error in writing cache file",w->tmp_name,strerror(errno));
+            }
+
+            write_data(w,NULL,col->dict_bytes);    // padding only
+        }
+    }
+
+    w->rows = 0;
+    w->columns = 0;
+    w->text_len = 0;
+}
+
+/* return the number of decimals in a number text, -1 if the text is not a plain decimal number
+ */
+static
+int text_decimals(char *s)
+{
+    char *p = s;
+
+    if(*p == '-') p++;
+    if(!(*p >= '0' && *p <= '9')) return -1;
+    while(*p >= '0' && *p <= '9') p++;
+    if(*p == '\000') return 0;
+    if(*p != '.') return -1;
+    s = ++p;
+    while(*p >= '0' && *p <= '9') p++;
+    if(*p != '\000') return -1;
+
+    return p - s;
+}
+
+/* add one input row to cache
+ */
+void column_write_row(struct column_writer *w,int value_count,char **values)
+{
+    struct write_column *col;
+    char buf[VALUE_TEXT_MAX];
+    char *end;
+    size_t len;
+    double d;
+    int c,decimals;
+
+    w->col = grow_columns(w->col,&w->col_cap,value_count,sizeof(struct write_column));
+
+    for(c = 0;c < value_count;c++)
+    {
+        col = &w->col[c];
+
+        if(col->number == NULL)
+        {
+            col->number = xmalloc(COLUMN_BLOCK_ROWS * sizeof(double));
+            col->text = xmalloc(COLUMN_BLOCK_ROWS * sizeof(uint32_t));
+            col->id = xmalloc(COLUMN_BLOCK_ROWS * sizeof(uint32_t));
+            col->dict = xmalloc(COLUMN_BLOCK_ROWS * sizeof(uint32_t));
+        }
+
+        if(c >= w->columns)           // new column in this block
+        {
+            col->shortest = 1;
+            col->fixed = 1;
+            col->decimals = -1;
+        }
+
+        len = strlen(values[c]) + 1;
+
+        if(w->text_len + len > w->text_cap)
+        {
+            w->text_cap = 2 * (w->text_len + len);
+            w->text = xrealloc(w->text,w->text_cap);
+        }
+
+        memcpy(&w->text[w->text_len],values[c],len);
+        col->text[w->rows] = w->text_len;
+        w->text_len += len;
+
+        if(!col->fixed && !col->shortest) continue;
+
+        d = parse_double(values[c],&end);
+
+        if(end == values[c] || *end != '\000' || len > VALUE_TEXT_MAX)
+        {
+            col->fixed = col->shortest = 0;
+            continue;
+        }
+
+        col->number[w->rows] = d;
+
+        if(col->shortest)
+        {
+            shortest_double(buf,d);
+            if(strcmp(buf,values[c]) != 0) col->shortest = 0;
+        }
+
+        if(col->fixed)
+        {
+            decimals = text_decimals(values[c]);
+
+            if(col->decimals == -1) col->decimals = decimals;
+
+            if(decimals == -1 || decimals != col->decimals)
+            {
+                col->fixed = 0;
+            } else
+            {
+                snprintf(buf,sizeof(buf),"%.*f",decimals,d);
+                if(strcmp(buf,values[c]) != 0) col->fixed = 0;
+            }
+        }
+    }
+
+    // columns which this row does not have keep their state
+    if(value_count > w->columns) w->columns = value_count;
+    w->value_count[w->rows++] = value_count;
+
+    if(w->rows == COLUMN_BLOCK_ROWS || w->text_len > 64 * INPUT_LEN_MAX) flush_block(w);
+}
+
+/* finish writing cache, cache is taken into use if complete is true
+ */
+void column_writer_close(struct column_writer *w,int complete)
+{
+    int c;
+
+    if(complete) flush_block(w);
+
+    if(fclose(w->fp) != 0) panic("Error in writing cache file",w->tmp_name,strerror(errno));
+
+    if(complete)
+    {
+        if(rename(w->tmp_name,w->file_name) != 0) info("Cannot write cache file",w->file_name,strerror(errno));
+    } else
+    {
+        unlink(w->tmp_name);
+    }
+
+    for(c = 0;c < w->col_cap;c++)
+    {
+        if(w->col[c].number != NULL)
+        {
+            free(w->col[c].number);
+            free(w->col[c].text);
+            free(w->col[c].id);
+            free(w->col[c].dict);
+        }
+    }
+
+    if(w->col != NULL) free(w->col);
+    if(w->text != NULL) free(w->text);
+    free(w->hash);
+    free(w->file_name);
+    free(w->tmp_name);
+    free(w);
+}
+
+/* new empty block for reading
+ */
+struct column_block *column_block_new()
+{
+    return xcalloc(1,sizeof(struct column_block));
+}
+
+void column_block_free(struct column_block *b)
+{
+    int c;
+
+    for(c = 0;c < b->col_cap;c++) if(b->col[c].dict != NULL) free(b->col[c].dict);
+    if(b->col != NULL) free(b->col);
+    if(b->data != NULL) free(b->data);
+    free(b);
+}
+
+static
+void corrupted(char *what)
+{
+    panic("Corrupted columnar input",what,NULL);
+}
+
+/* read next block from input, returns the number of rows in block, 0 at end of input
+ */
+int column_block_read(struct input *in,struct column_block *b)
+{
+    struct column_block_header bh;
+    struct column_part part;
+    struct read_column *col;
+    size_t pos,n;
+    uint32_t i;
+    int c;
+    char *p,*end;
+
+    n = input_read(in,&bh,sizeof(bh));
+
+    if(n == 0) return 0;
+    if(n != sizeof(bh)) corrupted("block header");
+    if(bh.rows == 0 || bh.rows > COLUMN_BLOCK_ROWS || bh.columns > (uint32_t) dim_max || bh.size < PAD8(bh.rows * sizeof(uint16_t))) corrupted("block header");
+
+    if(bh.size > b->data_cap)
+    {
+        b->data_cap = bh.size;
+        if(b->data != NULL) free(b->data);
+        b->data = xmalloc(b->data_cap);    // malloc memory is aligned for doubles
+    }
+
+    if(input_read(in,b->data,bh.size) != bh.size) corrupted("truncated block");
+
+    b->rows = bh.rows;
+    b->columns = bh.columns;
+    b->col = grow_columns(b->col,&b->col_cap,b->columns,sizeof(struct read_column));
+    b->value_count = (uint16_t *) b->data;
+
+    for(i = 0;i < b->rows;i++) if(b->value_count[i] > b->columns) corrupted("value count");
+
+    pos = PAD8(b->rows * sizeof(uint16_t));
+
+    for(c = 0;c < b->columns;c++)
+    {
+        col = &b->col[c];
+
+        if(pos + sizeof(part) > bh.size) corrupted("column header");
+        memcpy(&part,&b->data[pos],sizeof(part));
+        pos += sizeof(part);
+
+        if(part.size > bh.size - pos) corrupted("column size");
+
+        col->type = part.type;
+        col->decimals = part.decimals;
+
+        switch(part.type)
+        {
+            case STORE_SHORTEST:
+            case STORE_FIXED:
+                if(part.size != b->rows * sizeof(double)) corrupted("number column");
+                col->number = (double *) &b->data[pos];
+                break;
+            case STORE_TEXT:
+                if(part.size < PAD8(b->rows * sizeof(uint32_t))) corrupted("text column");
+                col->id = (uint32_t *) &b->data[pos];
+                col->dict_count = part.decimals;
+
+                if(col->dict_count > col->dict_cap)
+                {
+                    col->dict_cap = col->dict_count;
+                    col->dict = xrealloc(col->dict,col->dict_cap * sizeof(char *));
+                }
+
+                p = &b->data[pos + PAD8(b->rows * sizeof(uint32_t))];
+                end = &b->data[pos + part.size];
+
+                for(i = 0;i < col->dict_count;i++)
+                {
+                    col->dict[i] = p;
+                    while(p < end && *p) p++;
+                    if(p == end) corrupted("dictionary");
+                    p++;
+                }
+
+                for(i = 0;i < b->rows;i++) if(col->id[i] >= col->dict_count && c < b->value_count[i]) corrupted("dictionary index");
+                break;
+            default:
+                corrupted("column type");
+                break;
+        }
+
+        pos += part.size;
+    }
+
+    return b->rows;
+}
+
+int column_block_rows(struct column_block *b)
+{
+    return b->rows;
+}
+
+/* return value count of a row of block
+ */
+int column_block_value_count(struct column_block *b,int row)
+{
+    return b->value_count[row];
+}
+
+/* set values of a row of block, returns the number of values
+ * Numeric values are made available to parse_values (see column_numbers).
+ * Text for numeric values is made only for fields which are used as text, text for other
+ * fields is made when needed by column_value
+ */
+int column_block_row(struct column_block *b,int row,char **values)
+{
+    struct read_column *col;
+    int c,value_count = b->value_count[row];
+    int all_text = formulas > 0;     // expressions can refer to any field
+
+    row_values = values;
+
+    if(value_count > row_cap)
+    {
+        row_cap = value_count;
+        row_number = xrealloc(row_number,row_cap * sizeof(double));
+        row_format = xrealloc(row_format,row_cap);
+        row_decimals = xrealloc(row_decimals,row_cap);
+        row_text = xrealloc(row_text,row_cap * sizeof(*row_text));
+    }
+
+    for(c = 0;c < value_count;c++)
+    {
+        col = &b->col[c];
+
+        row_format[c] = col->type;
+
+        if(col->type == STORE_TEXT)
+        {
+            values[c] = col->dict[col->id[row]];
+        } else
+        {
+            row_number[c] = col->number[row];
+            row_decimals[c] = col->decimals;
+
+            if(all_text || (column_role[c] != COLUMN_DIMENSION && column_role[c] != COLUMN_IGNORED))
+            {
+                number_text(row_text[c],col->type,col->decimals,row_number[c]);
+                values[c] = row_text[c];
+            } else
+            {
+                values[c] = NULL;
+            }
+        }
+    }
+
+    return value_count;
+}
+
+/* forget the current columnar row of this thread, called when input changes
+ */
+void column_row_clear()
+{
+    row_values = NULL;
+}
+
+/* return numeric value of field idx of a columnar row
+ * returns false if values is not the current columnar row or the field is not numeric
+ */
+int column_number(char **values,int idx,double *d)
+{
+    if(values != row_values || row_format[idx] == STORE_TEXT) return 0;
+
+    *d = row_number[idx];
+
+    return 1;
+}
+
+/* return text of field idx, text of numeric fields of columnar rows is made here if it is not made yet
+ */
+char *column_value(char **values,int idx)
+{
+    if(values[idx] == NULL && values == row_values)
+    {
+        number_text(row_text[idx],row_format[idx],row_decimals[idx],row_number[idx]);
+        values[idx] = row_text[idx];
+    }
+
+    return values[idx] != NULL ? values[idx] : "";
+}
@@ -0,0 +1,588 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Compressed files
+ *
+ * Files opened with xfopen can be gzip or zstd compressed. Compressed input is detected using the magic bytes
+ * in the beginning of the data. Magic bytes of a regular file are peeked before the file is read. Magic bytes of
+ * other input (pipes, stdin) are read when the file is opened, if the input is not compressed the caller reads
+ * the original stream and gets the bytes read using compress_peeked. File name extension (.gz, .zst) is used
+ * for non-regular files having one. Output is compressed if the file name has a compression extension.
+ *
+ * For compressed data the caller gets one end of a pipe as a normal stream. A separate thread moves the data
+ * between the pipe and the compressed file, decompression or compression is done in parallel with parsing and scoring.
+ */
+#include "ceif.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_ZLIB)
+#include <zlib.h>
+#define USE_ZLIB
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_ZSTD)
+#include <zstd.h>
+#define USE_ZSTD
+#endif
+
+#define COMPRESS_BUF 262144      // size of the buffers used in compression threads
+#define COMPRESS_DETECT -1       // format of non-regular input is detected using the first bytes read
+#define PIPE_SIZE 1048576        // pipe buffer size asked from the system
+
+static unsigned char gzip_magic[] = {0x1f,0x8b};
+static unsigned char zstd_magic[] = {0x28,0xb5,0x2f,0xfd};
+
+/* bytes read from not compressed non-regular input when detecting the format, see compress_peeked
+ */
+struct peeked_input
+{
+    FILE *fp;
+    unsigned char data[4];
+    size_t len;
+    struct peeked_input *next;
+};
+
+static struct peeked_input *peeked = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t peeked_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PEEKED_LOCK() pthread_mutex_lock(&peeked_lock)
+#define PEEKED_UNLOCK() pthread_mutex_unlock(&peeked_lock)
+#else
+#define PEEKED_LOCK()
+#define PEEKED_UNLOCK()
+#endif
+
+/* Return the compression format of a file name using the extension
+ */
+int compress_format(char *name)
+{
+    size_t len = strlen(name);
+
+    if(len > 3 && strcmp(&name[len - 3],".gz") == 0) return COMPRESS_GZIP;
+    if(len > 4 && strcmp(&name[len - 4],".zst") == 0) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+/* Return the compression format of n first bytes of data
+ */
+static
+int compress_format_magic(unsigned char *magic,size_t n)
+{
+    if(n >= sizeof(gzip_magic) && memcmp(magic,gzip_magic,sizeof(gzip_magic)) == 0) return COMPRESS_GZIP;
+    if(n >= sizeof(zstd_magic) && memcmp(magic,zstd_magic,sizeof(zstd_magic)) == 0) return COMPRESS_ZSTD;
+    return COMPRESS_NONE;
+}
+
+/* Return the compression format of an input stream. Regular files are checked using magic bytes
+ * at the current position, the format of pipes, sockets and devices is detected by reading the first bytes.
+ * Directories are not compressed
+ */
+static
+int compress_format_read(FILE *fp,char *name)
+{
+    struct stat st;
+    unsigned char magic[4];
+    off_t pos;
+    ssize_t n;
+
+    if(fstat(fileno(fp),&st) != 0) return compress_format(name);
+
+    if(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode) || S_ISCHR(st.st_mode))
+    {
+        if(compress_format(name) != COMPRESS_NONE) return compress_format(name);
+        return COMPRESS_DETECT;
+    }
+
+    if(!S_ISREG(st.st_mode)) return COMPRESS_NONE;
+
+    pos = lseek(fileno(fp),0,SEEK_CUR);
+    if(pos < 0) pos = 0;
+
+    n = pread(fileno(fp),magic,sizeof(magic),pos);
+
+    return compress_format_magic(magic,n > 0 ? (size_t) n : 0);
+}
+
+/* read the first bytes of non-regular input to data, returns the number of bytes read
+ */
+static
+size_t read_magic(FILE *fp,char *name,unsigned char *data,size_t size)
+{
+    size_t len = 0;
+    ssize_t n;
+
+    while(len < size)
+    {
+        n = read(fileno(fp),&data[len],size - len);
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) panic("Error in reading file",name,strerror(errno));
+        if(n == 0) break;
+        len += n;
+    }
+
+    return len;
+}
+
+/* Return the bytes read from not compressed input fp when detecting the format. The bytes are
+ * copied to data (at least 4 bytes) and forgotten, returns the number of bytes. The bytes must
+ * be used before reading the rest of the input from the file descriptor of fp
+ */
+size_t compress_peeked(FILE *fp,unsigned char *data)
+{
+    struct peeked_input *p,**prev;
+    size_t len = 0;
+
+    PEEKED_LOCK();
+    for(prev = &peeked;(p = *prev) != NULL && p->fp != fp;prev = &p->next);
+    if(p != NULL) *prev = p->next;
+    PEEKED_UNLOCK();
+
+    if(p == NULL) return 0;
+
+    len = p->len;
+    memcpy(data,p->data,len);
+    free(p);
+    return len;
+}
+
+/* check that the format is supported
+ */
+static
+void compress_check(char *name,int format)
+{
+#ifndef USE_ZLIB
+    if(format == COMPRESS_GZIP) panic("gzip compression is not supported in this build",name,NULL);
+#endif
+#ifndef USE_ZSTD
+    if(format == COMPRESS_ZSTD) panic("zstd compression is not supported in this build",name,NULL);
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+
+struct compressed_stream
+{
+    FILE *stream;                      // pipe end given to the caller
+    FILE *file;                        // compressed file
+    int fd;                            // pipe end used by the thread
+    int format;                        // COMPRESS_GZIP or COMPRESS_ZSTD
+    unsigned char magic[4];            // bytes read for detecting the format, returned first by file_read
+    size_t magic_len;
+    int writing;                       // 1 = data is compressed to file
+    char *name;
+    void *thread;
+    struct compressed_stream *next;
+};
+
+static struct compressed_stream *streams = NULL;
+static pthread_mutex_t streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* write all data to pipe, returns 0 if the reader has closed the pipe
+ */
+static
+int pipe_write(struct compressed_stream *s,unsigned char *data,size_t size)
+{
+    ssize_t n;
+
+    while(size)
+    {
+        n = write(s->fd,data,size);
+        if(n < 0)
+        {
+            if(errno == EINTR) continue;
+            if(errno == EPIPE) return 0;
+            panic("Error in decompressing file",s->name,strerror(errno));
+        }
+        data += n;
+        size -= n;
+    }
+    return 1;
+}
+
+/* read data from pipe, returns 0 at the end of data
+ */
+static
+size_t pipe_read(struct compressed_stream *s,unsigned char *data,size_t size)
+{
+    ssize_t n;
+
+    do
+    {
+        n = read(s->fd,data,size);
+    } while(n < 0 && errno == EINTR);
+
+    if(n < 0) panic("Error in compressing file",s->name,strerror(errno));
+    return (size_t) n;
+}
+
+/* read compressed data from file, bytes read when detecting the format are returned first
+ */
+static
+size_t file_read(struct compressed_stream *s,unsigned char *data,size_t size)
+{
+    size_t n;
+
+    if(s->magic_len)
+    {
+        n = s->magic_len < size ? s->magic_len : size;
+        memcpy(data,s->magic,n);
+        memmove(s->magic,&s->magic[n],s->magic_len - n);
+        s->magic_len -= n;
+        return n;
+    }
+
+    n = fread(data,1,size,s->file);
+
+    if(n == 0 && ferror(s->file)) panic("Error in reading file",s->name,strerror(errno));
+    return n;
+}
+
+/* write compressed data to file
+ */
+static
+void file_write(struct compressed_stream *s,unsigned char *data,size_t size)
+{
+    if(size && fwrite(data,1,size,s->file) != size) panic("Error in writing file",s->name,strerror(errno));
+}
+
+#ifdef USE_ZLIB
+/* decompress gzip file to pipe, concatenated gzip members are read as one stream
+ */
+static
+void gzip_read(struct compressed_stream *s,unsigned char *in,unsigned char *out)
+{
+    z_stream z;
+    int ret = Z_OK;
+
+    memset(&z,0,sizeof(z));
+    if(inflateInit2(&z,15 + 32) != Z_OK) panic("Cannot initialize decompression",s->name,z.msg);
+
+    do
+    {
+        if(z.avail_in == 0)
+        {
+            z.next_in = in;
+            z.avail_in = file_read(s,in,COMPRESS_BUF);
+            if(z.avail_in == 0)
+            {
+                if(ret != Z_STREAM_END) panic("Truncated compressed file",s->name,NULL);
+                break;
+            }
+        }
+
+        if(ret == Z_STREAM_END) inflateReset(&z);      // next member
+
+        z.next_out = out;
+        z.avail_out = COMPRESS_BUF;
+
+        ret = inflate(&z,Z_NO_FLUSH);
+        if(ret != Z_OK && ret != Z_STREAM_END) panic("Corrupted compressed file",s->name,z.msg);
+    } while(pipe_write(s,out,COMPRESS_BUF - z.avail_out));
+
+    inflateEnd(&z);
+}
+
+/* compress data in z to file
+ */
+static
+void gzip_deflate(struct compressed_stream *s,z_stream *z,unsigned char *out,int flush)
+{
+    do
+    {
+        z->next_out = out;
+        z->avail_out = COMPRESS_BUF;
+        deflate(z,flush);
+        file_write(s,out,COMPRESS_BUF - z->avail_out);
+    } while(z->avail_out == 0);
+}
+
+/* compress data from pipe to gzip file
+ */
+static
+void gzip_write(struct compressed_stream *s,unsigned char *in,unsigned char *out)
+{
+    z_stream z;
+
+    memset(&z,0,sizeof(z));
+    if(deflateInit2(&z,Z_DEFAULT_COMPRESSION,Z_DEFLATED,15 + 16,8,Z_DEFAULT_STRATEGY) != Z_OK) panic("Cannot initialize compression",s->name,z.msg);
+
+    while((z.avail_in = pipe_read(s,in,COMPRESS_BUF)) > 0)
+    {
+        z.next_in = in;
+        gzip_deflate(s,&z,out,Z_NO_FLUSH);
+    }
+
+    gzip_deflate(s,&z,out,Z_FINISH);
+    deflateEnd(&z);
+}
+#endif
+
+#ifdef USE_ZSTD
+/* decompress zstd file to pipe
+ */
+static
+void zstd_read(struct compressed_stream *s,unsigned char *in,unsigned char *out)
+{
+    ZSTD_DStream *d = ZSTD_createDStream();
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    size_t ret = 0;
+
+    if(d == NULL) panic("Cannot initialize decompression",s->name,NULL);
+    ZSTD_initDStream(d);
+
+    while((zin.size = file_read(s,in,COMPRESS_BUF)) > 0)
+    {
+        zin.src = in;
+        zin.pos = 0;
+
+        do
+        {
+            zout.dst = out;
+            zout.size = COMPRESS_BUF;
+            zout.pos = 0;
+
+            ret = ZSTD_decompressStream(d,&zout,&zin);
+            if(ZSTD_isError(ret)) panic("Corrupted compressed file",s->name,(char *) ZSTD_getErrorName(ret));
+
+            if(!pipe_write(s,out,zout.pos))
+            {
+                ZSTD_freeDStream(d);
+                return;
+            }
+        } while(zin.pos < zin.size || zout.pos == zout.size);
+    }
+
+    if(ret != 0) panic("Truncated compressed file",s->name,NULL);
+    ZSTD_freeDStream(d);
+}
+
+/* compress data from pipe to zstd file
+ */
+static
+void zstd_write(struct compressed_stream *s,unsigned char *in,unsigned char *out)
+{
+    ZSTD_CStream *c = ZSTD_createCStream();
+    ZSTD_inBuffer zin;
+    ZSTD_outBuffer zout;
+    size_t ret;
+
+    if(c == NULL) panic("Cannot initialize compression",s->name,NULL);
+    ZSTD_initCStream(c,3);
+
+    while((zin.size = pipe_read(s,in,COMPRESS_BUF)) > 0)
+    {
+        zin.src = in;
+        zin.pos = 0;
+
+        while(zin.pos < zin.size)
+        {
+            zout.dst = out;
+            zout.size = COMPRESS_BUF;
+            zout.pos = 0;
+
+            ret = ZSTD_compressStream(c,&zout,&zin);
+            if(ZSTD_isError(ret)) panic("Error in compressing file",s->name,(char *) ZSTD_getErrorName(ret));
+            file_write(s,out,zout.pos);
+        }
+    }
+
+    do
+    {
+        zout.dst = out;
+        zout.size = COMPRESS_BUF;
+        zout.pos = 0;
+
+        ret = ZSTD_endStream(c,&zout);
+        if(ZSTD_isError(ret)) panic("Error in compressing file",s->name,(char *) ZSTD_getErrorName(ret));
+        file_write(s,out,zout.pos);
+    } while(ret != 0);
+
+    ZSTD_freeCStream(c);
+}
+#endif
+
+/* compression thread main
+ */
+static
+void *compress_main(void *arg)
+{
+    struct compressed_stream *s = arg;
+    unsigned char *in = xmalloc(COMPRESS_BUF);
+    unsigned char *out = xmalloc(COMPRESS_BUF);
+    sigset_t set;
+
+    /* reader closing the pipe early gives EPIPE instead of terminating the program */
+    sigemptyset(&set);
+    sigaddset(&set,SIGPIPE);
+    pthread_sigmask(SIG_BLOCK,&set,NULL);
+
+    switch(s->format)
+    {
+#ifdef USE_ZLIB
+        case COMPRESS_GZIP:
+            if(s->writing) gzip_write(s,in,out); else gzip_read(s,in,out);
+            break;
+#endif
+#ifdef USE_ZSTD
+        case COMPRESS_ZSTD:
+            if(s->writing) zstd_write(s,in,out); else zstd_read(s,in,out);
+            break;
+#endif
+    }
+
+    close(s->fd);
+    if(fclose(s->file) != 0 && s->writing) panic("Error in writing file",s->name,strerror(errno));
+
+    free(in);
+    free(out);
+    return NULL;
+}
+
+/* Start a compression thread for file fp, returns the caller end of the pipe.
+ * magic has bytes allready read from fp, they are decompressed first
+ */
+static
+FILE *compress_start(FILE *fp,char *name,int format,int writing,unsigned char *magic,size_t magic_len)
+{
+    struct compressed_stream *s;
+    int p[2];
+
+    if(pipe(p) != 0) panic("Cannot create pipe",name,strerror(errno));
+
+#ifdef F_SETPIPE_SZ
+    fcntl(p[1],F_SETPIPE_SZ,PIPE_SIZE);
+#endif
+
+    s = xmalloc(sizeof(struct compressed_stream));
+    s->file = fp;
+    s->format = format;
+    if(magic_len) memcpy(s->magic,magic,magic_len);
+    s->magic_len = magic_len;
+    s->writing = writing;
+    s->name = xstrdup(name);
+    s->fd = writing ? p[0] : p[1];
+    s->stream = fdopen(writing ? p[1] : p[0],writing ? "w" : "r");
+    if(s->stream == NULL) panic("Cannot create pipe",name,strerror(errno));
+
+    s->thread = start_thread(compress_main,s);
+
+    pthread_mutex_lock(&streams_lock);
+    s->next = streams;
+    streams = s;
+    pthread_mutex_unlock(&streams_lock);
+
+    return s->stream;
+}
+
+/* Close a compressed stream and wait until the thread has done. The fclose result is set to ret.
+ * Returns 0 if fp was not opened using compress_open_read or compress_open_write
+ */
+int compress_close(FILE *fp,int *ret)
+{
+    struct compressed_stream *s,**prev;
+
+    pthread_mutex_lock(&streams_lock);
+    for(prev = &streams;(s = *prev) != NULL && s->stream != fp;prev = &s->next);
+    if(s != NULL) *prev = s->next;
+    pthread_mutex_unlock(&streams_lock);
+
+    if(s == NULL) return 0;
+
+    *ret = fclose(s->stream);
+    join_thread(s->thread);
+
+    free(s->name);
+    free(s);
+    return 1;
+}
+
+#else
+
+static
+FILE *compress_start(FILE *fp,char *name,int format,int writing,unsigned char *magic,size_t magic_len)
+{
+    panic("Compressed files need thread support",name,NULL);
+    return fp;
+}
+
+int compress_close(FILE *fp,int *ret)
+{
+    return 0;
+}
+
+#endif
+
+/* Return a stream reading the decompressed data of fp, fp is returned if it is not compressed
+ */
+FILE *compress_open_read(FILE *fp,char *name)
+{
+    int format = compress_format_read(fp,name);
+    struct peeked_input *p;
+    unsigned char magic[4];
+    size_t magic_len = 0;
+
+    if(format == COMPRESS_DETECT)
+    {
+        magic_len = read_magic(fp,name,magic,sizeof(magic));
+        format = compress_format_magic(magic,magic_len);
+
+        if(format == COMPRESS_NONE)      // caller reads fp, bytes read are given back by compress_peeked
+        {
+            p = xmalloc(sizeof(struct peeked_input));
+            p->fp = fp;
+            memcpy(p->data,magic,magic_len);
+            p->len = magic_len;
+            PEEKED_LOCK();
+            p->next = peeked;
+            peeked = p;
+            PEEKED_UNLOCK();
+        }
+    }
+
+    if(format == COMPRESS_NONE) return fp;
+
+    compress_check(name,format);
+    return compress_start(fp,name,format,0,magic,magic_len);
+}
+
+/* Return a stream compressing data written to fp if name has a compression extension
+ */
+FILE *compress_open_write(FILE *fp,char *name)
+{
+    int format = compress_format(name);
+
+    if(format == COMPRESS_NONE) return fp;
+
+    compress_check(name,format);
+    return compress_start(fp,name,format,1,NULL,0);
+}
@@ -238,7 +238,7 @@ parse_expression(char *new)
 }
 
 /* check if a string is a valid floating point number in ascii representation
- * strtod is used for this.
+ * parse_double is used for this.
  * If end points to \000 it is assumed that string is valid float
  * returns true if string is a valid float
  */
@@ -249,91 +249,208 @@ int check_float_string(char *string)
 
     if(*string == '\000') return 0;
 
-    (void) strtod(string,&end);
+    (void) parse_double(string,&end);
 
     return *end == '\000';
 }
 
-/* Check if a input field (value index in data_idx) should be replaced using an expression
- * Expressions are only evaluated for numeric fields, text fields remain intact
- * If field is to be modified then it is evaluated using te_interp
- * If te_interp return NaN an error is raised
+/* Expressions are compiled once per thread. Data references are bound to variables in ref_value,
+ * which are set for each row before evaluation. compiled_state is 0 if formula is not compiled yet,
+ * 1 if it is compiled and -1 if it cannot be compiled (te_interp is used for it)
  */
-char *
-evaluate_data_expression(int data_idx, int value_count,char **values)
+static THREAD_LOCAL te_expr *compiled[FORMULA_MAX];
+static THREAD_LOCAL int compiled_state[FORMULA_MAX];
+static THREAD_LOCAL double ref_value[FORMULA_MAX][EXPRESSION_DATA_REFERENCE_MAX];
+
+/* compile formula f, $n references are replaced with variables ceif_ref0,ceif_ref1,...
+ * invalid references are handled as in expand_expression: only $ is removed
+ */
+static
+void compile_formula(int f)
 {
-    int f,r;
-    struct data_value_formula *dvf;
+    struct data_value_formula *dvf = &formula[f];
+    te_variable vars[EXPRESSION_DATA_REFERENCE_MAX];
+    char names[EXPRESSION_DATA_REFERENCE_MAX][16];
+    char expr[2048];
     char *s,*t;
-    double newval;
-    static char expr[2048];
-    static char retval[50];
-
-    // likely case, check this first
-    if(!formulas) return values[data_idx];
-
-    // No formulas to change data or data is not a float
-    if(data_idx >= value_count) return "";
-    if(!check_float_string(values[data_idx])) return values[data_idx];
+    int r = 0,var_count = 0,error;
 
+    s = dvf->expression;
+    t = expr;
 
-    for(f = 0;f < formulas;f++)
+    while(*s && t < &expr[sizeof(expr) - 16])
     {
-        if(formula[f].target_data_idx == data_idx)
+        if(*s == DATA_REFERENCE)
         {
-            dvf = &formula[f];
-            s = dvf->expression;
-            r = 0;
-            t = expr;
-            expr[0] = '\000';
-
-            // copy expression to expr, replace all $-references with actual data values
-            while(*s)
+            if(r < dvf->dref_count && dvf->dref[r].data_idx > -1)
             {
-                switch(*s)
-                {
-                    case DATA_REFERENCE:
-                        if(dvf->dref[r].data_idx > -1 && dvf->dref[r].data_idx < value_count && r < dvf->dref_count)
-                        {
-                            strcpy(t,values[dvf->dref[r].data_idx]);
-                            while(*t) t++;
-                            s += dvf->dref[r].length;
-                        } else
-                        {
-                            s++;
-                        }
-                        r++;
-                        break;
-                    default:
-                        *t = *s;
-                        t++;
-                        s++;
-                        break;
-                }
-            }
-            *t = '\000';
-           
-            newval = te_interp(expr,0);
-            if(isnormal(newval) || newval == 0.0)
-            {
-                sprintf(retval,"%.*f",dvf->decimals,newval);
+                sprintf(names[var_count],"ceif_ref%d",r);
+                vars[var_count].name = names[var_count];
+                vars[var_count].address = &ref_value[f][r];
+                vars[var_count].type = TE_VARIABLE;
+                vars[var_count].context = NULL;
+                var_count++;
+                t += sprintf(t," %s ",names[var_count - 1]);
+                s += dvf->dref[r].length;
             } else
             {
+                s++;
+            }
+            r++;
+        } else
+        {
+            *t++ = *s++;
+        }
+    }
+    *t = '\000';
 
-                info("Expression cannot be interpreted or evaluated ",dvf->expression,NULL);
+    compiled[f] = *s ? NULL : te_compile(expr,vars,var_count,&error);
+    compiled_state[f] = compiled[f] == NULL ? -1 : 1;
+}
+
+/* evaluate formula f using compiled expression
+ * returns false if compiled expression cannot be used for this row,
+ * e.g. a referenced field is missing or it is not a number
+ */
+static
+int evaluate_compiled(int f,int value_count,char **values,double *result)
+{
+    struct data_value_formula *dvf = &formula[f];
+    char *end;
+    int r;
+
+    if(!compiled_state[f]) compile_formula(f);
+    if(compiled_state[f] < 0) return 0;
 
-                if(ignore_expression_errors)
+    for(r = 0;r < dvf->dref_count;r++)
+    {
+        if(dvf->dref[r].data_idx == -1) continue;
+        if(dvf->dref[r].data_idx >= value_count) return 0;
+
+        ref_value[f][r] = parse_double(values[dvf->dref[r].data_idx],&end);
+        if(end == values[dvf->dref[r].data_idx] || *end != '\000') return 0;
+    }
+
+    *result = te_eval(compiled[f]);
+
+    return isnormal(*result) || *result == 0.0;
+}
+
+/* copy expression to expr, replace all $-references with actual data values
+ */
+static
+void expand_expression(struct data_value_formula *dvf,int value_count,char **values,char *expr)
+{
+    char *s,*t;
+    int r = 0;
+
+    s = dvf->expression;
+    t = expr;
+
+    while(*s)
+    {
+        switch(*s)
+        {
+            case DATA_REFERENCE:
+                if(dvf->dref[r].data_idx > -1 && dvf->dref[r].data_idx < value_count && r < dvf->dref_count)
                 {
-                    info("Expression with parameters expanded, this will be replace by zero",expr,NULL);
-                    sprintf(retval,"%.*f",dvf->decimals,0.0);
+                    strcpy(t,values[dvf->dref[r].data_idx]);
+                    while(*t) t++;
+                    s += dvf->dref[r].length;
                 } else
                 {
-                    panic("Expression with parameters expanded",expr,NULL);
+                    s++;
                 }
-            }
-            return retval;
+                r++;
+                break;
+            default:
+                *t = *s;
+                t++;
+                s++;
+                break;
         }
     }
-    return values[data_idx];   // default is to return the original data
+    *t = '\000';
+}
+
+/* evaluate formula f for a row
+ * compiled expression is used if possible, otherwise expression is expanded and evaluated using te_interp
+ * If the result is NaN an error is raised
+ */
+static
+double evaluate_formula(int f,int value_count,char **values)
+{
+    struct data_value_formula *dvf = &formula[f];
+    double newval;
+    static THREAD_LOCAL char expr[2048];
+
+    if(evaluate_compiled(f,value_count,values,&newval)) return newval;
+
+    expand_expression(dvf,value_count,values,expr);
+
+    newval = te_interp(expr,0);
+    if(isnormal(newval) || newval == 0.0) return newval;
+
+    info("Expression cannot be interpreted or evaluated ",dvf->expression,NULL);
+
+    if(ignore_expression_errors)
+    {
+        info("Expression with parameters expanded, this will be replace by zero",expr,NULL);
+    } else
+    {
+        panic("Expression with parameters expanded",expr,NULL);
+    }
+    return 0.0;
 }
 
+/* return index of formula replacing field data_idx, -1 if there is none
+ */
+static
+int find_formula(int data_idx)
+{
+    int f;
+
+    for(f = 0;f < formulas;f++)
+    {
+        if(formula[f].target_data_idx == data_idx) return f;
+    }
+    return -1;
+}
+
+/* Check if a input field (value index in data_idx) should be replaced using an expression
+ * Expressions are only evaluated for numeric fields, text fields remain intact
+ * Returns the field as string
+ */
+char *
+evaluate_data_expression(int data_idx, int value_count,char **values)
+{
+    int f;
+    static THREAD_LOCAL char retval[50];
+
+    // likely case, check this first
+    if(!formulas) return values[data_idx];
+
+    // No formulas to change data or data is not a float
+    if(data_idx >= value_count) return "";
+    if((f = find_formula(data_idx)) == -1) return values[data_idx];
+    if(!check_float_string(values[data_idx])) return values[data_idx];
+
+    snprintf(retval,sizeof(retval),"%.*f",formula[f].decimals,evaluate_formula(f,value_count,values));
+
+    return retval;
+}
+
+/* Same as evaluate_data_expression, but the field is returned as double
+ * Result is rounded to formula decimals, as the string returned by evaluate_data_expression
+ */
+double
+evaluate_data_value(int data_idx, int value_count,char **values)
+{
+    int f;
+
+    if(data_idx >= value_count) return 0.0;
+
+    if(!formulas || (f = find_formula(data_idx)) == -1 || !check_float_string(values[data_idx])) return parse_double(values[data_idx],NULL);
+
+    return round_decimals(evaluate_formula(f,value_count,values),formula[f].decimals);
+}
@@ -28,8 +28,10 @@
 #include <time.h>
 #include <math.h>
 #include <ctype.h>
-
-#define VALUES_MAX (2*DIM_MAX)             // Max values for parsing a csv line
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Make separated string. String is initialized with NULL item
  * Every call adds single item to string
@@ -38,8 +40,8 @@
 char *
 make_separated_string(char *item, char separator)
 {
-    static char string[10240];
-    static size_t write_pos = 0;
+    static THREAD_LOCAL char string[10240];
+    static THREAD_LOCAL size_t write_pos = 0;
     char *p;
 
     if(item == NULL)
@@ -89,6 +91,37 @@ make_csv_line(char *values[],int value_count,char separator)
     return line;
 }
 
+/* return pointer to the first c or NUL in string p
+ * with SSE2 16 bytes are tested at a time. Loads are 16 byte aligned, so they never cross a page boundary
+ */
+static inline
+char *find_char(char *p,char c)
+{
+#ifdef __SSE2__
+    uintptr_t off = (uintptr_t) p & 15;
+    const __m128i *a = (const __m128i *) (p - off);
+    const __m128i vc = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i x;
+    unsigned int mask;
+
+    x = _mm_load_si128(a);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x,vc),_mm_cmpeq_epi8(x,zero)));
+    mask &= 0xffffU << off;      // skip bytes before p
+
+    while(!mask)
+    {
+        x = _mm_load_si128(++a);
+        mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x,vc),_mm_cmpeq_epi8(x,zero)));
+    }
+
+    return (char *) a + __builtin_ctz(mask);
+#else
+    while(*p != '\000' && *p != c) p++;
+    return p;
+#endif
+}
+
 /* parse a csv line.
    return number of values
    pointers to each value will be written to values
@@ -96,6 +129,7 @@ make_csv_line(char *values[],int value_count,char separator)
    write NULL for each separator, line will be modified
     
    values can be enclosed to double quotes (")
+   separator preceded by backslash is part of the value
  */
 int
 parse_csv_line(char *values[],int max_values,char *line,char separator)
@@ -119,9 +153,17 @@ parse_csv_line(char *values[],int max_values,char *line,char separator)
         }
 
         values[n++] = line;
-        while(*line != '\000' && ((!in_quote && (*line != separator || (*line == separator && line > start && line[-1] == '\\'))) || (in_quote && *line != '"'))) line++;
-        if (in_quote && *line == '"') *line++ = '\000';
-        while(*line != '\000' && *line != separator) line++;
+
+        if(in_quote)
+        {
+            line = find_char(line,'"');
+            if(*line == '"') *line++ = '\000';
+            line = find_char(line,separator);
+        } else
+        {
+            while(*(line = find_char(line,separator)) == separator && line > start && line[-1] == '\\') line++;
+        }
+
         if (*line == separator) *line++ = '\000';
     }
 
@@ -133,14 +175,61 @@ parse_csv_line(char *values[],int max_values,char *line,char separator)
     return n;
 }
 
+/* parse one input row to values using input separator
+   if input is sparse (-x) the row is expanded to sparse_fields values. Fields having form INDEX:VALUE set the value
+   of field INDEX (starts from 1), other fields are set in order. Values not given are "0".
+   returns the number of values
+ */
+int
+parse_input_line(char *values[],char *line)
+{
+    static THREAD_LOCAL char **fields = NULL;
+    static THREAD_LOCAL int fields_cap = 0;
+    static char zero[] = "0";
+    int i,n,index,field_count;
+    char *p;
+
+    if(!sparse_fields) return parse_csv_line(values,dim_max,line,input_separator);
+
+    DIM_BUFFER(fields,fields_cap);
+
+    field_count = parse_csv_line(fields,dim_max,line,input_separator);
+
+    if(!field_count) return 0;
+
+    for(i = 0;i < sparse_fields;i++) values[i] = zero;
+
+    for(i = 0,n = 0;i < field_count;i++)
+    {
+        p = fields[i];
+        index = 0;
+
+        while(*p >= '0' && *p <= '9')
+        {
+            if(index <= sparse_fields) index = index * 10 + (*p - '0');
+            p++;
+        }
+
+        if(*p == ':' && p > fields[i])
+        {
+            if(index >= 1 && index <= sparse_fields) values[index - 1] = p + 1;   // indices out of range are ignored
+        } else if(n < sparse_fields)
+        {
+            values[n++] = fields[i];
+        }
+    }
+
+    return sparse_fields;
+}
+
 static void 
 check_dim_range(int index)
 {
     char n[100];
     
-    if(index < 1 || index > DIM_MAX)
+    if(index < 1 || index > dim_max)
     {
-        sprintf(n,"Valid dimension numbers are 1 - %i",DIM_MAX); 
+        sprintf(n,"Valid dimension numbers are 1 - %i, use option -x for wider input",dim_max); 
         panic(n,NULL,NULL);
     }
 }
@@ -160,14 +249,17 @@ check_dim_range(int index)
 int
 parse_dims(char *optarg, int *array)
 {
-    char *value[DIM_MAX];
+    static char **value = NULL;
+    static int value_cap = 0;
     char *range[2];
     int i,j;
     int ranges = 0;
     int values = 0;
     int dims = 0;
 
-    values = parse_csv_line(value,DIM_MAX,optarg,',');
+    DIM_BUFFER(value,value_cap);
+
+    values = parse_csv_line(value,dim_max,optarg,',');
 
     for(i = 0;i < values;i++)
     {
@@ -331,6 +423,10 @@ void read_config_file(char *config_file)
         {
              analyze_sampling_count = atoi(value);
              if(analyze_sampling_count < 0) analyze_sampling_count = 0;
+        } else if((value = parse_config_line(input_line,"ANALYZE_WINDOW")) != NULL)
+        {
+             analyze_window = atoi(value);
+             if(analyze_window < 0) analyze_window = 0;
         } else if((value = parse_config_line(input_line,"DEBUG")) != NULL)
         {
              debug = atoi(value);
@@ -356,6 +452,10 @@ void read_config_file(char *config_file)
         } else if((value = parse_config_line(input_line,"IGNORE_EXPR_PARSE_ERROR")) != NULL)
         {
             ignore_expression_errors = atoi(value);
+        } else if((value = parse_config_line(input_line,"THREADS")) != NULL)
+        {
+            thread_count = atoi(value);
+            if(thread_count < 1) thread_count = 1;
         } else
         {
              panic("Unknown option in config file",input_line,NULL);
@@ -379,6 +479,7 @@ print_forest_info(FILE *outs)
 {
     int forest_idx,i,j;
     struct forest *f;
+    double *d;
     char outstr[100];
     struct tm *tmp;
         
@@ -518,7 +619,8 @@ print_forest_info(FILE *outs)
             for(i = 0;i < f->cluster_count;i++)
             {
                 _3P("%15d",i + 1);
-                for(j = 0;j < dimensions;j++) _P("%*.*f",dimension_print_width,decimals,f->X[f->cluster_center[i]].dimension[j]);
+                d = sample_values(&f->X[f->cluster_center[i]]);
+                for(j = 0;j < dimensions;j++) _P("%*.*f",dimension_print_width,decimals,d[j]);
                 _P("\n");
             }
         }
@@ -539,6 +641,7 @@ print_sample_density(FILE *outs,int common_scale)
     int forest_idx,i,j,first;
     static char *digit="0123456789#";
     double min = 0,max = 0,bucket_size = 0,percentage;
+    double *d;
     struct forest *f;
     int density[DENSITY_MAX];
     size_t bucket;
@@ -561,17 +664,18 @@ print_sample_density(FILE *outs,int common_scale)
             // find all dimensions min and max values
             if(first)
             {
-                min = f->X[0].dimension[0];
-                max = f->X[0].dimension[0];
+                min = sample_value(&f->X[0],0);
+                max = min;
                 first = 0;
             }
 
             for(i = 0;i < f->X_count;i++)
             {
+                d = sample_values(&f->X[i]);
                 for(j = 0;j < dimensions;j++)
                 {
-                    min = fmin(min,f->X[i].dimension[j]);
-                    max = fmax(max,f->X[i].dimension[j]);
+                    min = fmin(min,d[j]);
+                    max = fmax(max,d[j]);
                 }
             }
         }
@@ -590,15 +694,16 @@ print_sample_density(FILE *outs,int common_scale)
         if(!common_scale)
         {
             // find all dimensions min and max values
-            min = f->X[0].dimension[0];
-            max = f->X[0].dimension[0];
+            min = sample_value(&f->X[0],0);
+            max = min;
 
             for(i = 0;i < f->X_count;i++)
             {
+                d = sample_values(&f->X[i]);
                 for(j = 0;j < dimensions;j++)
                 {
-                    min = fmin(min,f->X[i].dimension[j]);
-                    max = fmax(max,f->X[i].dimension[j]);
+                    min = fmin(min,d[j]);
+                    max = fmax(max,d[j]);
                 }
             }
             bucket_size = (max - min) / (double) DENSITY_MAX;
@@ -622,7 +727,7 @@ print_sample_density(FILE *outs,int common_scale)
 
             for(i = 0;i < f->X_count;i++)
             {
-                bucket = (size_t) ((f->X[i].dimension[j] - min) / bucket_size);
+                bucket = (size_t) ((sample_value(&f->X[i],j) - min) / bucket_size);
                 if(bucket >= DENSITY_MAX) bucket = DENSITY_MAX - 1;
                 density[bucket]++;
             }
@@ -643,8 +748,8 @@ print_sample_density(FILE *outs,int common_scale)
         if(!common_scale)
         {
            f = &forest[0];
-            min = f->X[0].dimension[j];
-            max = f->X[0].dimension[j];
+            min = sample_value(&f->X[0],j);
+            max = min;
 
             for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
             {
@@ -652,8 +757,8 @@ print_sample_density(FILE *outs,int common_scale)
 
                 for(i = 0;i < f->X_count;i++)
                 {
-                    min = fmin(min,f->X[i].dimension[j]);
-                    max = fmax(max,f->X[i].dimension[j]);
+                    min = fmin(min,sample_value(&f->X[i],j));
+                    max = fmax(max,sample_value(&f->X[i],j));
                 }
                 bucket_size = (max - min) / (double) DENSITY_MAX;
             }
@@ -676,7 +781,7 @@ print_sample_density(FILE *outs,int common_scale)
 
             for(i = 0;i < f->X_count;i++)
             {
-                bucket = (size_t) ((f->X[i].dimension[j] - min) / bucket_size);
+                bucket = (size_t) ((sample_value(&f->X[i],j) - min) / bucket_size);
                 if(bucket >= DENSITY_MAX) bucket = DENSITY_MAX - 1;
                 density[bucket]++;
             }
@@ -713,7 +818,7 @@ void
 print_sample_scores(FILE *outs)
 {
     int forest_idx,i,j,cluster_idx;
-    double score;
+    double score,*d;
     struct forest *f;
 
     _P("Sample score list\n");
@@ -748,7 +853,8 @@ print_sample_scores(FILE *outs)
                _P("%10s","");
            }
 
-           for(j = 0;j < dimensions;j++) _P("%*.*f",dimension_print_width,decimals,f->X[i].dimension[j]);
+           d = sample_values(&f->X[i]);
+           for(j = 0;j < dimensions;j++) _P("%*.*f",dimension_print_width,decimals,d[j]);
            _P("\n");
        }
     }
@@ -760,12 +866,14 @@ static
 void calc_stddev(struct forest *f, double *stddev)
 {
     int i,j;
+    double *d;
 
     for(i = 0;i < dimensions;i++) stddev[i] = 0.0;
 
     for(i = 0;i < f->X_count;i++)
     {
-        for(j = 0;j < dimensions;j++) stddev[j] += POW2(f->X[i].dimension[j] - f->avg[j]); 
+        d = sample_values(&f->X[i]);
+        for(j = 0;j < dimensions;j++) stddev[j] += POW2(d[j] - f->avg[j]); 
     }
 
     for(j = 0;j < dimensions;j++) stddev[j] = sqrt(stddev[j] / (double) (f->X_count - 1));
@@ -813,7 +921,7 @@ void print_correlation_coefficent(FILE *outs)
 
                     for(i = 0;i < f->X_count;i++)
                     {
-                        psum += f->X[i].dimension[a] * f->X[i].dimension[b];
+                        psum += sample_value(&f->X[i],a) * sample_value(&f->X[i],b);
                     }
 
                     cc = (psum - (double) f->X_count * f->avg[a] * f->avg[b]) / ((double) (f->X_count - 1) * stddev[a] * stddev[b]);
@@ -0,0 +1,339 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Input data reader
+ *
+ * Regular files are memory mapped, other inputs (pipes, terminals) are read in large blocks.
+ * Lines are given to the caller directly from the mapped memory or from the block buffer,
+ * line feed is replaced with NUL. A line is valid until the next call of input_next.
+ *
+ * Input in columnar binary format (see column.c) is detected from the file header. Rows of
+ * CSV files can be read using a columnar cache, the cache is written while reading the CSV file.
+ */
+#include "ceif.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define USE_MMAP
+#endif
+
+#define BLOCK_SIZE 4194304       // read size for non mapped input
+#define RELEASE_SIZE 67108864    // mapped pages are released after this many bytes are consumed
+
+struct input
+{
+    int fd;
+    char *buf;                   // mapped file or block buffer
+    size_t size;                 // mapped size or buffer capasity
+    size_t pos;                  // start of the next line
+    size_t end;                  // end of data in buf
+    size_t released;             // mapped data before this is released
+    int mapped;                  // buf is memory mapped
+    int eof;                     // no more data to be read to buf
+    char *tail;                  // copy of the last line of a mapped file having no line feed in the end
+    FILE *cache;                 // columnar cache opened instead of the original stream
+    int columnar;                // input is in columnar format
+    struct column_block *block;  // current block of columnar input
+    int block_row;               // next row in block
+    struct column_writer *writer;  // columnar cache being written
+};
+
+/* try to map a regular file to memory
+ */
+static
+int map_input(struct input *in)
+{
+#ifdef USE_MMAP
+    struct stat st;
+    off_t offset;
+
+    if(fstat(in->fd,&st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+
+    offset = lseek(in->fd,0,SEEK_CUR);
+    if(offset < 0 || offset >= st.st_size) return 0;
+
+    in->buf = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_PRIVATE,in->fd,0);
+    if(in->buf == MAP_FAILED) return 0;
+
+#ifdef HAVE_MADVISE
+    madvise(in->buf,st.st_size,MADV_SEQUENTIAL);
+#endif
+
+    in->size = st.st_size;
+    in->end = st.st_size;
+    in->pos = offset;
+    in->released = 0;
+    in->mapped = 1;
+    in->eof = 1;
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+static void fill_buffer(struct input *);
+
+/* start reading lines from stream, name is the name of the file or NULL if not known
+ */
+struct input *input_open(FILE *stream,char *name)
+{
+    struct input *in = xmalloc(sizeof(struct input));
+    int use_cache;
+
+    in->pos = 0;
+    in->end = 0;
+    in->mapped = 0;
+    in->eof = 0;
+    in->tail = NULL;
+    in->cache = NULL;
+    in->columnar = 0;
+    in->block = NULL;
+    in->block_row = 0;
+    in->writer = NULL;
+
+    use_cache = column_cache && name != NULL && strcmp(name,"-") != 0;
+
+    if(use_cache) in->cache = column_cache_open(name);
+
+    in->fd = fileno(in->cache != NULL ? in->cache : stream);
+
+    if(!map_input(in))
+    {
+        in->size = BLOCK_SIZE;
+        in->buf = xmalloc(in->size + 1);
+        if(in->cache == NULL) in->end = compress_peeked(stream,(unsigned char *) in->buf);  // bytes read when checking compression
+#ifdef HAVE_POSIX_FADVISE
+        posix_fadvise(in->fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+        while(!in->eof && column_magic(&in->buf[in->pos],in->end - in->pos) == -1) fill_buffer(in);
+    }
+
+    if(column_magic(&in->buf[in->pos],in->end - in->pos) == 1)
+    {
+        in->columnar = 1;
+        in->pos += column_header_size();
+        in->block = column_block_new();
+    } else if(use_cache)
+    {
+        in->writer = column_writer_open(name);
+    }
+
+    column_row_clear();
+
+    return in;
+}
+
+/* read more data to block buffer, keep the unused data
+ */
+static
+void fill_buffer(struct input *in)
+{
+    ssize_t n;
+
+    if(in->pos)
+    {
+        memmove(in->buf,&in->buf[in->pos],in->end - in->pos);
+        in->end -= in->pos;
+        in->pos = 0;
+    }
+
+    if(in->end == in->size)       // line does not fit to buffer
+    {
+        in->size *= 2;
+        in->buf = xrealloc(in->buf,in->size + 1);
+    }
+
+    do
+    {
+        n = read(in->fd,&in->buf[in->end],in->size - in->end);
+    } while(n < 0 && errno == EINTR);
+
+    if(n < 0) panic("Error in reading input",NULL,strerror(errno));
+
+    if(n == 0) in->eof = 1;
+
+    in->end += n;
+}
+
+/* release mapped pages which are allready consumed
+ */
+static
+void release_mapped(struct input *in)
+{
+#if defined(USE_MMAP) && defined(HAVE_MADVISE)
+    size_t page,start,len;
+
+    page = sysconf(_SC_PAGESIZE);
+    start = in->released - in->released % page;
+    len = (in->pos - start) - (in->pos - start) % page;
+
+    if(len) madvise(&in->buf[start],len,MADV_DONTNEED);
+
+    in->released = start + len;
+#endif
+}
+
+/* return next line, NULL at end of input
+ */
+char *input_next(struct input *in)
+{
+    char *line,*nl = NULL;
+
+    if(in->mapped && in->pos - in->released > RELEASE_SIZE) release_mapped(in);
+
+    for(;;)
+    {
+        if(in->pos < in->end)
+        {
+            nl = memchr(&in->buf[in->pos],'\n',in->end - in->pos);
+
+            if(nl != NULL || in->eof) break;
+        } else if(in->eof)
+        {
+            return NULL;
+        }
+
+        fill_buffer(in);
+    }
+
+    line = &in->buf[in->pos];
+
+    if(nl != NULL)
+    {
+        *nl = '\000';
+        in->pos = nl - in->buf + 1;
+    } else if(in->mapped)          // last line has no line feed and there is no space for NUL
+    {
+        if(in->tail != NULL) free(in->tail);
+        in->tail = xmalloc(in->end - in->pos + 1);
+        memcpy(in->tail,line,in->end - in->pos);
+        in->tail[in->end - in->pos] = '\000';
+        line = in->tail;
+        in->pos = in->end;
+    } else
+    {
+        in->buf[in->end] = '\000';
+        in->pos = in->end;
+    }
+
+    return line;
+}
+
+/* copy next len bytes of input to data, returns the number of bytes copied, less than len at end of input
+ */
+size_t input_read(struct input *in,void *data,size_t len)
+{
+    size_t n,copied = 0;
+
+    if(in->mapped && in->pos - in->released > RELEASE_SIZE) release_mapped(in);
+
+    while(copied < len)
+    {
+        if(in->pos == in->end)
+        {
+            if(in->eof) break;
+            fill_buffer(in);
+            continue;
+        }
+
+        n = in->end - in->pos;
+        if(n > len - copied) n = len - copied;
+
+        memcpy((char *) data + copied,&in->buf[in->pos],n);
+        in->pos += n;
+        copied += n;
+    }
+
+    return copied;
+}
+
+/* return true if input is in columnar format
+ */
+int input_columnar(struct input *in)
+{
+    return in->columnar;
+}
+
+/* return true if a columnar cache is written from input rows, rows must then be read using input_row
+ */
+int input_caching(struct input *in)
+{
+    return in->writer != NULL;
+}
+
+/* read next block of columnar input to b, returns the number of rows, 0 at end of input
+ */
+int input_block(struct input *in,struct column_block *b)
+{
+    return column_block_read(in,b);
+}
+
+/* read next row and split it to values, returns the number of values or -1 at end of input
+ * values are valid until the next call
+ */
+int input_row(struct input *in,char **values)
+{
+    char *line;
+    int value_count;
+
+    if(in->columnar)
+    {
+        while(in->block_row >= column_block_rows(in->block))
+        {
+            if(!column_block_read(in,in->block)) return -1;
+            in->block_row = 0;
+        }
+
+        return column_block_row(in->block,in->block_row++,values);
+    }
+
+    if((line = input_next(in)) == NULL) return -1;
+
+    value_count = parse_input_line(values,line);
+
+    if(in->writer != NULL) column_write_row(in->writer,value_count,values);
+
+    return value_count;
+}
+
+void input_close(struct input *in)
+{
+    if(in->writer != NULL) column_writer_close(in->writer,in->eof && in->pos == in->end);
+    if(in->block != NULL) column_block_free(in->block);
+    column_row_clear();
+
+#ifdef USE_MMAP
+    if(in->mapped) munmap(in->buf,in->size);
+    else free(in->buf);
+#else
+    free(in->buf);
+#endif
+    if(in->tail != NULL) free(in->tail);
+    if(in->cache != NULL) xfclose(in->cache);
+    free(in);
+}
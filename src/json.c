@@ -24,32 +24,6 @@
 #include "ceif.h"
 #include <time.h>
 
-#ifdef HAVE_LIBFASTJSON_JSON_H
-
-#include <libfastjson/json.h>
-
-// json_object_to_file and json_object_from_file json-c compability  mappings might be missing for libfastjson
-#ifndef json_object_to_file
-#define json_object_to_file fjson_object_to_file
-#endif
-
-#ifndef json_object_from_file
-#define json_object_from_file fjson_object_from_file
-#endif
-
-#else
-
-#ifdef HAVE_JSON_JSON_H
-#include <json/json.h>
-#else 
-#ifdef HAVE_JSON_C_JSON_H
-#include <json-c/json.h>
-#endif
-#endif
-
-#endif
-
-#if defined HAVE_JSON_JSON_H || defined HAVE_LIBFASTJSON_JSON_H || HAVE_JSON_C_JSON_H   // headers are defined only if devel library is present
 #define NVL(a) ((a) ? (a) : "")
 
 #define GLOBALS "globals"
@@ -57,6 +31,7 @@
 #define CATEGORY "category"
 #define SAMPLE_COUNT "sampleCount"
 #define LAST_UPDATED "lastUpdated"
+#define SEEN_ROWS "seenRows"
 #define SAMPLES "samples"
 
 #define DIMENSIONS "dimensions"
@@ -80,306 +55,641 @@
 #define UNIQUE_SAMPLES "uniqueSamples"
 #define AGGREGATE "aggregate"
 #define FORMULA "formulas"
+#define PROJECTION "projection"
+
+/* write a string as json string, quotes and control characters are escaped
+ */
+void json_write_string(FILE *fp,char *s)
+{
+    unsigned char *c = (unsigned char *) NVL(s);
+
+    putc('"',fp);
+
+    while(*c)
+    {
+        switch(*c)
+        {
+            case '"':
+                fputs("\\\"",fp);
+                break;
+            case '\\':
+                fputs("\\\\",fp);
+                break;
+            case '\n':
+                fputs("\\n",fp);
+                break;
+            case '\r':
+                fputs("\\r",fp);
+                break;
+            case '\t':
+                fputs("\\t",fp);
+                break;
+            default:
+                if(*c < 0x20)
+                {
+                    fprintf(fp,"\\u%04x",*c);
+                } else
+                {
+                    putc(*c,fp);
+                }
+                break;
+        }
+        c++;
+    }
 
-#if defined HAVE_JSON_C_SET_SERIALIZATION_DOUBLE_FORMAT || defined HAVE_JSON_OBJECT_NEW_DOUBLE_S   // in versions 0.15 and 0.12 or fastjson
-    static char double_print[10];
-#endif
+    putc('"',fp);
+}
+
+/* write key of a json object member, first member of an object is written without comma
+ */
+static
+void json_write_key(FILE *fp,char *key,int first)
+{
+    if(!first) putc(',',fp);
+    json_write_string(fp,key);
+    putc(':',fp);
+}
+
+static
+void json_write_int(FILE *fp,char *key,int value)
+{
+    json_write_key(fp,key,0);
+    fprintf(fp,"%d",value);
+}
+
+static
+void json_write_str(FILE *fp,char *key,char *value)
+{
+    json_write_key(fp,key,0);
+    json_write_string(fp,value);
+}
 
-/* makes global variable json object 
+/* write global variable object
  */
-static json_object *
-write_globals(void)
+static
+void write_globals(FILE *fp)
 {
     int i;
     char str[] = "X";
     char scorestr[20];
-    char *filter_str;
-
-    filter_str = xstrdup(make_csv_line(cat_filter,cat_filter_count,';'));
 
-    json_object *globals = json_object_new_object();
-    json_object *jdims = json_object_new_int(dimensions);
-    json_object *jforest_count = json_object_new_int(forest_count);
-    json_object *jprint_string = json_object_new_string(print_string);
-    json_object *jprintf_format = json_object_new_string(printf_format);
-    json_object *jtree_count = json_object_new_int(tree_count);
-    json_object *jsamples_max = json_object_new_int(samples_max);
+    json_write_key(fp,DIMENSIONS,1);
+    fprintf(fp,"%d",dimensions);
+    json_write_int(fp,FOREST_COUNT,forest_count);
+    json_write_str(fp,PRINT_STRING,print_string);
+    json_write_str(fp,PRINTF_FORMAT,printf_format);
+    json_write_int(fp,TREE_COUNT,tree_count);
+    json_write_int(fp,SAMPLES_MAX,samples_max);
     str[0] = input_separator;
-    json_object *jinput_separator = json_object_new_string(str);
+    json_write_str(fp,INPUT_SEPARATOR,str);
     str[0] = list_separator;
-    json_object *jlist_separator = json_object_new_string(str);
-    json_object *jheader = json_object_new_int(header);
+    json_write_str(fp,LIST_SEPARATOR,str);
+    json_write_int(fp,HEADER,header);
     sprintf(scorestr,"%f%s",outlier_score,scale_score ? "s" : (percentage_score ? "%" : ""));
-    json_object *joutlier_score = json_object_new_string(scorestr);
-    json_object *jcategory_dims = json_object_new_string(category_dims);
-    json_object *jlabel_dims = json_object_new_string(label_dims);
-    json_object *jscore_dims = json_object_new_string(score_dims);
-    json_object *jignore_dims = json_object_new_string(ignore_dims);
-    json_object *jinclude_dims = json_object_new_string(include_dims);
-    json_object *jtext_dims = json_object_new_string(text_dims);
-    json_object *jfilter_str = json_object_new_string(filter_str);
-    json_object *jdecimals = json_object_new_int(decimals);
-    json_object *junique_samples = json_object_new_int(unique_samples);
-    json_object *jaggregate = json_object_new_int(aggregate);
-    json_object *jformulas = json_object_new_array();
-    json_object *jformula;
-
-    json_object_object_add(globals,DIMENSIONS,jdims);
-    json_object_object_add(globals,FOREST_COUNT,jforest_count);
-    json_object_object_add(globals,PRINT_STRING,jprint_string);
-    json_object_object_add(globals,PRINTF_FORMAT,jprintf_format);
-    json_object_object_add(globals,TREE_COUNT,jtree_count);
-    json_object_object_add(globals,SAMPLES_MAX,jsamples_max);
-    json_object_object_add(globals,INPUT_SEPARATOR,jinput_separator);
-    json_object_object_add(globals,LIST_SEPARATOR,jlist_separator);
-    json_object_object_add(globals,HEADER,jheader);
-    json_object_object_add(globals,OUTLIER_SCORE,joutlier_score);
-    json_object_object_add(globals,CATEGORY_DIMS,jcategory_dims);
-    json_object_object_add(globals,LABEL_DIMS,jlabel_dims);
-    json_object_object_add(globals,INCLUDE_DIMS,jinclude_dims);
-    json_object_object_add(globals,IGNORE_DIMS,jignore_dims);
-    json_object_object_add(globals,TEXT_DIMS,jtext_dims);
-    json_object_object_add(globals,SCORE_DIMS,jscore_dims);
-    json_object_object_add(globals,FILTER_STR,jfilter_str);
-    json_object_object_add(globals,DECIMALS,jdecimals);
-    json_object_object_add(globals,UNIQUE_SAMPLES,junique_samples);
-    json_object_object_add(globals,AGGREGATE,jaggregate);
-
+    json_write_str(fp,OUTLIER_SCORE,scorestr);
+    json_write_str(fp,CATEGORY_DIMS,category_dims);
+    json_write_str(fp,LABEL_DIMS,label_dims);
+    json_write_str(fp,INCLUDE_DIMS,include_dims);
+    json_write_str(fp,IGNORE_DIMS,ignore_dims);
+    json_write_str(fp,TEXT_DIMS,text_dims);
+    json_write_str(fp,SCORE_DIMS,score_dims);
+    json_write_str(fp,FILTER_STR,make_csv_line(cat_filter,cat_filter_count,';'));
+    json_write_int(fp,DECIMALS,decimals);
+    json_write_int(fp,UNIQUE_SAMPLES,unique_samples);
+    json_write_int(fp,AGGREGATE,aggregate);
+    json_write_str(fp,PROJECTION,projection_string());
+
+    json_write_key(fp,FORMULA,0);
+    putc('[',fp);
     for(i = 0;i < formulas;i++)
     {
-        jformula = json_object_new_string(formula[i].formula);
-        json_object_array_add(jformulas,jformula);
+        if(i) putc(',',fp);
+        json_write_string(fp,formula[i].formula);
     }
-
-    json_object_object_add(globals,FORMULA,jformulas);
-
-    return globals;
+    putc(']',fp);
 }
 
-/* make a json object for a forest, includes samples too
+/* write a forest object, includes samples too
+ * samples are written one at a time, so no copy of forest data is made
  */
-static json_object *
-write_forest(int forest_idx)
+static
+void write_forest(FILE *fp,int forest_idx)
 {
     int i,j;
     struct forest *f = &forest[forest_idx];
+    char *buf = xmalloc(350 + (decimals > 0 ? decimals : 6));   // large enough for "%.*f" of any double
 
-    json_object *jforest = json_object_new_object();
-    json_object *jsamples = json_object_new_array();
-    json_object *jsample;
-    json_object *jdouble;
-    json_object *jcategory = json_object_new_string(NVL(f->category));
-    json_object *jsample_count = json_object_new_int(f->X_count);
-    json_object *jlast_updated = json_object_new_int64(f->last_updated);   // Might work after 19 January 2038...
-    
-    json_object_object_add(jforest,CATEGORY,jcategory);
-    json_object_object_add(jforest,SAMPLE_COUNT,jsample_count);
-    json_object_object_add(jforest,LAST_UPDATED,jlast_updated);
+    json_write_key(fp,CATEGORY,1);
+    json_write_string(fp,f->category);
+    json_write_int(fp,SAMPLE_COUNT,f->X_count);
+    json_write_key(fp,SEEN_ROWS,0);
+    fprintf(fp,"%ld",f->seen_rows);
+    json_write_key(fp,LAST_UPDATED,0);
+    fprintf(fp,"%lld",(long long) f->last_updated);   // Might work after 19 January 2038...
+
+    json_write_key(fp,SAMPLES,0);
+    putc('[',fp);
 
     for(i = 0;i < f->X_count;i++)
     {
-        jsample = json_object_new_array();
-        for(j = 0;j < dimensions;j++)
+        if(i) putc(',',fp);
+        putc('[',fp);
+        if(f->X[i].dimension == NULL)      // sparse sample is an array of [dimension number,value] pairs
         {
-#if !defined HAVE_JSON_C_SET_SERIALIZATION_DOUBLE_FORMAT && defined HAVE_JSON_OBJECT_NEW_DOUBLE_S 
-            char ds[1024];
-            sprintf(ds,double_print,f->X[i].dimension[j]);
-            jdouble = json_object_new_double_s(f->X[i].dimension[j],ds);
-#else
-            jdouble = json_object_new_double(f->X[i].dimension[j]);
-#endif
-            json_object_array_add(jsample,jdouble);
+            for(j = 0;j < f->X[i].nz_count;j++)
+            {
+                if(j) putc(',',fp);
+                fprintf(fp,"[%d,",SAMPLE_NZ_IDX(&f->X[i])[j] + 1);
+                fwrite(buf,1,format_fixed(buf,f->X[i].nz_value[j],decimals),fp);
+                putc(']',fp);
+            }
+        } else
+        {
+            for(j = 0;j < dimensions;j++)
+            {
+                if(j) putc(',',fp);
+                fwrite(buf,1,format_fixed(buf,f->X[i].dimension[j],decimals),fp);
+            }
         }
-        json_object_array_add(jsamples,jsample);
+        putc(']',fp);
     }
 
-    json_object_object_add(jforest,SAMPLES,jsamples);
-
-    return jforest;
+    putc(']',fp);
+    free(buf);
 }
 
-
+/* write global variables as a json object, used in binary forest data
+ */
+void write_globals_json(FILE *fp)
+{
+    putc('{',fp);
+    write_globals(fp);
+    putc('}',fp);
+}
 
 /* write forest data to json file
+ * data is written forest by forest without making a json object of the whole data
  * returns true if json is supported
  */
 
 int write_forest_file_json(char *file_name,time_t delete_interval)
 {
-    int i;
+    int i,first = 1;
     time_t now = time(NULL);
+    FILE *fp = xfopen(file_name,"w",'a');
 
-#if defined HAVE_JSON_C_SET_SERIALIZATION_DOUBLE_FORMAT || defined HAVE_JSON_OBJECT_NEW_DOUBLE_S   // in versions 0.15 and 0.12 or libfastjson
-    sprintf(double_print,"%%.%df",decimals);
-#ifdef HAVE_JSON_C_SET_SERIALIZATION_DOUBLE_FORMAT
-    json_c_set_serialization_double_format(double_print,JSON_C_OPTION_GLOBAL);
-#endif
-#endif
-
-    json_object *root = json_object_new_object();
-    json_object *jglobals;
-    json_object *jforests = json_object_new_array();
-    json_object *jforest;
+    putc('{',fp);
+    json_write_key(fp,GLOBALS,1);
+    putc('{',fp);
+    write_globals(fp);
+    putc('}',fp);
 
-    jglobals = write_globals();
-    json_object_object_add(root,GLOBALS,jglobals);
+    json_write_key(fp,FORESTS,0);
+    putc('[',fp);
 
     for(i = 0;i < forest_count;i++)
     {
         if(delete_interval == (time_t) 0 || (delete_interval > (time_t) 0 && forest[i].last_updated >= now - delete_interval)) 
         {
-            jforest = write_forest(i);
-            json_object_array_add(jforests,jforest);
+            if(!first) putc(',',fp);
+            putc('{',fp);
+            write_forest(fp,i);
+            putc('}',fp);
+            first = 0;
         }
     }
 
-    json_object_object_add(root,FORESTS,jforests);
+    fputs("]}",fp);
 
-    if(json_object_to_file(file_name,root) == -1) panic("Cannot write to file",file_name,"");
-        
-    json_object_put(root);
+    if(ferror(fp) || xfclose(fp) != 0) panic("Cannot write to file",file_name,"");
     return 1;
 }
 
+/* Streaming json reader.
+ * Forest data is read directly from the file using a small recursive descent parser,
+ * no json object of the whole data is made. Samples are stored directly to the sample table.
+ */
+#define JSON_BUFFER_SIZE 65536
+
+static FILE *json_fp;                          // file being read, NULL if data is read from memory
+static char *json_file_name;
+static unsigned char json_file_buf[JSON_BUFFER_SIZE];
+static unsigned char *json_buf;                // data being parsed
+static size_t json_pos,json_len;               // read position and data length in json_buf
+static int json_line;                          // line number for error messages
+static char *json_str = NULL;                  // buffer for string values
+static size_t json_str_cap = 0;
+
+static
+void json_error(char *msg)
+{
+    char sln[50];
+
+    sprintf(sln,"line %d",json_line);
+    panic(msg,json_file_name,sln);
+}
+
+/* read next block of data, returns the first char of the block or EOF
+ */
+static
+int json_fill(void)
+{
+    json_pos = 0;
+    if(json_fp == NULL) return EOF;
+    json_buf = json_file_buf;
+    json_len = fread(json_buf,1,JSON_BUFFER_SIZE,json_fp);
+
+    if(json_len == 0)
+    {
+        if(ferror(json_fp)) panic("Cannot read file: ",json_file_name,strerror(errno));
+        return EOF;
+    }
+    return json_buf[json_pos++];
+}
+
+#define json_getc() (json_pos < json_len ? json_buf[json_pos++] : json_fill())
+
+/* skip white space and return the next char without consuming it
+ */
+static
+int json_peek(void)
+{
+    int c;
+
+    do
+    {
+        c = json_getc();
+        if(c == '\n') json_line++;
+    } while(c == ' ' || c == '\t' || c == '\n' || c == '\r');
+
+    if(c != EOF) json_pos--;
+    return c;
+}
+
+static
+void json_expect(int c)
+{
+    if(json_peek() != c) json_error("Syntax error in JSON file");
+    json_pos++;
+}
+
+/* start reading an object or an array, returns 0 if it is empty
+ */
+static
+int json_begin(int open,int close)
+{
+    json_expect(open);
+
+    if(json_peek() == close)
+    {
+        json_pos++;
+        return 0;
+    }
+    return 1;
+}
+
+/* move to the next member or element, returns 0 at the end of the object or array
+ */
+static
+int json_next(int close)
+{
+    int c = json_peek();
+
+    if(c != ',' && c != close) json_error("Syntax error in JSON file");
+    json_pos++;
+    return c == ',';
+}
+
+static
+unsigned int json_read_hex(void)
+{
+    unsigned int u = 0;
+    int i,c;
+
+    for(i = 0;i < 4;i++)
+    {
+        c = json_getc();
+        if(c >= '0' && c <= '9') u = u * 16 + (c - '0');
+        else if(c >= 'a' && c <= 'f') u = u * 16 + (c - 'a' + 10);
+        else if(c >= 'A' && c <= 'F') u = u * 16 + (c - 'A' + 10);
+        else json_error("Invalid escape in JSON string");
+    }
+    return u;
+}
+
+/* write unicode code point u as utf-8, returns the number of bytes
+ */
+static
+int json_utf8(char *s,unsigned int u)
+{
+    if(u < 0x80)
+    {
+        s[0] = (char) u;
+        return 1;
+    }
+    if(u < 0x800)
+    {
+        s[0] = (char) (0xc0 | (u >> 6));
+        s[1] = (char) (0x80 | (u & 0x3f));
+        return 2;
+    }
+    if(u < 0x10000)
+    {
+        s[0] = (char) (0xe0 | (u >> 12));
+        s[1] = (char) (0x80 | ((u >> 6) & 0x3f));
+        s[2] = (char) (0x80 | (u & 0x3f));
+        return 3;
+    }
+    s[0] = (char) (0xf0 | (u >> 18));
+    s[1] = (char) (0x80 | ((u >> 12) & 0x3f));
+    s[2] = (char) (0x80 | ((u >> 6) & 0x3f));
+    s[3] = (char) (0x80 | (u & 0x3f));
+    return 4;
+}
+
+/* read a json string, escapes are decoded. Returned buffer is valid until the next string is read
+ */
+static
+char *json_read_string(void)
+{
+    size_t len = 0;
+    unsigned int u,u2;
+    int c;
+
+    json_expect('"');
+
+    while((c = json_getc()) != '"')
+    {
+        if(c == EOF) json_error("Unterminated string in JSON file");
+
+        if(len + 8 >= json_str_cap)
+        {
+            json_str_cap = json_str_cap ? 2 * json_str_cap : 256;
+            json_str = xrealloc(json_str,json_str_cap);
+        }
+
+        if(c == '\\')
+        {
+            switch((c = json_getc()))
+            {
+                case '"':
+                case '\\':
+                case '/':
+                    break;
+                case 'b':
+                    c = '\b';
+                    break;
+                case 'f':
+                    c = '\f';
+                    break;
+                case 'n':
+                    c = '\n';
+                    break;
+                case 'r':
+                    c = '\r';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case 'u':
+                    u = json_read_hex();
+                    if(u >= 0xd800 && u < 0xdc00)      // surrogate pair
+                    {
+                        if(json_getc() != '\\' || json_getc() != 'u') json_error("Invalid escape in JSON string");
+                        u2 = json_read_hex();
+                        if(u2 < 0xdc00 || u2 > 0xdfff) json_error("Invalid escape in JSON string");
+                        u = 0x10000 + ((u - 0xd800) << 10) + (u2 - 0xdc00);
+                    }
+                    len += json_utf8(&json_str[len],u);
+                    continue;
+                default:
+                    json_error("Invalid escape in JSON string");
+                    break;
+            }
+        } else if(c == '\n')
+        {
+            json_line++;
+        }
+
+        json_str[len++] = (char) c;
+    }
+
+    if(json_str == NULL) json_str = xrealloc(json_str,json_str_cap = 256);
+    json_str[len] = '\000';
+    return json_str;
+}
+
+/* read a number or a literal (true, false, null) as text. Returned buffer is valid until the next token is read
+ */
+static
+char *json_read_token(void)
+{
+    static char token[400];
+    size_t len = 0;
+    int c;
+
+    json_peek();
+
+    while((c = json_getc()) != EOF && ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.'))
+    {
+        if(len < sizeof(token) - 1) token[len++] = (char) c;
+    }
+
+    if(c != EOF) json_pos--;
+    if(len == 0) json_error("Syntax error in JSON file");
+
+    token[len] = '\000';
+    return token;
+}
+
+static
+double json_read_double(void)
+{
+    char *token = json_read_token();
+    char *end;
+    double d = parse_double(token,&end);
+
+    if(*end) json_error("Invalid number in JSON file");
+    return d;
+}
+
+/* read a string or a number as a newly allocated string
+ */
+static
+char *json_read_scalar(void)
+{
+    return xstrdup(json_peek() == '"' ? json_read_string() : json_read_token());
+}
+
+/* skip a value of an unknown member
+ */
+static
+void json_skip_value(void)
+{
+    switch(json_peek())
+    {
+        case '"':
+            json_read_string();
+            break;
+        case '{':
+            if(json_begin('{','}')) do
+            {
+                json_read_string();
+                json_expect(':');
+                json_skip_value();
+            } while(json_next('}'));
+            break;
+        case '[':
+            if(json_begin('[',']')) do
+            {
+                json_skip_value();
+            } while(json_next(']'));
+            break;
+        default:
+            json_read_token();
+            break;
+    }
+}
+
+/* global variable keys, all except the projection are required
+ */
+enum {G_DIMENSIONS,G_FOREST_COUNT,G_PRINT_STRING,G_PRINTF_FORMAT,G_TREE_COUNT,G_SAMPLES_MAX,G_INPUT_SEPARATOR,G_LIST_SEPARATOR,
+      G_HEADER,G_OUTLIER_SCORE,G_CATEGORY_DIMS,G_LABEL_DIMS,G_INCLUDE_DIMS,G_IGNORE_DIMS,G_TEXT_DIMS,G_SCORE_DIMS,G_FILTER_STR,
+      G_DECIMALS,G_UNIQUE_SAMPLES,G_AGGREGATE,G_PROJECTION,GLOBAL_COUNT};
+
+static char *global_keys[GLOBAL_COUNT] = {DIMENSIONS,FOREST_COUNT,PRINT_STRING,PRINTF_FORMAT,TREE_COUNT,SAMPLES_MAX,INPUT_SEPARATOR,LIST_SEPARATOR,
+      HEADER,OUTLIER_SCORE,CATEGORY_DIMS,LABEL_DIMS,INCLUDE_DIMS,IGNORE_DIMS,TEXT_DIMS,SCORE_DIMS,FILTER_STR,
+      DECIMALS,UNIQUE_SAMPLES,AGGREGATE,PROJECTION};
+
 /* read global variables
-*/
+ */
 static
-void read_globals(json_object *globals)
+void read_globals(void)
 {
     char str[10240];
+    char *value[GLOBAL_COUNT];
+    char **formula_str = NULL;
     char *f[FILTER_MAX];
-    int i,c,fcount;
-
-    json_object *jdims  ;
-    json_object *jforest_count  ;
-    json_object *jprint_string  ;
-    json_object *jprintf_format  ;
-    json_object *jtree_count  ;
-    json_object *jsamples_max  ;
-    json_object *jinput_separator  ;
-    json_object *jlist_separator  ;
-    json_object *jheader  ;
-    json_object *joutlier_score  ;
-    json_object *jcategory_dims  ;
-    json_object *jlabel_dims  ;
-    json_object *jscore_dims  ;
-    json_object *jignore_dims  ;
-    json_object *jinclude_dims  ;
-    json_object *jtext_dims  ;
-    json_object *jfilter_str  ;
-    json_object *jdecimals  ;
-    json_object *junique_samples  ;
-    json_object *jaggregate  ;
-    json_object *jformulas = NULL;
-    json_object *jformula;
-
-    if(!json_object_object_get_ex(globals,DIMENSIONS,&jdims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,FOREST_COUNT,&jforest_count)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,PRINT_STRING,&jprint_string)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,PRINTF_FORMAT,&jprintf_format)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,TREE_COUNT,&jtree_count)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,SAMPLES_MAX,&jsamples_max)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,INPUT_SEPARATOR,&jinput_separator)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,LIST_SEPARATOR,&jlist_separator)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,HEADER,&jheader)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,OUTLIER_SCORE,&joutlier_score)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,CATEGORY_DIMS,&jcategory_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,LABEL_DIMS,&jlabel_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,SCORE_DIMS,&jscore_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,IGNORE_DIMS,&jignore_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,INCLUDE_DIMS,&jinclude_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,TEXT_DIMS,&jtext_dims)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,FILTER_STR,&jfilter_str)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,DECIMALS,&jdecimals)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,UNIQUE_SAMPLES,&junique_samples)) panic("Error in globals object","","");
-    if(!json_object_object_get_ex(globals,AGGREGATE,&jaggregate)) panic("Error in globals object","","");
-    json_object_object_get_ex(globals,FORMULA,&jformulas);
-
-    if(jformulas != NULL)
+    char *key;
+    int i,c,formula_count = 0;
+
+    for(i = 0;i < GLOBAL_COUNT;i++) value[i] = NULL;
+
+    if(json_begin('{','}')) do
     {
-        fcount = json_object_array_length(jformulas);
-        for(i = 0;i < fcount;i++)
+        key = json_read_string();
+        json_expect(':');
+
+        if(strcmp(key,FORMULA) == 0)
+        {
+            if(json_begin('[',']')) do
+            {
+                formula_str = xrealloc(formula_str,(formula_count + 1) * sizeof(char *));
+                formula_str[formula_count] = xstrdup(json_read_string());
+                if(strlen(formula_str[formula_count++]) >= sizeof(str)) panic("Too long value in globals object",FORMULA,"");
+            } while(json_next(']'));
+            continue;
+        }
+
+        for(i = 0;i < GLOBAL_COUNT && strcmp(key,global_keys[i]) != 0;i++);
+
+        if(i < GLOBAL_COUNT)
+        {
+            if(value[i] != NULL) free(value[i]);
+            value[i] = json_read_scalar();
+        } else
         {
-           jformula = json_object_array_get_idx(jformulas,i);
-           strcpy(str,json_object_get_string(jformula));
-           parse_expression(str);
+            json_skip_value();
         }
+    } while(json_next('}'));
+
+    for(i = 0;i < GLOBAL_COUNT;i++)
+    {
+        if(value[i] == NULL && i != G_PROJECTION) panic("Error in globals object",global_keys[i],"");
+        if(strlen(NVL(value[i])) >= sizeof(str)) panic("Too long value in globals object",global_keys[i],"");
     }
 
-    dimensions = json_object_get_int(jdims);
-    if(dimensions > DIM_MAX) dimensions = DIM_MAX;
+    if(merge_read)         // global variables in memory are used
+    {
+        check_merge_globals(atoi(value[G_DIMENSIONS]),value[G_CATEGORY_DIMS],NVL(value[G_PROJECTION]));
+        forest_count = atoi(value[G_FOREST_COUNT]);
 
-    forest_count = json_object_get_int(jforest_count);
-    print_string = xstrdup(json_object_get_string(jprint_string));
-    printf_format = xstrdup(json_object_get_string(jprintf_format));
-    tree_count = json_object_get_int(jtree_count);
-    samples_max = json_object_get_int(jsamples_max);
-    strcpy(str,json_object_get_string(jinput_separator));
-    input_separator = str[0];
-    strcpy(str,json_object_get_string(jlist_separator));
-    list_separator = str[0];
-    header = json_object_get_int(jheader);
+        for(i = 0;i < formula_count;i++) free(formula_str[i]);
+        if(formula_str != NULL) free(formula_str);
+        for(i = 0;i < GLOBAL_COUNT;i++) if(value[i] != NULL) free(value[i]);
+        return;
+    }
 
-    strcpy(str,json_object_get_string(joutlier_score));
-    parse_user_score(str);
+    for(i = 0;i < formula_count;i++)
+    {
+        strcpy(str,formula_str[i]);
+        parse_expression(str);
+        free(formula_str[i]);
+    }
+    if(formula_str != NULL) free(formula_str);
 
-    strcpy(str,json_object_get_string(jcategory_dims));
+    dimensions = atoi(value[G_DIMENSIONS]);
+    set_dim_max(dimensions);
+
+    forest_count = atoi(value[G_FOREST_COUNT]);
+    print_string = xstrdup(value[G_PRINT_STRING]);
+    printf_format = xstrdup(value[G_PRINTF_FORMAT]);
+    tree_count = atoi(value[G_TREE_COUNT]);
+    samples_max = atoi(value[G_SAMPLES_MAX]);
+    input_separator = value[G_INPUT_SEPARATOR][0];
+    list_separator = value[G_LIST_SEPARATOR][0];
+    header = atoi(value[G_HEADER]);
+
+    parse_user_score(value[G_OUTLIER_SCORE]);
+
+    strcpy(str,value[G_CATEGORY_DIMS]);
     category_dims = xstrdup(str);
     category_idx_count = parse_dims(str,category_idx);
 
-    strcpy(str,json_object_get_string(jlabel_dims));
+    strcpy(str,value[G_LABEL_DIMS]);
     label_dims = xstrdup(str);
     label_idx_count = parse_dims(str,label_idx);
 
-    strcpy(str,json_object_get_string(jscore_dims));
+    strcpy(str,value[G_SCORE_DIMS]);
     score_dims = xstrdup(str);
     score_idx_count = parse_dims(str,score_idx);
 
-    strcpy(str,json_object_get_string(jignore_dims));
+    strcpy(str,value[G_IGNORE_DIMS]);
     ignore_dims = xstrdup(str);
     ignore_idx_count = parse_dims(str,ignore_idx);
     
-    strcpy(str,json_object_get_string(jinclude_dims));
+    strcpy(str,value[G_INCLUDE_DIMS]);
     include_dims = xstrdup(str);
     include_idx_count = parse_dims(str,include_idx);
 
-    strcpy(str,json_object_get_string(jtext_dims));
+    strcpy(str,value[G_TEXT_DIMS]);
     text_dims = xstrdup(str);
     text_idx_count = parse_dims(str,text_idx);
 
-    strcpy(str,json_object_get_string(jfilter_str));
+    strcpy(str,value[G_FILTER_STR]);
     c = parse_csv_line(f,FILTER_MAX,str,';');
     for(i = 0;i < c;i++) add_category_filter(f[i]);
 
-    decimals = json_object_get_int(jdecimals);
-    unique_samples = json_object_get_int(junique_samples);
-    aggregate = json_object_get_int(jaggregate);
+    decimals = atoi(value[G_DECIMALS]);
+    unique_samples = atoi(value[G_UNIQUE_SAMPLES]);
+    aggregate = atoi(value[G_AGGREGATE]);
+
+    if(value[G_PROJECTION] != NULL) parse_projection_string(value[G_PROJECTION]);
 
     samples_total = max_total_samples ?  max_total_samples : tree_count * samples_max;  
+
+    for(i = 0;i < GLOBAL_COUNT;i++) if(value[i] != NULL) free(value[i]);
 }
 
-/* read forest data including samples
+/* initialize a forest read from file
  */
-static
-void init_forest(int forest_idx,json_object *jforest)
+void init_saved_forest(int forest_idx)
 {
-    struct forest *f;
-    int i,j,sample_count,attr_count;
-    static double new[DIM_MAX];
-
-    json_object *jsamples;
-    json_object *jsample;
-    json_object *jcategory;
-    json_object *jlast_updated;
-    
-    f = &forest[forest_idx];
-    
-    if(!json_object_object_get_ex(jforest,CATEGORY,&jcategory)) panic("Missing category string","","");
-    f->category = xstrdup(json_object_get_string(jcategory));
-
-    if(!json_object_object_get_ex(jforest,LAST_UPDATED,&jlast_updated)) panic("Missing last updated date","","");;
-    f->last_updated = (time_t) json_object_get_int64(jlast_updated);
+    struct forest *f = &forest[forest_idx];
 
+    f->category = NULL;
+    f->last_updated = (time_t) -1;
+    f->dirty = 0;
     f->c = 0;
     f->heigth_limit = 0;
     f->X = NULL;
@@ -390,6 +700,8 @@ void init_forest(int forest_idx,json_object *jforest)
     f->min = NULL;
     f->max = NULL;
     f->scale_range_idx = -1;
+    f->scale_factor = NULL;
+    f->scale_offset = NULL;
     f->avg = NULL;
     f->summary = NULL;
     f->dim_density = NULL;
@@ -399,95 +711,215 @@ void init_forest(int forest_idx,json_object *jforest)
     f->analyzed_rows = 0;
     f->high_analyzed_rows = 0;
     f->extra_rows = 0;
+    f->seen_rows = -1;
     f->percentage_score = 0.0;
     f->min_score = 1.0;
     f->test_average_score = 0.0;
-    
-    add_forest_hash(forest_idx,f->category);
+}
 
-    f->X_count = 0;
+/* read one sample array. Saved samples are already shuffled, so they are added
+ * directly to the sample table until it is full, rest are added using reservoir sampling.
+ * Sparse samples are arrays of [dimension number,value] pairs
+ */
+static
+void read_sample(struct forest *f)
+{
+    static double *new = NULL;
+    static int *idx = NULL;
+    double *d;
+    int j = 0;
+    int direct = f->X_count < samples_total && !sparse_fields;
 
-    if(json_object_object_get_ex(jforest,SAMPLES,&jsamples))
+    if(new == NULL)
     {
-        sample_count = json_object_array_length(jsamples);   // get number of samples from array
-        f->X_cap = sample_count + 1;
-        f->X = xmalloc(f->X_cap * sizeof(struct sample));
+        new = xmalloc(dimensions * sizeof(double));
+        idx = xmalloc(dimensions * sizeof(int));
+    }
+    d = new;
 
-        for(i = 0;i < sample_count;i++)
+    if(direct)
+    {
+        if(f->X_count >= f->X_cap)
         {
-            jsample = json_object_array_get_idx(jsamples,i);
-            attr_count = json_object_array_length(jsample);
-
-            for(j = 0;j < attr_count;j++) new[j] = json_object_get_double(json_object_array_get_idx(jsample,j));
-            for(j = attr_count;j < dimensions;j++)  new[j] = 0.0;     // reset rest, if array is shorter than expected, should not happen
+            f->X_cap = f->X_cap ? 2 * f->X_cap : 32;
+            f->X = xrealloc(f->X,f->X_cap * sizeof(struct sample));
+        }
+        d = xmalloc(dimensions * sizeof(double));
+    }
 
-            add_to_X(f,new,attr_count,1);
+    if(json_begin('[',']'))
+    {
+        if(json_peek() == '[')
+        {
+            if(!sparse_fields) panic("Forest data has sparse samples, give option -x before reading it",json_file_name,NULL);
+
+            do
+            {
+                if(j >= dimensions) json_error("Too many values in sparse sample");
+                json_expect('[');
+                idx[j] = atoi(json_read_token()) - 1;
+                json_expect(',');
+                new[j++] = json_read_double();
+                json_expect(']');
+            } while(json_next(']'));
+
+            add_sparse_to_X(f,j,idx,new);
+            return;
         }
+
+        do
+        {
+            if(j < dimensions)
+            {
+                d[j++] = json_read_double();
+            } else
+            {
+                json_read_double();
+            }
+        } while(json_next(']'));
+    } else if(sparse_fields)
+    {
+        add_sparse_to_X(f,0,idx,new);
+        return;
+    }
+
+    for(;j < dimensions;j++) d[j] = 0.0;     // reset rest, if array is shorter than expected, should not happen
+
+    if(direct)
+    {
+        f->X[f->X_count].dimension = d;
+        f->X[f->X_count].scaled_dimension = NULL;
+        f->X[f->X_count].cluster_center_idx = -1;
+        f->X_count++;
     } else
     {
-        f->X_cap = f->X_count + 1;
-        f->X = xmalloc(f->X_cap * sizeof(struct sample));
+        add_to_X(f,new,dimensions,1);
     }
 }
 
-
-/* read json formatted forest data into memory
+/* read forest data including samples
  */
-int read_forest_file_json(char *file_name)
+static
+void read_forest(int forest_idx)
 {
-    int forest_idx;
-
-    json_object *root = json_object_from_file(file_name);
-    json_object *globals;
-    json_object *forests;
+    struct forest *f = &forest[forest_idx];
+    char *key;
+    int sample_count = -1;
 
-    if(!root) panic("Cannot read file: ",file_name,"");
+    init_saved_forest(forest_idx);
 
-    if(json_object_object_get_ex(root,GLOBALS,&globals))
+    if(json_begin('{','}')) do
     {
-        read_globals(globals);
-    } else
+        key = json_read_string();
+        json_expect(':');
+
+        if(strcmp(key,CATEGORY) == 0)
+        {
+            if(f->category != NULL) free(f->category);
+            f->category = xstrdup(json_read_string());
+        } else if(strcmp(key,LAST_UPDATED) == 0)
+        {
+            f->last_updated = (time_t) atoll(json_read_token());
+        } else if(strcmp(key,SEEN_ROWS) == 0)
+        {
+            f->seen_rows = atol(json_read_token());
+        } else if(strcmp(key,SAMPLE_COUNT) == 0)
+        {
+            sample_count = atoi(json_read_token());      // preallocate sample table
+            if(f->X_cap < sample_count + 1 && sample_count >= 0)
+            {
+                f->X_cap = sample_count + 1;
+                f->X = xrealloc(f->X,f->X_cap * sizeof(struct sample));
+            }
+        } else if(strcmp(key,SAMPLES) == 0)
+        {
+            if(json_begin('[',']')) do
+            {
+                read_sample(f);
+            } while(json_next(']'));
+        } else
+        {
+            json_skip_value();
+        }
+    } while(json_next('}'));
+
+    if(f->category == NULL) panic("Missing category string","","");
+    if(f->last_updated == (time_t) -1) panic("Missing last updated date","","");
+    if(f->seen_rows < 0) f->seen_rows = sample_count >= 0 ? sample_count : f->X_count;    // saved before row counts were saved
+
+    if(f->X == NULL)
     {
-        panic("No globals in JSON file","","");
+        f->X_cap = 1;
+        f->X = xmalloc(f->X_cap * sizeof(struct sample));
     }
-    
-    if(json_object_object_get_ex(root,FORESTS,&forests))
+
+    add_forest_hash(forest_idx,f->category);
+}
+
+/* read json formatted forest data into memory
+ */
+int read_forest_file_json(char *file_name)
+{
+    char *key;
+    int globals_read = 0;
+
+    json_fp = xfopen(file_name,"r",'a');
+    json_file_name = file_name;
+    json_buf = json_file_buf;
+    json_pos = 0;
+    json_len = 0;
+    json_line = 1;
+
+    if(json_begin('{','}')) do
     {
-        forest_count = json_object_array_length(forests);         // get actual forest count from array
+        key = json_read_string();
+        json_expect(':');
 
-        forest_cap = forest_count + 1;
-        forest = xmalloc(forest_cap * sizeof(struct forest));     // allocate forest table
+        if(strcmp(key,GLOBALS) == 0)
+        {
+            read_globals();
+            globals_read = 1;
 
-        for(forest_idx = 0;forest_idx < forest_count;forest_idx++)
+            forest_cap = forest_count + 1;
+            forest_count = 0;                                          // get actual forest count from array
+            forest = xmalloc(forest_cap * sizeof(struct forest));     // allocate forest table
+        } else if(strcmp(key,FORESTS) == 0)
+        {
+            if(!globals_read) panic("No globals in JSON file","","");
+
+            if(json_begin('[',']')) do
+            {
+                if(forest_count >= forest_cap)
+                {
+                    forest_cap *= 2;
+                    forest = xrealloc(forest,forest_cap * sizeof(struct forest));
+                }
+                read_forest(forest_count);
+                forest_count++;
+            } while(json_next(']'));
+        } else
         {
-            init_forest(forest_idx,json_object_array_get_idx(forests,forest_idx));
+            json_skip_value();
         }
-    } else
-    {
-        forest_count = 0;
-        forest_cap = forest_count + 1;
-        forest = xmalloc(forest_cap * sizeof(struct forest));     // allocate forest table
-    }
+    } while(json_next('}'));
 
-    json_object_put(root);
+    if(!globals_read) panic("No globals in JSON file","","");
 
-    return 1;
-}
-
-#else
+    xfclose(json_fp);
 
-/* no json-c support cases
- *  */
-int
-write_forest_file_json(char *file_name,time_t delete_interval)
-{
-    return 0;
+    return 1;
 }
 
-int read_forest_file_json(char *file_name)
+/* read global variables from a json object in memory, used in binary forest data
+ */
+void read_globals_json(char *buf,size_t len,char *file_name)
 {
-    panic("JSON not implemented","","");
-    return 0;
+    json_fp = NULL;
+    json_file_name = file_name;
+    json_buf = (unsigned char *) buf;
+    json_pos = 0;
+    json_len = len;
+    json_line = 1;
+
+    read_globals();
 }
-
-#endif
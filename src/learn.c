@@ -29,9 +29,12 @@
 static double fast_n_cache[FAST_N_SAMPLES];
 static double fast_c_cache[FAST_C_SAMPLES];
 
-static char input_line[INPUT_LEN_MAX];
 static time_t now;
+
+/* index of the k:th dimension in dimension index table, NULL table means all dimensions */
+#define DIM_IDX(idx,k) ((idx) == NULL ? (k) : (idx)[k])
 static double centroid_tresshold = CENTROID_TRESSHOLD;
+static int forests_trained = 0;                   // forests are trained, forests read later from shards are trained when read
 
 /* hash function for hash table
  * calculates hash for string s
@@ -50,10 +53,32 @@ size_t hash(char *s)
     return (size_t) (h % HASH_MAX);
 }
 
-/* search forest hash 
- * return -1 if not found, else index to forest table
+/* hash of a category string, same on all platforms. Used to split categories to shards
  */
-int search_forest_hash(char *category_string)
+unsigned int category_hash(char *s)
+{
+    unsigned int h = 5381;
+    int c;
+
+    while ((c = (unsigned char) *s++) != 0)
+    {
+        h = ((h << 5) + h) + c;
+    }
+
+    return h;
+}
+
+/* check if a category belongs to the category shard handled by this process (--shard)
+ */
+int own_category(char *category_string)
+{
+    return !category_shards || category_hash(category_string) % (unsigned int) category_shards == (unsigned int) category_shard;
+}
+
+/* search forest from forests in memory
+ */
+static
+int find_forest_hash(char *category_string)
 {
     int i;
     size_t h = hash(category_string);
@@ -66,6 +91,27 @@ int search_forest_hash(char *category_string)
     return -1;
 }
 
+/* search forest hash 
+ * If forest data is read from a directory the shard of the category is read when the category is not found.
+ * Rows can be analyzed by several threads, so this is done under a lock until all shards are read
+ * return -1 if not found, else index to forest table
+ */
+int search_forest_hash(char *category_string)
+{
+    int i;
+
+    if(!__atomic_load_n(&forest_shards_pending,__ATOMIC_ACQUIRE)) return find_forest_hash(category_string);
+
+    lock_shared();
+
+    i = find_forest_hash(category_string);
+    if(i == -1 && read_forest_shard(category_string)) i = find_forest_hash(category_string);
+
+    unlock_shared();
+
+    return i;
+}
+
 /*
  * Add new entry to foretst hash 
  * idx is index to forest table
@@ -85,6 +131,103 @@ void add_forest_hash(int idx, char *category_string)
     fhash[h].idx_count++;
 }
 
+/* remove the entry of forest idx from forest hash
+ */
+static
+void remove_forest_hash(int idx, char *category_string)
+{
+    size_t h = hash(category_string);
+    int i;
+
+    for(i = 0;i < fhash[h].idx_count;i++)
+    {
+        if(fhash[h].idx[i] == (size_t) idx)
+        {
+            fhash[h].idx[i] = fhash[h].idx[--fhash[h].idx_count];
+            return;
+        }
+    }
+}
+
+/* free all memory of forest f, used when a forest is removed or replaced
+ */
+void free_forest(struct forest *f)
+{
+    int i,j;
+    struct node *n;
+
+    for(i = 0;i < f->X_count;i++) free_sample(&f->X[i]);
+    if(f->X != NULL) free(f->X);
+
+    if(f->t != NULL)
+    {
+        for(i = 0;i < tree_count;i++)
+        {
+            for(j = 0;j < f->t[i].node_count;j++)
+            {
+                n = &f->t[i].n[j];
+                free(n->n);
+                if(n->n_idx != NULL) free(n->n_idx);
+                if(n->samples != NULL) free(n->samples);
+            }
+            if(f->t[i].n != NULL) free(f->t[i].n);
+        }
+        free(f->t);
+    }
+
+    if(f->category != NULL) free(f->category);
+    if(f->min != NULL) free(f->min);
+    if(f->max != NULL) free(f->max);
+    if(f->scale_factor != NULL) free(f->scale_factor);
+    if(f->scale_offset != NULL) free(f->scale_offset);
+    if(f->avg != NULL) free(f->avg);
+    if(f->dim_density != NULL) free(f->dim_density);
+    if(f->summary != NULL) free(f->summary);
+
+    f->X = NULL;
+    f->X_count = 0;
+    f->t = NULL;
+    f->category = NULL;
+}
+
+/* remove forests first...forest_count - 1 read from forest data which belong to other category shards (--shard)
+ */
+void drop_other_shards(int first)
+{
+    int i,n = first;
+    struct forest *f;
+
+    if(!category_shards) return;
+
+    for(i = first;i < forest_count;i++) remove_forest_hash(i,forest[i].category);
+
+    for(i = first;i < forest_count;i++)
+    {
+        f = &forest[i];
+
+        if(own_category(f->category))
+        {
+            forest[n] = *f;
+            add_forest_hash(n,forest[n].category);
+            n++;
+        } else
+        {
+            free_forest(f);
+        }
+    }
+
+    forest_count = n;
+}
+
+/* remove all entries from forest hash, space is kept for new entries
+ */
+void clear_forest_hash()
+{
+    int i;
+
+    for(i = 0;i < HASH_MAX;i++) fhash[i].idx_count = 0;
+}
+
 /* generate a random integer from range min...max
  */ 
 inline int ri(int min, int max)
@@ -107,7 +250,7 @@ inline double rd(double min, double max)
 
    Making string compare here, for large number of forests hash based search would be faster
 
-   returns index to forest table
+   returns index to forest table, -1 if the category belongs to an other category shard (--shard)
  */
 static
 int select_forest(int value_count,char **values)
@@ -118,10 +261,16 @@ int select_forest(int value_count,char **values)
 
     category_string = make_category_string(value_count,values);
 
+    if(!own_category(category_string)) return -1;
+
     i = search_forest_hash(category_string);
    
     if(i >= 0) {
-        if(forest[i].last_updated != now) forest[i].last_updated = now;
+        if(forest[i].last_updated != now)
+        {
+            forest[i].last_updated = now;
+            forest[i].dirty = 1;
+        }
         return i;
     }
 
@@ -142,17 +291,21 @@ int select_forest(int value_count,char **values)
    forest[forest_count].min = NULL;
    forest[forest_count].max = NULL;
    forest[forest_count].scale_range_idx = -1;
+   forest[forest_count].scale_factor = NULL;
+   forest[forest_count].scale_offset = NULL;
    forest[forest_count].summary = NULL;
    forest[forest_count].c = 0;
    forest[forest_count].heigth_limit = 0;
    forest[forest_count].analyzed = 0;
    forest[forest_count].last_updated = now;
+   forest[forest_count].dirty = 1;
    forest[forest_count].avg = xmalloc(dimensions * sizeof(double));
    forest[forest_count].dim_density = xmalloc(dimensions * sizeof(double));
    forest[forest_count].total_rows = 0;
    forest[forest_count].analyzed_rows = 0;
    forest[forest_count].high_analyzed_rows = 0;
    forest[forest_count].extra_rows = 0;
+   forest[forest_count].seen_rows = 0;
    forest[forest_count].percentage_score = 0.0;
    forest[forest_count].min_score = 1.0;
    forest[forest_count].test_average_score = 0.0;
@@ -194,6 +347,145 @@ int v_cmp(double *t,double *s)
     return memcmp(t,s,dimensions * sizeof(double));
 }
 
+/* Samples are stored as dimension arrays or with sparse input (-x) as non zero values and their dimension indices.
+ * Sparse sample storage is allocated as one block having the values followed by the indices.
+ */
+static
+void alloc_sparse_sample(struct sample *s,int count)
+{
+    s->nz_count = count;
+    s->nz_value = xmalloc(count ? count * (sizeof(double) + sizeof(int)) : 1);
+}
+
+/* initialize an empty sample, dimension values of a dense sample are not initialized
+ */
+static
+void new_sample(struct sample *s)
+{
+    s->dimension = sparse_fields ? NULL : xmalloc(dimensions * sizeof(double));
+    s->scaled_dimension = NULL;
+    s->nz_count = 0;
+    s->cluster_center_idx = -1;
+    if(sparse_fields) alloc_sparse_sample(s,0);
+}
+
+/* free the values of sample s
+ */
+void free_sample(struct sample *s)
+{
+    if(s->dimension != NULL)
+    {
+        free(s->dimension);
+        if(s->scaled_dimension != NULL) free(s->scaled_dimension);
+    } else if(s->nz_value != NULL)
+    {
+        free(s->nz_value);
+    }
+    s->dimension = NULL;
+    s->scaled_dimension = NULL;
+}
+
+/* set the values of sample s from dimension array v, sparse samples keep only the non zero values
+ */
+static
+void set_sample(struct sample *s,double *v)
+{
+    int i,count = 0;
+
+    if(s->dimension != NULL)
+    {
+        v_copy(s->dimension,v);
+        return;
+    }
+
+    for(i = 0;i < dimensions;i++) if(v[i] != 0.0) count++;
+
+    if(s->nz_value != NULL) free(s->nz_value);
+    alloc_sparse_sample(s,count);
+
+    for(i = 0,count = 0;i < dimensions;i++)
+    {
+        if(v[i] != 0.0)
+        {
+            SAMPLE_NZ_IDX(s)[count] = i;
+            s->nz_value[count++] = v[i];
+        }
+    }
+}
+
+/* make a copy of sample s to t
+ */
+static
+void copy_sample(struct sample *t,struct sample *s)
+{
+    *t = *s;
+
+    if(s->dimension != NULL)
+    {
+        t->dimension = v_dup(s->dimension);
+        if(s->scaled_dimension != NULL) t->scaled_dimension = v_dup(s->scaled_dimension);
+    } else
+    {
+        alloc_sparse_sample(t,s->nz_count);
+        memcpy(t->nz_value,s->nz_value,s->nz_count * sizeof(double));
+        memcpy(SAMPLE_NZ_IDX(t),SAMPLE_NZ_IDX(s),s->nz_count * sizeof(int));
+    }
+}
+
+/* return the dimension array of sample s. Sparse samples are expanded to a buffer which is valid until the next call
+ */
+double *sample_values(struct sample *s)
+{
+    static THREAD_LOCAL double *v = NULL;
+    int i;
+
+    if(s->dimension != NULL) return s->dimension;
+
+    if(v == NULL) v = xmalloc(dimensions * sizeof(double));
+
+    for(i = 0;i < dimensions;i++) v[i] = 0.0;
+    for(i = 0;i < s->nz_count;i++) v[SAMPLE_NZ_IDX(s)[i]] = s->nz_value[i];
+
+    return v;
+}
+
+/* return the value of dimension j of sample s
+ */
+double sample_value(struct sample *s,int j)
+{
+    int low = 0,high;
+    int mid;
+
+    if(s->dimension != NULL) return s->dimension[j];
+
+    high = s->nz_count - 1;
+
+    while(low <= high)
+    {
+        mid = (low + high) / 2;
+        if(SAMPLE_NZ_IDX(s)[mid] == j) return s->nz_value[mid];
+        if(SAMPLE_NZ_IDX(s)[mid] < j) low = mid + 1; else high = mid - 1;
+    }
+
+    return 0.0;
+}
+
+/* check if sample s has the values of v, count is the number of non zero values in v for sparse samples
+ */
+static
+int sample_equal(struct sample *s,double *v,int count)
+{
+    int i;
+
+    if(s->dimension != NULL) return v_cmp(v,s->dimension) == 0;
+
+    if(s->nz_count != count) return 0;
+
+    for(i = 0;i < count;i++) if(v[SAMPLE_NZ_IDX(s)[i]] != s->nz_value[i]) return 0;
+
+    return 1;
+}
+
 
 /* parse single numeric sample attribute. data expression is called to evaluate possible expression
    return 0 in case number cannot be parsed
@@ -202,7 +494,7 @@ double parse_dim_attribute_expr(int data_idx, int value_count, char **values)
 {
     double d;
 
-    d = atof(evaluate_data_expression(data_idx,value_count,values));
+    d = evaluate_data_value(data_idx,value_count,values);
 
     return isnan(d) ? 0.0 : d;
 }
@@ -212,7 +504,7 @@ double parse_dim_attribute(char *value)
 {
     double d;
 
-    d = atof(value);
+    d = parse_double(value,NULL);
 
     return isnan(d) ? 0.0 : d;
 }
@@ -256,31 +548,56 @@ double parse_dim_hash_attribute(char *value)
  */
 void parse_values(double *dim,char **values, int value_count, int saved)
 {
-    int i;
+    int i,count = dimensions;
+    static THREAD_LOCAL double *raw = NULL;
+    double *target = dim;
 
-    for(i = 0;i < dimensions;i++)
+    if(projection_dims && !saved)       // input attributes are parsed to raw and projected to dim, saved samples are allready projected
+    {
+        count = projection_input_dims;
+        if(raw == NULL) raw = xmalloc(projection_input_dims * sizeof(double));
+        target = raw;
+    }
+
+    for(i = 0;i < count;i++)
     {
         // silently ignore missing input dimension values
         if((saved ? i : dim_idx[i]) < value_count)
         {
             if(saved)
             {
-                dim[i] = parse_dim_attribute(values[i]);
+                target[i] = parse_dim_attribute(values[i]);
             } else
             {
-                if(check_idx(dim_idx[i],text_idx_count,text_idx))
-                {
-                    dim[i] = parse_dim_hash_attribute(values[dim_idx[i]]);
-                } else
+                switch(column_role[dim_idx[i]] & (COLUMN_TEXT | COLUMN_EXPRESSION))
                 {
-                    dim[i] = parse_dim_attribute_expr(dim_idx[i],value_count,values);
+                    case 0:
+                        if(column_number(values,dim_idx[i],&target[i]))  // columnar input is allready parsed
+                        {
+                            if(isnan(target[i])) target[i] = 0.0;
+                        } else if(values[dim_idx[i]][0] == '0' && values[dim_idx[i]][1] == '\000')    // most fields of sparse rows are zero
+                        {
+                            target[i] = 0.0;
+                        } else
+                        {
+                            target[i] = parse_dim_attribute(values[dim_idx[i]]);
+                        }
+                        break;
+                    case COLUMN_EXPRESSION:
+                        target[i] = parse_dim_attribute_expr(dim_idx[i],value_count,values);
+                        break;
+                    default:
+                        target[i] = parse_dim_hash_attribute(values[dim_idx[i]]);
+                        break;
                 }
             }
         } else
         {
-            dim[i] = 0.0;   // use default value for missing dimension values
+            target[i] = 0.0;   // use default value for missing dimension values
         }
     }
+
+    if(target != dim) project(raw,dim);
 }
 
 /* check if dimension values are allready in sample table X
@@ -288,20 +605,24 @@ void parse_values(double *dim,char **values, int value_count, int saved)
 static
 int duplicate_sample(struct forest *f,double *new_dim)
 {
-    int i;
+    int i,count = 0;
+
+    if(sparse_fields) for(i = 0;i < dimensions;i++) if(new_dim[i] != 0.0) count++;
 
     for(i = 0;i < f->X_count;i++)
     {
-        if(v_cmp(new_dim,f->X[i].dimension) == 0) return 1;
+        if(sample_equal(&f->X[i],new_dim,count)) return 1;
     }
     return 0;
 }
 
-/* return scaled or non scaled sample dimension. Select dim using auto_weigth
+/* return scaled or non scaled sample dimension. Select dim using auto_weigth.
+ * Sparse samples are expanded and scaled to buffers which are valid until the next call
  */
 inline double *
-sample_dimension(struct sample *s)
+sample_dimension(struct sample *s,struct forest *f)
 {
+    if(s->dimension == NULL) return auto_weigth ? scale_dimension(sample_values(s),f) : sample_values(s);
     return auto_weigth ? s->scaled_dimension : s->dimension;
 }
 
@@ -332,6 +653,8 @@ void add_to_X(struct forest *f,double *new, int value_count,int saved)
 
     DEBUG(", Not a duplicate,");
 
+    if(!saved) f->seen_rows++;
+
     if(f->X_count >= f->X_cap) {
         if(f->X_cap == 0) f->X_cap = 32;
         f->X_cap *= 2;
@@ -345,15 +668,13 @@ void add_to_X(struct forest *f,double *new, int value_count,int saved)
         if(f->X_count == 0)
         {
             sample_idx = f->X_count;
-            f->X[sample_idx].dimension = xmalloc(dimensions * sizeof(double));
-            f->X[sample_idx].scaled_dimension = NULL;                            
+            new_sample(&f->X[sample_idx]);
         } else
         {
             sample_idx = ri(0,f->X_count - 1);             // ceif does not work well with sorted samples, make sure that  samples are shuffled
-            f->X[f->X_count].dimension = v_dup(f->X[sample_idx].dimension);
-            f->X[f->X_count].scaled_dimension = NULL;
+            copy_sample(&f->X[f->X_count],&f->X[sample_idx]);  // copy the random sample to the end, keeps sample storage in table order
+            f->X[f->X_count].cluster_center_idx = -1;
         }
-        f->X[f->X_count].cluster_center_idx = -1;
         f->X_count++;
     } else
     {
@@ -365,11 +686,53 @@ void add_to_X(struct forest *f,double *new, int value_count,int saved)
         if(sample_idx >= f->X_count) return;         // check if old sample should be replaced with this or not
     }
 
-    v_copy(f->X[sample_idx].dimension,new);
+    set_sample(&f->X[sample_idx],new);
+    if(!saved) f->dirty = 1;
 
     DEBUG("\n");
 }
 
+/* add a saved sparse sample to forest f. Sample has count non zero values in value and their dimension indices in idx.
+ * Saved samples are already shuffled, so they are added directly to the sample table until it is full, rest are added using reservoir sampling
+ */
+void add_sparse_to_X(struct forest *f,int count,int *idx,double *value)
+{
+    static double *new = NULL;
+    struct sample *s;
+    int i;
+
+    for(i = 0;i < count;i++)
+    {
+        if(idx[i] < 0 || idx[i] >= dimensions || (i && idx[i] <= idx[i - 1])) panic("Invalid sparse sample in forest data",f->category,NULL);
+    }
+
+    if(f->X_count < samples_total)
+    {
+        if(f->X_count >= f->X_cap)
+        {
+            f->X_cap = f->X_cap ? 2 * f->X_cap : 32;
+            f->X = xrealloc(f->X,f->X_cap * sizeof(struct sample));
+        }
+
+        s = &f->X[f->X_count++];
+
+        s->dimension = NULL;
+        s->scaled_dimension = NULL;
+        s->cluster_center_idx = -1;
+        alloc_sparse_sample(s,count);
+        memcpy(s->nz_value,value,count * sizeof(double));
+        memcpy(SAMPLE_NZ_IDX(s),idx,count * sizeof(int));
+    } else
+    {
+        if(new == NULL) new = xmalloc(dimensions * sizeof(double));
+
+        for(i = 0;i < dimensions;i++) new[i] = 0.0;
+        for(i = 0;i < count;i++) new[idx[i]] = value[i];
+
+        add_to_X(f,new,dimensions,1);
+    }
+}
+
 /* Aggregate new values for a certain sample item in a forest.
  * if forest -> X_summary == -1, this is the first data to be aggregated
  * if forest -> X_summary > -1, this is the index to X where data is aggregated
@@ -380,7 +743,9 @@ add_aggregate(struct forest *f,char **values, int value_count)
 {
     int i,sample_idx;
     double *s;
-    static double new[DIM_MAX];
+    static double *new = NULL;
+
+    if(new == NULL) new = xmalloc(dimensions * sizeof(double));
 
     parse_values(new,values,value_count,0); 
     DEBUG("Adding dimension to be aggregated to forest %s: ",f->category);
@@ -396,14 +761,14 @@ add_aggregate(struct forest *f,char **values, int value_count)
     if(f->X_summary > -1)
     {
         sample_idx = f->X_summary;
+        s = sample_values(&f->X[sample_idx]);     // dense samples are updated in place
     } else
     {
         if(f->X_count < samples_total)    // check the samples table size
         {
             DEBUG(" Adding as a new item to sample table,");
             sample_idx = f->X_count;
-            f->X[sample_idx].dimension = xmalloc(dimensions * sizeof(double));
-            f->X[sample_idx].scaled_dimension = NULL;
+            new_sample(&f->X[sample_idx]);
             f->X_count++;
         } else                                          // max number of samples in X
         {
@@ -412,16 +777,19 @@ add_aggregate(struct forest *f,char **values, int value_count)
         }
 
         f->X_summary = sample_idx;
+        f->seen_rows++;
+
+        s = sample_values(&f->X[sample_idx]);
 
-        for(i = 0;i < dimensions;i++) f->X[sample_idx].dimension[i] = 0.0; // init summary
+        for(i = 0;i < dimensions;i++) s[i] = 0.0; // init summary
     }
     
-    s = f->X[sample_idx].dimension;
-
     for(i = 0;i < dimensions;i++) s[i] += new[i];
+    if(f->X[sample_idx].dimension == NULL) set_sample(&f->X[sample_idx],s);
+    f->dirty = 1;
 
     DEBUG(" Aggegated values so far: ");
-    DEBUG_ARRAY(dimensions,f->X[sample_idx].dimension);
+    DEBUG_ARRAY(dimensions,s);
     DEBUG("\n");
 }
 
@@ -430,8 +798,10 @@ add_aggregate(struct forest *f,char **values, int value_count)
 static
 void calculate_stats(struct forest *f)
 {
-    int i,j;
+    int i,j,k;
     double *s;
+    static int *nz_count = NULL;
+    static int nz_cap = 0;
 
     if(f->min == NULL)
     {
@@ -441,6 +811,47 @@ void calculate_stats(struct forest *f)
 
     if(f->avg == NULL) f->avg = xmalloc(dimensions * sizeof(double));
 
+    if(sparse_fields)          // only non zero values are visited, zero is included if a dimension has zero values
+    {
+        DIM_BUFFER(nz_count,nz_cap);
+
+        for(j = 0;j < dimensions;j++)
+        {
+            nz_count[j] = 0;
+            f->avg[j] = 0.0;
+        }
+
+        for(i = 0;i < f->X_count;i++)
+        {
+            for(k = 0;k < f->X[i].nz_count;k++)
+            {
+                j = SAMPLE_NZ_IDX(&f->X[i])[k];
+
+                if(!nz_count[j]++)
+                {
+                    f->min[j] = f->X[i].nz_value[k];
+                    f->max[j] = f->X[i].nz_value[k];
+                } else
+                {
+                    if(f->X[i].nz_value[k] < f->min[j]) f->min[j] = f->X[i].nz_value[k];
+                    if(f->X[i].nz_value[k] > f->max[j]) f->max[j] = f->X[i].nz_value[k];
+                }
+                f->avg[j] += f->X[i].nz_value[k];
+            }
+        }
+
+        for(j = 0;j < dimensions;j++)
+        {
+            if(nz_count[j] < f->X_count)
+            {
+                if(!nz_count[j] || f->min[j] > 0.0) f->min[j] = 0.0;
+                if(!nz_count[j] || f->max[j] < 0.0) f->max[j] = 0.0;
+            }
+            f->avg[j] /= (double) f->X_count;
+        }
+        return;
+    }
+
     for(i = 0;i < f->X_count;i++)
     {
         s = f->X[i].dimension;
@@ -534,12 +945,14 @@ double N()
  * returns pointer to vector
  * */
 static 
-double *calculate_n()
+double *calculate_n(int count)
 {
     int i;
-    static double n[DIM_MAX];
+    static double *n = NULL;
 
-    for(i = 0;i < dimensions;i++)
+    if(n == NULL) n = xmalloc(dimensions * sizeof(double));
+
+    for(i = 0;i < count;i++)
     {
         n[i] = N();
     }
@@ -571,6 +984,37 @@ double v_dist_nosqrt(double *a, double *b)
     return d;
 }
 
+/* calculate the distance of two samples, the sqrt is left out.
+ * Non zero values of sparse samples are merged using their sorted indices
+ * */
+double sample_dist_nosqrt(struct sample *a,struct sample *b)
+{
+    int i = 0,j = 0;
+    double d = 0.0;
+
+    if(a->dimension != NULL) return v_dist_nosqrt(a->dimension,b->dimension);
+
+    while(i < a->nz_count || j < b->nz_count)
+    {
+        if(j == b->nz_count || (i < a->nz_count && SAMPLE_NZ_IDX(a)[i] < SAMPLE_NZ_IDX(b)[j]))
+        {
+            d += POW2(a->nz_value[i]);
+            i++;
+        } else if(i == a->nz_count || SAMPLE_NZ_IDX(b)[j] < SAMPLE_NZ_IDX(a)[i])
+        {
+            d += POW2(b->nz_value[j]);
+            j++;
+        } else
+        {
+            d += POW2(a->nz_value[i] - b->nz_value[j]);
+            i++;
+            j++;
+        }
+    }
+
+    return d;
+}
+
 /* calculate the distance of two samples  */
 double v_dist(double *a, double *b)
 {
@@ -600,44 +1044,70 @@ void set_centroid_tresshold(double new)
  * In more deeper nodes the sample cetroid is used as p, this ensures more balanced tree (hopefully)
  */
 static
-double *generate_p(int sample_count,int *samples,struct sample *X,double heigth_ratio, double *max, double *min)
+double *generate_p(int sample_count,int *samples,struct sample *X,double heigth_ratio, double *max, double *min,int dim_count,int *dim_idx)
 {
-    int i,j;
+    int i,j,k;
     int random_sample;
     static int start = 1;
     double *n_vector;
-    static double p[DIM_MAX];
+    static double *p = NULL;
+    struct sample *s;
+
+    if(p == NULL) p = xmalloc(dimensions * sizeof(double));
 
     if(heigth_ratio < centroid_tresshold)  // In deeper nodes of tree use sample centroid as p, take only every other sample, speeds things and adds ramdomness
     {
         DEBUG("(centroid)");
     
-        for(i = 0;i < dimensions;i++) p[i] = 0.0;
+        for(k = 0;k < dim_count;k++) p[DIM_IDX(dim_idx,k)] = 0.0;
 
         start = 1 - start;
 
-        for(i = start;i < sample_count;i += 2)
+        if(sparse_fields)       // non zero values of sparse samples are in node dimensions
+        {
+            for(i = start;i < sample_count;i += 2)
+            {
+                s = &X[samples[i]];
+                for(k = 0;k < s->nz_count;k++) p[SAMPLE_NZ_IDX(s)[k]] += s->nz_value[k];
+            }
+        } else
         {
-            for(j = 0;j < dimensions;j++)  p[j] += X[samples[i]].dimension[j];
+            for(i = start;i < sample_count;i += 2)
+            {
+                s = &X[samples[i]];
+                for(k = 0;k < dim_count;k++)
+                {
+                    j = DIM_IDX(dim_idx,k);
+                    p[j] += s->dimension[j];
+                }
+            }
         }
 
-        for(i = 0;i < dimensions;i++) p[i] /= (double) (sample_count >> 1);  // turn to average, divide by sample_count / 2
+        for(k = 0;k < dim_count;k++) p[DIM_IDX(dim_idx,k)] /= (double) (sample_count >> 1);  // turn to average, divide by sample_count / 2
     } else
     {
         DEBUG("(random)");
         // get a random sample point
         random_sample = ri(0,sample_count - 1);
+        s = &X[samples[random_sample]];
 
         // copy random sample to p vector 
-        v_copy(p,X[samples[random_sample]].dimension);
-    
+        if(sparse_fields)
+        {
+            for(k = 0;k < dim_count;k++) p[dim_idx[k]] = 0.0;
+            for(k = 0;k < s->nz_count;k++) p[SAMPLE_NZ_IDX(s)[k]] = s->nz_value[k];
+        } else
+        {
+            for(k = 0;k < dim_count;k++) p[DIM_IDX(dim_idx,k)] = s->dimension[DIM_IDX(dim_idx,k)];
+        }
     
-        n_vector = calculate_n();
+        n_vector = calculate_n(dim_count);
 
         // Add adjustment vector
 
-        for(i = 0;i < dimensions;i++) {
-            p[i] += n_vector[i] * heigth_ratio * (max[i] - min[i] > 0.0 ? (max[i] - min[i]) / 2.0 : 0.5);   // move sample by adjustment
+        for(k = 0;k < dim_count;k++) {
+            i = DIM_IDX(dim_idx,k);
+            p[i] += n_vector[k] * heigth_ratio * (max[i] - min[i] > 0.0 ? (max[i] - min[i]) / 2.0 : 0.5);   // move sample by adjustment
         }
     }
     
@@ -662,6 +1132,24 @@ double dot(double *a, double *b)
     return d;
 } 
 
+/* calculate dot from a dimension array and node normal vector n.
+ * Sparse nodes have only some of the dimensions in n
+ */
+double node_dot(double *a, struct node *n)
+{
+    int i;
+    double d = 0.0;
+
+    if(n->n_idx == NULL) return dot(a,n->n);
+
+    for(i = 0;i < n->n_count;i++)
+    {
+        d += a[n->n_idx[i]] * n->n[i];
+    }
+
+    return d;
+}
+
 /* scale a double value. Scaling is done using scale_min and scale_max values
  * with values min...max range
  */
@@ -703,9 +1191,13 @@ void init_fast_c_cache()
 */
 
 static
-double *make_n_vector()
+double *make_n_vector(int count)
 {
-    return calculate_n();
+    double *n = xmalloc(count * sizeof(double));
+
+    memcpy(n,calculate_n(count),count * sizeof(double));
+
+    return n;
 }
 
 
@@ -715,7 +1207,9 @@ double *scale_dimension(double *dim,struct forest *f)
 {
     int i;
     double range;
-    static double sd[DIM_MAX];
+    static THREAD_LOCAL double *sd = NULL;
+
+    if(sd == NULL) sd = xmalloc(dimensions * sizeof(double));
 
     if(f->scale_range_idx == -1)
     {
@@ -730,6 +1224,110 @@ double *scale_dimension(double *dim,struct forest *f)
     return sd;
 }
 
+/* scale p values of given dimensions, used for sparse nodes instead of scale_dimension
+ */
+static
+void scale_dimension_idx(double *p,int dim_count,int *dim_idx,struct forest *f)
+{
+    int k,i;
+    double range;
+
+    if(f->scale_range_idx == -1) return;
+
+    range = f->max[f->scale_range_idx] - f->min[f->scale_range_idx];
+
+    for(k = 0;k < dim_count;k++)
+    {
+        i = dim_idx[k];
+        p[i] = scale_double(p[i],range,f->min[f->scale_range_idx],f->min[i],f->max[i]);
+    }
+}
+
+static
+int cmp_int(const void *a,const void *b)
+{
+    return *(const int *) a - *(const int *) b;
+}
+
+/* find dimensions having a non zero value in any of the sparse samples
+ * returns the number of dimensions, indices are written to a new array in dim_idx
+ */
+static
+int find_active_dims(int sample_count,int *samples,struct sample *X,int **dim_idx)
+{
+    static int *mark = NULL;
+    static int mark_cap = 0;
+    static int stamp = 0;
+    int i,j,d,count = 0;
+    int *idx;
+    struct sample *s;
+
+    if(mark_cap < dim_max || ++stamp == 0)       // new buffer or stamp wrapped around
+    {
+        DIM_BUFFER(mark,mark_cap);
+        memset(mark,0,mark_cap * sizeof(int));
+        stamp = 1;
+    }
+
+    idx = xmalloc(dimensions * sizeof(int));
+
+    for(i = 0;i < sample_count;i++)
+    {
+        s = &X[samples[i]];
+
+        for(j = 0;j < s->nz_count;j++)
+        {
+            d = SAMPLE_NZ_IDX(s)[j];
+            if(mark[d] != stamp)
+            {
+                mark[d] = stamp;
+                idx[count++] = d;
+            }
+        }
+    }
+
+    qsort(idx,count,sizeof(int),cmp_int);
+
+    *dim_idx = xrealloc(idx,count ? count * sizeof(int) : sizeof(int));
+
+    return count;
+}
+
+/* calculate the dot of scaled sparse samples and node normal vector for samples of a sparse node.
+ * The scaled value of a sample is scale_factor * value + scale_offset, so the dot is the dot of the scaled zero sample
+ * adjusted by the non zero values of a sample. Results are written to d
+ */
+static
+void sparse_node_dots(struct forest *f,struct node *n,int sample_count,int *samples,struct sample *X,double *d)
+{
+    static double *w = NULL;
+    static int w_cap = 0;
+    double zero_dot = 0.0;
+    struct sample *s;
+    int i,k;
+
+    DIM_BUFFER(w,w_cap);
+
+    for(k = 0;k < n->n_count;k++)            // samples have non zero values only in node dimensions
+    {
+        if(f->scale_factor != NULL)
+        {
+            w[n->n_idx[k]] = f->scale_factor[n->n_idx[k]] * n->n[k];
+            zero_dot += f->scale_offset[n->n_idx[k]] * n->n[k];
+        } else
+        {
+            w[n->n_idx[k]] = n->n[k];
+        }
+    }
+
+    for(i = 0;i < sample_count;i++)
+    {
+        s = &X[samples[i]];
+        d[i] = zero_dot;
+        for(k = 0;k < s->nz_count;k++) d[i] += w[SAMPLE_NZ_IDX(s)[k]] * s->nz_value[k];
+    }
+}
+
 /*  copy samples array for leaf node
  */
 static 
@@ -755,6 +1353,7 @@ int add_node(struct forest *f,struct tree *t,int sample_count,int *samples,struc
     int left_count = 0, rigth_count = 0,new;
     int *left_samples;
     int *rigth_samples;
+    double *sample_dots = NULL;     // dots of sparse samples
 
     if(heigth >= heigth_limit || sample_count < NODE_MIN_SAMPLE) return -1;
     
@@ -777,31 +1376,65 @@ int add_node(struct forest *f,struct tree *t,int sample_count,int *samples,struc
     this->sample_count = sample_count;
     this->samples = NULL;
 
-    this->n = v_dup(make_n_vector());
+    if(sparse_fields)      // sparse node, n has only the dimensions which have non zero values in node samples
+    {
+        this->n_count = find_active_dims(sample_count,samples,X,&this->n_idx);
+    } else
+    {
+        this->n_count = dimensions;
+        this->n_idx = NULL;
+    }
+
+    this->n = make_n_vector(this->n_count);
 
     this->left = -1;
     this->rigth = -1;
 
     DEBUG(" interception point ");
-    p = generate_p(sample_count,samples,X,1.0 - ((double) heigth / (double) heigth_limit),f->max,f->min);
+    p = generate_p(sample_count,samples,X,1.0 - ((double) heigth / (double) heigth_limit),f->max,f->min,this->n_count,this->n_idx);
 
-    if(auto_weigth) p = scale_dimension(p,f);
+    if(auto_weigth)
+    {
+        if(this->n_idx == NULL) p = scale_dimension(p,f); else scale_dimension_idx(p,this->n_count,this->n_idx,f);
+    }
 
     DEBUG(" p: ");
     DEBUG_ARRAY(dimensions,p);
 
-    this->pdotn = dot(p,this->n);
+    this->pdotn = node_dot(p,this);
 
-    for(i = 0;i < sample_count;i++)
+    if(sparse_fields)
     {
-        if(dot(sample_dimension(&X[samples[i]]),this->n) < this->pdotn)
+        sample_dots = xmalloc(sample_count * sizeof(double));
+        sparse_node_dots(f,this,sample_count,samples,X,sample_dots);
+
+        for(i = 0;i < sample_count;i++)
         {
-            left_samples[left_count] = samples[i];
-            left_count++;
-        } else
+            if(sample_dots[i] < this->pdotn)
+            {
+                left_samples[left_count] = samples[i];
+                left_count++;
+            } else
+            {
+                rigth_samples[rigth_count] = samples[i];
+                rigth_count++;
+            }
+        }
+
+        free(sample_dots);
+    } else
+    {
+        for(i = 0;i < sample_count;i++)
         {
-            rigth_samples[rigth_count] = samples[i];
-            rigth_count++;
+            if(node_dot(auto_weigth ? X[samples[i]].scaled_dimension : X[samples[i]].dimension,this) < this->pdotn)
+            {
+                left_samples[left_count] = samples[i];
+                left_count++;
+            } else
+            {
+                rigth_samples[rigth_count] = samples[i];
+                rigth_count++;
+            }
         }
     }
 
@@ -874,15 +1507,45 @@ int find_weigth_scale_idx(double *min,double *max)
     return idx;
 }
 
-/* calculate scaled dimension values to be used later
+/* calculate scaled dimension values to be used later.
+ * Sparse samples are not scaled, scale_double is written as scale_factor * value + scale_offset for each dimension instead
  */
 static
 void calculate_scaled_dimensions(struct forest *f)
 {
     int i;
+    double range;
+
+    if(sparse_fields)
+    {
+        if(f->scale_range_idx == -1) return;
+
+        if(f->scale_factor == NULL)
+        {
+            f->scale_factor = xmalloc(dimensions * sizeof(double));
+            f->scale_offset = xmalloc(dimensions * sizeof(double));
+        }
+
+        range = f->max[f->scale_range_idx] - f->min[f->scale_range_idx];
+
+        for(i = 0;i < dimensions;i++)
+        {
+            if(f->max[i] == f->min[i])
+            {
+                f->scale_factor[i] = 1.0;
+                f->scale_offset[i] = 0.0;
+            } else
+            {
+                f->scale_factor[i] = range / (f->max[i] - f->min[i]);
+                f->scale_offset[i] = f->min[f->scale_range_idx] - f->scale_factor[i] * f->min[i];
+            }
+        }
+        return;
+    }
 
     for(i = 0;i < f->X_count;i++)
     {
+        if(f->X[i].scaled_dimension != NULL) free(f->X[i].scaled_dimension);
         f->X[i].scaled_dimension = v_dup(scale_dimension(f->X[i].dimension,f));
         DEBUG("   Dimension: ");
         DEBUG_ARRAY(dimensions,f->X[i].dimension);
@@ -988,13 +1651,13 @@ void add_category_filter(char *regexp)
     }
 }
 
-/*  mark forests filtered using
+/*  mark forests first...forest_count - 1 filtered using
     regular expressions in cat_filter 
 
     if regex starts with "-v ", then remove it and invert the result
 */
 static
-void filter_forests()
+void filter_forests(int first)
 {
     int i,j,s;
     regex_t reg;
@@ -1008,7 +1671,7 @@ void filter_forests()
             panic("Error in regular expression",&cat_filter[i][s],NULL);
         }
 
-        for(j = 0;j < forest_count;j++)
+        for(j = first;j < forest_count;j++)
         {
             if(forest[j].category[0] != '\000')
             {
@@ -1030,29 +1693,34 @@ void filter_forests()
  * make tree in acording make_tree. Tree is needed only if analysing/categorizing or making test data
    */
 void
-train_forest(FILE *in_stream,int new,int make_tree)
+train_forest(FILE *in_stream,char *file_name,int new,int make_tree)
 {
     int i,first;
     int value_count;
     int lines = 0;
     int forest_idx;
-    static char *values[DIM_MAX];
-    static double numval[DIM_MAX];
+    struct input *in;
+    static char **values = NULL;
+    static double *numval = NULL;
+    static int values_cap = 0,numval_cap = 0;
 
-    
+    DIM_BUFFER(values,values_cap);
+    DIM_BUFFER(numval,numval_cap);
 
     first = 1;
     now = time(NULL);
 
     if(in_stream != NULL)
     {
-        while(fgets(input_line,INPUT_LEN_MAX,in_stream) != NULL)  // Read data to  memory
+        in = input_open(in_stream,file_name);
+
+        while((value_count = input_row(in,values)) != -1)  // Read data to  memory
         {
             lines++;
 
             if(header && lines == 1) continue;
 
-            value_count = parse_csv_line(values,DIM_MAX,input_line,input_separator);
+            if(!value_count) continue;
 
             if(first)
             {
@@ -1062,6 +1730,8 @@ train_forest(FILE *in_stream,int new,int make_tree)
 
             forest_idx = select_forest(value_count,values);
 
+            if(forest_idx < 0) continue;        // other category shard, row is not parsed
+
             // If we are adding lines to allready loded samples then adjust the line count accordingly
             if(aggregate)
             {
@@ -1072,13 +1742,16 @@ train_forest(FILE *in_stream,int new,int make_tree)
                 add_to_X(&forest[forest_idx],numval,value_count,0);
             }
         }
+
+        input_close(in);
     }
 
-    filter_forests();
+    filter_forests(0);
 
     // train only once, if new data is only added (!make_tree) no training is run and only new samples are collected
     if(new && make_tree)  
     {
+        forests_trained = 1;
         DEBUG("\n **Starting forest training\n");
         for(i = 0;i < forest_count;i++)
         {
@@ -1091,6 +1764,121 @@ train_forest(FILE *in_stream,int new,int make_tree)
 
 
 
+/* filter and train forests first...forest_count - 1 read from a shard of forest data directory.
+ * Forests are trained only if the other forests are already trained
+ */
+void train_shard_forests(int first)
+{
+    int i;
+
+    filter_forests(first);
+
+    if(!forests_trained) return;
+
+    for(i = first;i < forest_count;i++)
+    {
+        calculate_stats(&forest[i]);
+        train_one_forest(i);
+        find_cluster_centers(i);
+    }
+}
+
+/* Forest copies collecting new samples when learning and analyzing in a single pass.
+ * Original forests are used in analysis, so new samples are added to copies which replace 
+ * the original samples after the pass. Copy is made when a forest gets the first new sample.
+ */
+static struct forest *shadow = NULL;
+static int shadow_count = 0;        // forests existing when the pass started, forests created during the pass are not copied
+
+/* start learning rows while analyzing
+ */
+void start_learn_pass()
+{
+    now = time(NULL);
+    shadow_count = forest_count;
+    shadow = xcalloc(forest_count + 1,sizeof(struct forest));
+}
+
+/* return forest for new samples, make a copy of the forest samples if needed
+ */
+static
+struct forest *learn_forest(int forest_idx)
+{
+    int i;
+    struct forest *f = &forest[forest_idx];
+    struct forest *s;
+
+    if(forest_idx >= shadow_count) return f;
+
+    s = &shadow[forest_idx];
+
+    if(s->category == NULL)
+    {
+        *s = *f;
+
+        if(f->X_cap) s->X = xmalloc(f->X_cap * sizeof(struct sample));
+
+        for(i = 0;i < f->X_count;i++) copy_sample(&s->X[i],&f->X[i]);
+    }
+
+    return s;
+}
+
+/* add data row to samples, dimension has the parsed values of the row
+ */
+void learn_row(int value_count,char **values,double *dimension)
+{
+    struct forest *f;
+    int forest_idx = select_forest(value_count,values);
+
+    if(forest_idx < 0) return;
+
+    f = learn_forest(forest_idx);
+
+    if(aggregate)
+    {
+        add_aggregate(f,values,value_count);
+    } else
+    {
+        add_to_X(f,dimension,value_count,0);
+    }
+}
+
+/* replace forest samples with the copies having new samples
+ */
+void end_learn_pass()
+{
+    int i,j;
+    struct forest *f,*s;
+
+    for(i = 0;i < shadow_count;i++)
+    {
+        s = &shadow[i];
+
+        if(s->category == NULL) continue;
+
+        f = &forest[i];
+
+        for(j = 0;j < f->X_count;j++) free_sample(&f->X[j]);
+
+        if(f->X != NULL) free(f->X);
+
+        f->X = s->X;
+        f->X_count = s->X_count;
+        f->X_cap = s->X_cap;
+        f->X_summary = s->X_summary;
+        f->extra_rows = s->extra_rows;
+        f->seen_rows = s->seen_rows;
+        f->dirty = 1;
+    }
+
+    free(shadow);
+    shadow = NULL;
+    shadow_count = 0;
+
+    filter_forests(0);
+}
+
 /* Make a test run through forests using points between each dimension min..max range
  * Range is adjusted by test_extension_factor (larger value means larger space)
  * and number of points between max--min is test_sample_interval
@@ -1188,7 +1976,7 @@ test2(FILE *outs,double test_extension_factor,int test_sample_interval)
                            
             for(samples = 0;samples < TEST_SAMPLES && samples < f->X_count;samples++)
             {
-                 print_(outs,0.0,0,forest_idx,0,NULL,f->X[f->X_count <= TEST_SAMPLES ? samples : ri(0,f->X_count - 1)].dimension,print_string,"sduaxCX");
+                 print_(outs,0.0,0,forest_idx,0,NULL,sample_values(&f->X[f->X_count <= TEST_SAMPLES ? samples : ri(0,f->X_count - 1)]),print_string,"sduaxCX");
             }
         }
     }
@@ -0,0 +1,204 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+
+/* Merging forest data (-J)
+ *
+ * Forest data read from an other file is merged to the forest data in memory. Forests having a category
+ * not in memory are added. Samples of forests having the same category are combined: both sample tables are
+ * uniform random samples of the rows seen by the forest, so the merged table is taken from them in proportion
+ * to the number of rows seen by each. This makes it possible to learn the same data in several processes
+ * or hosts and combine the results.
+ *
+ * Global variables of the merged file are not used, but the dimensions, category and projection must match.
+ */
+#include "ceif.h"
+
+int merge_read = 0;             // forest data is read for merging, global variables are only checked
+
+/* check that global variables read from merged forest data match
+ */
+void check_merge_globals(int dims,char *category,char *projection)
+{
+    if(dims != dimensions) panic("Number of dimensions does not match in merged forest data",NULL,NULL);
+    if(strcmp(category,category_dims ? category_dims : "") != 0) panic("Category attributes do not match in merged forest data",category,NULL);
+    if(strcmp(projection,projection_string()) != 0) panic("Projection does not match in merged forest data",projection,NULL);
+}
+
+/* return true with probability a / (a + b)
+ */
+static
+int take_first(long a,long b)
+{
+    return (double) rand() / ((double) RAND_MAX + 1.0) * (double) (a + b) < (double) a;
+}
+
+/* take a random sample from X[0]..X[*count - 1] and remove it from the table
+ */
+static
+struct sample take_sample(struct sample *X,int *count)
+{
+    int i = ri(0,*count - 1);
+    struct sample s = X[i];
+
+    X[i] = X[--(*count)];
+    return s;
+}
+
+/* combine samples of forest s to forest f, samples not taken from s are left to s
+ * The merged table has samples from f and s in proportion to the rows seen by each, so it is as large as
+ * possible without taking more samples than either table has (or samples_total). Samples are taken
+ * one at a time: from f with probability samples of f left / all samples left.
+ */
+static
+void merge_samples(struct forest *f,struct forest *s)
+{
+    long f_rows = f->seen_rows > f->X_count ? f->seen_rows : f->X_count;
+    long s_rows = s->seen_rows > s->X_count ? s->seen_rows : s->X_count;
+    long seen_rows = f_rows + s_rows;
+    double limit;
+    int count = samples_total;
+    int f_take,s_take;
+    int f_left = f->X_count;
+    int s_left = s->X_count;
+    int i,n = 0;
+    struct sample *X;
+
+    if(f->X_count + s->X_count < count) count = f->X_count + s->X_count;
+
+    // each table can give as many samples as its share of rows allows
+    if(f->X_count)
+    {
+        limit = (double) f->X_count * seen_rows / f_rows;
+        if(limit < count) count = (int) limit;
+    }
+
+    if(s->X_count)
+    {
+        limit = (double) s->X_count * seen_rows / s_rows;
+        if(limit < count) count = (int) limit;
+    }
+
+    f_take = seen_rows ? (int) ((double) count * f_rows / seen_rows + 0.5) : 0;
+    if(f_take > f->X_count) f_take = f->X_count;
+    s_take = count - f_take;
+    if(s_take > s->X_count)
+    {
+        s_take = s->X_count;
+        f_take = count - s_take;
+    }
+
+    X = xmalloc((count + 1) * sizeof(struct sample));
+
+    while(n < count)
+    {
+        if(take_first(f_take,s_take))
+        {
+            X[n++] = take_sample(f->X,&f_left);
+            f_take--;
+        } else
+        {
+            X[n++] = take_sample(s->X,&s_left);
+            s_take--;
+        }
+    }
+
+    for(i = 0;i < f_left;i++) free_sample(&f->X[i]);
+
+    if(f->X != NULL) free(f->X);
+
+    s->X_count = s_left;
+
+    f->X = X;
+    f->X_count = count;
+    f->X_cap = count + 1;
+    f->seen_rows = seen_rows;
+    f->extra_rows += s->extra_rows;
+    if(s->last_updated > f->last_updated) f->last_updated = s->last_updated;
+    f->dirty = 1;
+}
+
+/* merge forest data in file_name to forest data in memory
+ */
+void merge_forest_file(char *file_name)
+{
+    struct forest *merged,*target;
+    int merged_count,target_count,target_cap;
+    int i,j;
+
+    if(forest_dir(file_name)) panic("Forest data directory cannot be merged",file_name,NULL);
+
+    DEBUG("*** Merging forest data from %s\n",file_name);
+
+    read_forest_shards();       // all forests must be in memory
+
+    target = forest;
+    target_count = forest_count;
+    target_cap = forest_cap;
+
+    // forests are read to a new table, hash is rebuilt for the forests in memory after reading
+    clear_forest_hash();
+    forest = NULL;
+    forest_count = 0;
+    forest_cap = 0;
+
+    merge_read = 1;
+    if(!read_forest_file(file_name)) panic("Cannot load forest data from file",file_name,NULL);
+    merge_read = 0;
+
+    merged = forest;
+    merged_count = forest_count;
+
+    forest = target;
+    forest_count = target_count;
+    forest_cap = target_cap;
+
+    clear_forest_hash();
+    for(i = 0;i < forest_count;i++) add_forest_hash(i,forest[i].category);
+
+    for(i = 0;i < merged_count;i++)
+    {
+        j = search_forest_hash(merged[i].category);
+
+        if(j >= 0)
+        {
+            merge_samples(&forest[j],&merged[i]);
+            free_forest(&merged[i]);
+        } else
+        {
+            if(forest_count >= forest_cap)
+            {
+                forest_cap = forest_cap ? 2 * forest_cap : 64;
+                forest = xrealloc(forest,forest_cap * sizeof(struct forest));
+            }
+
+            forest[forest_count] = merged[i];
+            forest[forest_count].dirty = 1;
+            add_forest_hash(forest_count,forest[forest_count].category);
+            forest_count++;
+        }
+    }
+
+    if(merged != NULL) free(merged);
+}
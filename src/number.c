@@ -0,0 +1,307 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Number conversions
+ */
+#include "ceif.h"
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <locale.h>
+#ifdef HAVE_XLOCALE_H
+#include <xlocale.h>
+#endif
+
+/* Exact powers of ten, 10^22 is the largest one which is exact as double
+ */
+static const double pow10_exact[] = {
+    1e0,1e1,1e2,1e3,1e4,1e5,1e6,1e7,1e8,1e9,1e10,1e11,
+    1e12,1e13,1e14,1e15,1e16,1e17,1e18,1e19,1e20,1e21,1e22
+};
+
+#define MANTISSA_MAX 9007199254740992ULL    // 2^53, integers up to this are exact as double
+
+/* Parse a decimal number using strtod in "C" locale, used when the fast path cannot give exact result
+ */
+static
+double parse_double_slow(const char *s,char **end)
+{
+#if defined(HAVE_STRTOD_L) && defined(HAVE_NEWLOCALE)
+    static locale_t c_locale = (locale_t) 0;
+
+    if(c_locale == (locale_t) 0) c_locale = newlocale(LC_ALL_MASK,"C",(locale_t) 0);
+    if(c_locale != (locale_t) 0) return strtod_l(s,end,c_locale);
+#endif
+    return strtod(s,end);
+}
+
+/* Parse a floating point number from string s. Decimal point is always '.', locale is not used.
+ * Result is the same as with strtod in "C" locale, end is set to the first character not used (if end is not NULL)
+ *
+ * Numbers having at most 19 significant digits and a mantissa and power of ten which are exact as double
+ * are converted using one multiplication or division (Clinger's fast path). This covers almost all data values.
+ * Other numbers (long mantissas, large exponents, hex, inf, nan) are converted using strtod.
+ */
+double parse_double(const char *s,char **end)
+{
+    const char *p = s;
+    uint64_t w = 0;
+    int digits = 0;              // significant digits in w
+    int any_digits = 0;
+    int e10 = 0;                 // decimal exponent
+    int exp_value,exp_sign,exp_digits;
+    int negative = 0;
+    const char *q;
+    double d;
+
+    while(*p == ' ' || (*p >= '\t' && *p <= '\r')) p++;
+
+    if(*p == '-')
+    {
+        negative = 1;
+        p++;
+    } else if(*p == '+')
+    {
+        p++;
+    }
+
+    if(!(*p >= '0' && *p <= '9') && !(*p == '.' && p[1] >= '0' && p[1] <= '9')) return parse_double_slow(s,end);  // inf, nan, or not a number
+
+    if(*p == '0' && (p[1] == 'x' || p[1] == 'X')) return parse_double_slow(s,end);   // hex float
+
+    while(*p >= '0' && *p <= '9')
+    {
+        any_digits = 1;
+        if(w || *p != '0')
+        {
+            if(++digits > 19) return parse_double_slow(s,end);
+            w = w * 10 + (*p - '0');
+        }
+        p++;
+    }
+
+    if(*p == '.')
+    {
+        p++;
+        while(*p >= '0' && *p <= '9')
+        {
+            any_digits = 1;
+            if(w || *p != '0')
+            {
+                if(++digits > 19) return parse_double_slow(s,end);
+                w = w * 10 + (*p - '0');
+            }
+            e10--;
+            p++;
+        }
+    }
+
+    if(!any_digits) return parse_double_slow(s,end);
+
+    if(*p == 'e' || *p == 'E')
+    {
+        q = p + 1;
+        exp_sign = 1;
+        exp_value = 0;
+        exp_digits = 0;
+
+        if(*q == '-')
+        {
+            exp_sign = -1;
+            q++;
+        } else if(*q == '+')
+        {
+            q++;
+        }
+
+        while(*q >= '0' && *q <= '9')
+        {
+            if(++exp_digits > 5) return parse_double_slow(s,end);
+            exp_value = exp_value * 10 + (*q - '0');
+            q++;
+        }
+
+        if(exp_digits)           // "1e" and "1e+" are parsed as 1
+        {
+            e10 += exp_sign * exp_value;
+            p = q;
+        }
+    }
+
+    if(end != NULL) *end = (char *) p;
+
+    if(w == 0) return negative ? -0.0 : 0.0;
+
+#if FLT_EVAL_METHOD == 0
+    if(w <= MANTISSA_MAX)
+    {
+        if(e10 >= 0 && e10 <= 22)
+        {
+            d = (double) w * pow10_exact[e10];
+            return negative ? -d : d;
+        }
+
+        if(e10 < 0 && e10 >= -22)
+        {
+            d = (double) w / pow10_exact[-e10];
+            return negative ? -d : d;
+        }
+
+        if(e10 > 22 && e10 <= 22 + 15 && w <= MANTISSA_MAX / (uint64_t) pow10_exact[e10 - 22])   // move extra powers of ten to mantissa if it stays exact
+        {
+            d = (double) (w * (uint64_t) pow10_exact[e10 - 22]) * pow10_exact[22];
+            return negative ? -d : d;
+        }
+    }
+#endif
+    return parse_double_slow(s,end);
+}
+
+/* Round d to given number of decimals. Result is the same as parsing the string printed with "%.*f",
+ * rounding is done without printing if the result is not ambiguous
+ */
+double round_decimals(double d,int decimals)
+{
+    double t,frac;
+    char buf[400];
+
+    if(decimals < 0) decimals = 6;    // as printf does with negative precision
+
+    if(decimals <= 22 && isfinite(d))
+    {
+        t = d * pow10_exact[decimals];
+
+        if(fabs(t) < MANTISSA_MAX / 2)
+        {
+            frac = fabs(t - floor(t) - 0.5);
+
+            // halfway cases and cases where multiplication may have crossed the halfway point are printed
+            if(frac > fabs(t) * 4 * DBL_EPSILON + DBL_MIN) return nearbyint(t) / pow10_exact[decimals];
+        }
+    }
+
+    if(decimals > 300 || fabs(d) > 1e80) return d;
+
+    sprintf(buf,"%.*f",decimals,d);
+    return parse_double(buf,NULL);
+}
+
+/* Write integer n as a decimal number having given number of decimals (n / 10^decimals),
+ * decimals must be at most 19. Returns the length of the text
+ */
+static
+int write_decimal(char *buf,int negative,uint64_t n,int decimals)
+{
+    char digits[24];
+    uint64_t ipart,fpart,scale = 1;
+    int len = 0,i;
+
+    for(i = 0;i < decimals;i++) scale *= 10;
+
+    ipart = n / scale;
+    fpart = n % scale;
+
+    if(negative) buf[len++] = '-';
+
+    i = sizeof(digits);
+    do
+    {
+        digits[--i] = '0' + (char) (ipart % 10);
+        ipart /= 10;
+    } while(ipart);
+
+    memcpy(&buf[len],&digits[i],sizeof(digits) - i);
+    len += sizeof(digits) - i;
+
+    if(decimals)
+    {
+        buf[len++] = '.';
+        for(i = decimals - 1;i >= 0;i--)
+        {
+            buf[len + i] = '0' + (char) (fpart % 10);
+            fpart /= 10;
+        }
+        len += decimals;
+    }
+
+    buf[len] = '\000';
+    return len;
+}
+
+/* Write the shortest "%.*g" text of d which is parsed back to d, returns the length of the text.
+ *
+ * Values printed by "%g" without exponent are first tried with increasing number of decimals:
+ * if integer n = d * 10^k divided by 10^k gives d back, n / 10^k is the shortest text. Division of two exact
+ * doubles is correctly rounded as is parsing, and n having at most 15 digits makes it the same text "%.15g" gives.
+ */
+int shortest_double(char *buf,double d)
+{
+    double a = fabs(d),t,n;
+    int len,precision,k;
+
+    if(a == 0.0 || (a >= 1e-4 && a < 1e15))
+    {
+        for(k = 0;k <= 18;k++)
+        {
+            t = a * pow10_exact[k];
+            if(t >= 1e15) break;
+
+            n = nearbyint(t);
+            if(n < 1e15 && n / pow10_exact[k] == a) return write_decimal(buf,signbit(d),(uint64_t) n,k);
+        }
+    }
+
+    for(precision = 15;precision < 17;precision++)
+    {
+        len = sprintf(buf,"%.*g",precision,d);
+        if(parse_double(buf,NULL) == d) return len;
+    }
+
+    return sprintf(buf,"%.17g",d);
+}
+
+/* Write d with given number of decimals to buf, result is the same as with "%.*f".
+ * Digits are made from a rounded integer if the rounding is not ambiguous, returns the length of the text
+ */
+int format_fixed(char *buf,double d,int decimals)
+{
+    double t,frac;
+
+    if(decimals < 0) decimals = 6;
+
+    if(decimals <= 15 && isfinite(d))
+    {
+        t = fabs(d) * pow10_exact[decimals];
+
+        if(t < MANTISSA_MAX / 2)
+        {
+            frac = fabs(t - floor(t) - 0.5);
+
+            // same ambiguity check as in round_decimals
+            if(frac > t * 4 * DBL_EPSILON + DBL_MIN) return write_decimal(buf,signbit(d),(uint64_t) nearbyint(t),decimals);
+        }
+    }
+
+    return sprintf(buf,"%.*f",decimals,d);
+}
@@ -0,0 +1,363 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Parallel analysis pipeline
+ *
+ * reader (calling thread) -> work queue -> N workers -> done queue -> writer
+ *
+ * The reader collects input lines to batches. Workers parse and score all rows of a batch
+ * and print the results to a memory buffer of the batch. The writer writes batch buffers to
+ * output in input order (or in completion order if ordered_output is not set) and
+ * gives the batches back to the reader using the free queue.
+ * The number of batches is fixed, so memory usage is bounded.
+ *
+ * Columnar input is read one block at a time, a batch has then the rows of one block.
+ * Rows of columnar input are analyzed one at a time, windows are not used.
+ */
+#include "ceif.h"
+
+int ordered_output = 1;          // write pipeline output in input order
+
+#ifdef HAVE_PTHREAD_H
+
+#define BATCH_ROWS 1024          // max rows in one batch
+#define BATCH_DATA 262144        // batch is sent to workers when it has this much line data
+#define BATCHES_PER_WORKER 4     // number of batches in pipeline for each worker
+
+struct row_batch
+{
+    long seq;                    // batch sequence number, used in ordering the output
+    int lines;                   // input line number of the first row
+    int count;                   // number of rows in batch
+    int row[BATCH_ROWS];         // row start offsets in data
+    char *data;                  // row data, every row is terminated with NUL
+    size_t data_len;
+    size_t data_cap;
+    char *out;                   // printed output of the batch
+    size_t out_len;
+    struct column_block *block;  // rows of columnar input
+};
+
+struct pipeline
+{
+    struct queue *free_q;        // empty batches for the reader
+    struct queue *work_q;        // batches to be analyzed
+    struct queue *done_q;        // analyzed batches for the writer
+    int workers;
+    int batches;
+    FILE *outs;
+    char *file_name;             // input file name
+    char *not_found_format;
+    char *average_format;
+};
+
+/* analyze all rows of batches from the work queue, NULL ends the work
+ */
+static
+void *pipeline_worker(void *arg)
+{
+    struct pipeline *p = arg;
+    struct row_batch *b;
+    FILE *outs;
+    char **values = NULL;
+    char *rows[BATCH_ROWS];
+    int lines[BATCH_ROWS];
+    double *dimension = NULL;
+    int i,n,value_count,values_cap = 0;
+
+    DIM_BUFFER(values,values_cap);
+
+    while((b = queue_pop(p->work_q)) != NULL)
+    {
+        if(dimension == NULL) dimension = xmalloc(dimensions * sizeof(double));
+
+        outs = open_memstream(&b->out,&b->out_len);
+        if(outs == NULL) panic("Cannot open memory stream",NULL,strerror(errno));
+
+        if(b->block != NULL)
+        {
+            for(i = 0;i < b->count;i++)
+            {
+                if(header && b->lines + i == 1) continue;
+
+                value_count = column_block_row(b->block,i,values);
+
+                if(value_count) analyze_row(outs,p->file_name,b->lines + i,value_count,values,dimension,p->not_found_format,p->average_format);
+            }
+        } else if(analyze_window > 1)
+        {
+            for(i = 0;i < b->count;i++)
+            {
+                rows[i] = &b->data[b->row[i]];
+                lines[i] = b->lines + i;
+            }
+
+            for(i = 0;i < b->count;i += analyze_window)
+            {
+                n = b->count - i < analyze_window ? b->count - i : analyze_window;
+                analyze_grouped(outs,p->file_name,n,&lines[i],&rows[i],p->not_found_format,p->average_format);
+            }
+        } else
+        {
+            for(i = 0;i < b->count;i++)
+            {
+                value_count = parse_input_line(values,&b->data[b->row[i]]);
+
+                if(value_count) analyze_row(outs,p->file_name,b->lines + i,value_count,values,dimension,p->not_found_format,p->average_format);
+            }
+        }
+
+        fclose(outs);
+
+        queue_push(p->done_q,b);
+    }
+
+    queue_push(p->done_q,NULL);
+
+    if(dimension != NULL) free(dimension);
+    free(values);
+
+    return NULL;
+}
+
+/* write batch output and give the batch back to the reader
+ */
+static
+void write_batch(struct pipeline *p,struct row_batch *b)
+{
+    if(b->out_len && fwrite(b->out,1,b->out_len,p->outs) != b->out_len) panic("Error in writing output",NULL,strerror(errno));
+
+    free(b->out);
+    b->out = NULL;
+    b->out_len = 0;
+
+    queue_push(p->free_q,b);
+}
+
+/* write analyzed batches, stop after all workers have finished
+ */
+static
+void *pipeline_writer(void *arg)
+{
+    struct pipeline *p = arg;
+    struct row_batch *b;
+    struct row_batch **pending;
+    long next_seq = 0;
+    int running = p->workers;
+
+    pending = xcalloc(p->batches,sizeof(struct row_batch *));
+
+    while(running)
+    {
+        b = queue_pop(p->done_q);
+
+        if(b == NULL)
+        {
+            running--;
+            continue;
+        }
+
+        if(!ordered_output)
+        {
+            write_batch(p,b);
+            continue;
+        }
+
+        // All batches not yet written are between next_seq and next_seq + batches
+        pending[b->seq % p->batches] = b;
+
+        while((b = pending[next_seq % p->batches]) != NULL && b->seq == next_seq)
+        {
+            pending[next_seq % p->batches] = NULL;
+            write_batch(p,b);
+            next_seq++;
+        }
+    }
+
+    free(pending);
+
+    return NULL;
+}
+
+/* add a line to batch
+ */
+static
+void add_line(struct row_batch *b,char *line)
+{
+    size_t len = strlen(line) + 1;
+
+    if(b->data_len + len > b->data_cap)
+    {
+        b->data_cap = b->data_len + len + BATCH_DATA;
+        b->data = xrealloc(b->data,b->data_cap);
+    }
+
+    memcpy(&b->data[b->data_len],line,len);
+    b->row[b->count] = b->data_len;
+    b->data_len += len;
+    b->count++;
+}
+
+/* read blocks of columnar input to batches, dimensions are initialized using the first row having values
+ */
+static
+void read_blocks(struct pipeline *p,struct input *in,int *lines)
+{
+    struct row_batch *b;
+    long seq = 0;
+    int i,rows,first = 1;
+
+    for(;;)
+    {
+        b = queue_pop(p->free_q);
+
+        if(b->block == NULL) b->block = column_block_new();
+
+        if((rows = input_block(in,b->block)) == 0)
+        {
+            queue_push(p->free_q,b);
+            break;
+        }
+
+        b->seq = seq++;
+        b->lines = *lines + 1;
+        b->count = rows;
+        *lines += rows;
+
+        for(i = 0;first && i < rows;i++)
+        {
+            if((header && b->lines + i == 1) || !column_block_value_count(b->block,i)) continue;
+
+            check_first_row(column_block_value_count(b->block,i));
+            first = 0;
+        }
+
+        queue_push(p->work_q,b);
+    }
+}
+
+/* Analyze rows from in_stream using a reader, worker and writer pipeline.
+ * Number of lines read is written to lines
+ * Returns true if the analysis was done
+ */
+int
+analyze_pipeline(struct input *in,char *file_name,FILE *outs,char *not_found_format,char *average_format,int *lines)
+{
+    struct pipeline p;
+    struct row_batch *b = NULL;
+    struct row_batch *batch;
+    char *line;
+    char **first_values = NULL;
+    void **workers,*writer;
+    long seq = 0;
+    int i,first_cap = 0;
+
+    p.workers = thread_count;
+    p.batches = p.workers * BATCHES_PER_WORKER;
+    p.outs = outs;
+    p.file_name = file_name;
+    p.not_found_format = not_found_format;
+    p.average_format = average_format;
+    p.free_q = queue_new(p.batches);
+    p.work_q = queue_new(p.batches + p.workers);
+    p.done_q = queue_new(p.batches + p.workers);
+
+    DEBUG("Analyzing with %d worker threads\n",p.workers);
+
+    batch = xcalloc(p.batches,sizeof(struct row_batch));
+
+    for(i = 0;i < p.batches;i++) queue_push(p.free_q,&batch[i]);
+
+    workers = xmalloc(p.workers * sizeof(void *));
+
+    for(i = 0;i < p.workers;i++) workers[i] = start_thread(pipeline_worker,&p);
+
+    writer = start_thread(pipeline_writer,&p);
+
+    *lines = 0;
+
+    DIM_BUFFER(first_values,first_cap);
+
+    if(input_columnar(in)) read_blocks(&p,in,lines);
+
+    while(!input_columnar(in) && (line = input_next(in)) != NULL)
+    {
+        (*lines)++;
+
+        if(header && *lines == 1) continue;
+
+        if(b == NULL)
+        {
+            b = queue_pop(p.free_q);
+            b->seq = seq++;
+            b->lines = *lines;
+            b->count = 0;
+            b->data_len = 0;
+        }
+
+        add_line(b,line);
+
+        // dimensions are initialized before workers see any rows
+        if(b->count == 1 && b->seq == 0) check_first_row(parse_input_line(first_values,line));
+
+        if(b->count == BATCH_ROWS || b->data_len >= BATCH_DATA)
+        {
+            queue_push(p.work_q,b);
+            b = NULL;
+        }
+    }
+
+    if(b != NULL) queue_push(p.work_q,b);
+
+    for(i = 0;i < p.workers;i++) queue_push(p.work_q,NULL);
+
+    for(i = 0;i < p.workers;i++) join_thread(workers[i]);
+
+    join_thread(writer);
+
+    for(i = 0;i < p.batches;i++)
+    {
+        if(batch[i].data != NULL) free(batch[i].data);
+        if(batch[i].block != NULL) column_block_free(batch[i].block);
+    }
+
+    free(batch);
+    free(workers);
+    free(first_values);
+    queue_free(p.free_q);
+    queue_free(p.work_q);
+    queue_free(p.done_q);
+
+    return 1;
+}
+
+#else
+
+int
+analyze_pipeline(struct input *in,char *file_name,FILE *outs,char *not_found_format,char *average_format,int *lines)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Random projection of dimension attributes (-K)
+ *
+ * Input dimension attributes are projected to projection_dims dimensions using a sparse random
+ * matrix (Achlioptas): each element is sqrt(3/k) or -sqrt(3/k) with probability 1/6 and zero otherwise.
+ * Distances between points are approximately preserved (Johnson-Lindenstrauss).
+ *
+ * The matrix is generated from projection_seed using a private random number generator, so only
+ * the seed and the dimension counts are saved in forest data.
+ */
+#include "ceif.h"
+#include <math.h>
+#include <stdint.h>
+
+int projection_dims = 0;             // number of projected dimensions, 0 = no projection
+unsigned int projection_seed = 0;    // seed of the projection matrix
+int projection_input_dims = 0;       // number of input dimension attributes projected
+
+static double *matrix = NULL;        // projection_input_dims rows of projection_dims values
+
+/* splitmix64 random number generator, same sequence on all platforms
+ */
+static
+uint64_t next_random(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Make the projection matrix for input_dims dimension attributes.
+ * A new seed is taken if the projection is not read from forest data.
+ * Returns the number of dimensions after projection
+ */
+int init_projection(int input_dims)
+{
+    uint64_t state;
+    double value = sqrt(3.0 / (double) projection_dims);
+    int i;
+
+    if(projection_input_dims)
+    {
+        if(projection_input_dims != input_dims) panic("Number of input dimensions does not match the projection in forest data",NULL,NULL);
+    } else
+    {
+        projection_input_dims = input_dims;
+        projection_seed = (unsigned int) rand();
+    }
+
+    if(matrix == NULL)
+    {
+        matrix = xmalloc((size_t) projection_input_dims * projection_dims * sizeof(double));
+
+        state = projection_seed;
+
+        for(i = 0;i < projection_input_dims * projection_dims;i++)
+        {
+            switch(next_random(&state) % 6)
+            {
+                case 0:
+                    matrix[i] = value;
+                    break;
+                case 1:
+                    matrix[i] = -value;
+                    break;
+                default:
+                    matrix[i] = 0.0;
+                    break;
+            }
+        }
+    }
+
+    return projection_dims;
+}
+
+/* project input dimension values in raw to dim
+ */
+void project(double *raw,double *dim)
+{
+    int i,j;
+    double *row;
+
+    for(j = 0;j < projection_dims;j++) dim[j] = 0.0;
+
+    for(i = 0;i < projection_input_dims;i++)
+    {
+        if(raw[i] == 0.0) continue;
+
+        row = &matrix[(size_t) i * projection_dims];
+
+        for(j = 0;j < projection_dims;j++) dim[j] += raw[i] * row[j];
+    }
+}
+
+/* make projection string saved in forest data: dimensions,seed,input dimensions, empty if no projection
+ */
+char *projection_string()
+{
+    static char str[100];
+
+    str[0] = '\000';
+    if(projection_dims) sprintf(str,"%d,%u,%d",projection_dims,projection_seed,projection_input_dims);
+    return str;
+}
+
+/* read projection string saved in forest data
+ */
+void parse_projection_string(char *str)
+{
+    int dims,input_dims;
+    unsigned int seed;
+
+    if(str == NULL || str[0] == '\000') return;
+
+    if(sscanf(str,"%d,%u,%d",&dims,&seed,&input_dims) != 3 || dims < 1 || dims > dim_max || input_dims < 1 || input_dims > dim_max)
+    {
+        panic("Invalid projection in forest data",str,NULL);
+    }
+
+    if(projection_dims && projection_dims != dims) panic("Projection cannot be changed for saved forest data",NULL,NULL);
+
+    projection_dims = dims;
+    projection_seed = seed;
+    projection_input_dims = input_dims;
+}
@@ -0,0 +1,210 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Structured result output (--results)
+ *
+ * Outlier rows of analysis (-a) and rows of categorization (-c) can be written as records instead of
+ * the print string (-p):
+ *
+ *   ndjson   one JSON object per line: {"row":N,"forest":N,"category":"...","score":S,"attributeScores":[...]}
+ *   binary   magic bytes "\211CEIR\r\n\032" and format version (u32) followed by records having
+ *            row number (u64), forest index (i32), number of attribute scores (u32), score (f64) and
+ *            the attribute scores (f64). All values are little endian.
+ *
+ * Attribute scores are written if ",attributes" is added to the format. Attribute scores are the same as
+ * printed by %e, forests without attribute scores have them as null (ndjson) or NaN (binary).
+ * Scores are written using the shortest text giving the same double back.
+ */
+#include "ceif.h"
+#include <math.h>
+#include <stdint.h>
+
+#define RESULT_MAGIC "\211CEIR\r\n\032"
+#define RESULT_MAGIC_LEN 8
+#define RESULT_VERSION 1
+
+int result_format = RESULT_TEXT;        // RESULT_* how outlier rows are written
+int result_attributes = 0;              // if true write attribute scores
+
+static THREAD_LOCAL unsigned char *record = NULL;    // binary record being written
+static THREAD_LOCAL size_t record_size = 0;
+
+/* store size bytes of v in little endian order
+ */
+static
+void put_le(unsigned char *p,uint64_t v,int size)
+{
+    int i;
+
+    for(i = 0;i < size;i++) p[i] = (unsigned char) (v >> (8 * i));
+}
+
+static
+void put_double(unsigned char *p,double d)
+{
+    uint64_t v;
+
+    memcpy(&v,&d,sizeof(v));
+    put_le(p,v,8);
+}
+
+/* returns attribute scores of a row or NULL if the forest does not have them
+ */
+static
+double *attribute_scores(int forest_idx,double *dimension)
+{
+    if(!result_attributes || forest[forest_idx].filter || !forest[forest_idx].cluster_count || dimension == NULL) return NULL;
+
+    return get_dim_attr_scores(forest_idx,dimension);
+}
+
+/* parse result format given with option --results: text, ndjson or binary optionally followed by ",attributes"
+ */
+void parse_result_format(char *s)
+{
+    char *name = xstrdup(s);
+    char *attr = strchr(name,',');
+
+    result_attributes = 0;
+
+    if(attr != NULL)
+    {
+        *attr++ = '\000';
+        if(strcmp(attr,"attributes") != 0) panic("Unknown result format option",attr,"give attributes");
+        result_attributes = 1;
+    }
+
+    if(strcmp(name,"text") == 0)
+    {
+        result_format = RESULT_TEXT;
+    } else if(strcmp(name,"ndjson") == 0)
+    {
+        result_format = RESULT_NDJSON;
+    } else if(strcmp(name,"binary") == 0)
+    {
+        result_format = RESULT_BINARY;
+    } else
+    {
+        panic("Unknown result format",name,"give text, ndjson or binary");
+    }
+
+    free(name);
+}
+
+/* write the beginning of result output, called before rows are analyzed or categorized
+ */
+void write_result_header(FILE *outs)
+{
+    unsigned char header[RESULT_MAGIC_LEN + 4];
+
+    if(result_format != RESULT_BINARY) return;
+
+    memcpy(header,RESULT_MAGIC,RESULT_MAGIC_LEN);
+    put_le(&header[RESULT_MAGIC_LEN],RESULT_VERSION,4);
+
+    fwrite(header,1,sizeof(header),outs);
+}
+
+/* write a json number, non finite values are written as null
+ */
+static
+void write_json_number(FILE *outs,double d)
+{
+    char buf[32];
+
+    if(isfinite(d))
+    {
+        fwrite(buf,1,shortest_double(buf,d),outs);
+    } else
+    {
+        fputs("null",outs);
+    }
+}
+
+static
+void write_ndjson_result(FILE *outs,double score,int lines,int forest_idx,double *dimension)
+{
+    double *attr = attribute_scores(forest_idx,dimension);
+    int i;
+
+    fprintf(outs,"{\"row\":%d,\"forest\":%d,\"category\":",lines,forest_idx);
+    json_write_string(outs,forest[forest_idx].category);
+    fputs(",\"score\":",outs);
+    write_json_number(outs,score);
+
+    if(result_attributes)
+    {
+        fputs(",\"attributeScores\":",outs);
+        if(attr != NULL)
+        {
+            putc('[',outs);
+            for(i = 0;i < dimensions;i++)
+            {
+                if(i) putc(',',outs);
+                write_json_number(outs,attr[i]);
+            }
+            putc(']',outs);
+        } else
+        {
+            fputs("null",outs);
+        }
+    }
+
+    fputs("}\n",outs);
+}
+
+static
+void write_binary_result(FILE *outs,double score,int lines,int forest_idx,double *dimension)
+{
+    double *attr = attribute_scores(forest_idx,dimension);
+    int i,count = result_attributes ? dimensions : 0;
+
+    if(record_size < 24 + 8 * (size_t) count)
+    {
+        record_size = 24 + 8 * (size_t) count;
+        record = xrealloc(record,record_size);
+    }
+
+    put_le(&record[0],(uint64_t) lines,8);
+    put_le(&record[8],(uint32_t) forest_idx,4);
+    put_le(&record[12],(uint32_t) count,4);
+    put_double(&record[16],score);
+
+    for(i = 0;i < count;i++) put_double(&record[24 + 8 * i],attr != NULL ? attr[i] : NAN);
+
+    fwrite(record,1,24 + 8 * (size_t) count,outs);
+}
+
+/* write an outlier or categorized row as a result record, lines is the row number
+ */
+void write_result(FILE *outs,double score,int lines,int forest_idx,double *dimension)
+{
+    if(result_format == RESULT_NDJSON)
+    {
+        write_ndjson_result(outs,score,lines,forest_idx,dimension);
+    } else
+    {
+        write_binary_result(outs,score,lines,forest_idx,dimension);
+    }
+}
@@ -24,15 +24,11 @@
 #include "ceif.h"
 #include <time.h>
 
-#define FILE_JSON     1
-#define FILE_CSV      2
-#define FILE_UNKNOWN  3
-
 /* formats for write and reading data
  */
 
 static char *W_global = "G;%d;\"%s\";\"%s\";%d;%d;\"%s\";\"%c\";%d;%f%s;\"%s\";\"%s\";\"%s\";%d;\"%s\";%d;%d;\"%s\";\"%c\";%d;%d;\"%s\";\"%s\"\n";
-static char *W_forest = "F;\"%s\";%f;%d;%d;%ld\n";
+static char *W_forest = "F;\"%s\";%f;%d;%d;%ld;%ld\n";
 static char *W_sample = "S;%s\n";
 
 static char input_line[INPUT_LEN_MAX];
@@ -57,33 +53,78 @@ void write_global_data(FILE *w,int f_count)
                 input_separator,header,outlier_score,scale_score ? "s" : (percentage_score ? "%" : ""),score_dims ? score_dims :"",\
                 ignore_dims ? ignore_dims : "",\
                 include_dims ? include_dims : "",f_count,filter_str,decimals,unique_samples,printf_format ? printf_format : "",list_separator,\
-                n_vector_adjust,aggregate,text_dims ? text_dims : "","") < 0)
+                n_vector_adjust,aggregate,text_dims ? text_dims : "",projection_string()) < 0)
     {
         write_error();
     }
     free(filter_str);
 }
 
-/* write dimension data to csv string
+/* write sample data to csv string, dimension values are separated by pipe (|). Sparse samples have the non zero
+ * values as DIMENSION:VALUE, dimension numbers start from 1.
+ * values are appended using a running position, buffer is large enough for "%.*f" of any double
    */
 static 
-char *dim_to_csv(int size,double *dim)
+char *sample_to_csv(struct sample *s)
 {
-    static char csv[DIM_MAX*21];
-    char f[200];
+    static char *csv = NULL;
+    static size_t csv_size = 0;
+    int size = s->dimension != NULL ? dimensions : s->nz_count;
+    size_t needed = (size_t) size * (362 + (decimals > 0 ? decimals : 6)) + 1;
+    char *p;
     int i;
 
-    csv[0] = '\000';
+    if(needed > csv_size)
+    {
+        csv = xrealloc(csv,needed);
+        csv_size = needed;
+    }
+
+    p = csv;
+    *p = '\000';
 
     for(i = 0;i < size;i++) 
     {
-        sprintf(f,"%.*f|",decimals,dim[i]);
-        strcat(csv,f);
+        if(i) *p++ = '|';
+        if(s->dimension != NULL)
+        {
+            p += format_fixed(p,s->dimension[i],decimals);
+        } else
+        {
+            p += sprintf(p,"%d:",SAMPLE_NZ_IDX(s)[i] + 1);
+            p += format_fixed(p,s->nz_value[i],decimals);
+        }
     }
-    if(size) csv[strlen(csv) - 1] = '\000';
     return csv;
 }
 
+/* parse a saved sparse sample having values DIMENSION:VALUE and add it to forest f
+ */
+static
+void read_sparse_sample(struct forest *f,char **values,int value_count)
+{
+    static double *value = NULL;
+    static int *idx = NULL;
+    static int value_cap = 0,idx_cap = 0;
+    int i,count = 0;
+    char *p;
+
+    DIM_BUFFER(value,value_cap);
+    DIM_BUFFER(idx,idx_cap);
+
+    for(i = 0;i < value_count;i++)
+    {
+        if(values[i][0] == '\000') continue;      // sample having no non zero values
+
+        p = strchr(values[i],':');
+        if(p == NULL) panic("Invalid sparse sample in forest data",values[i],NULL);
+
+        idx[count] = atoi(values[i]) - 1;
+        value[count++] = parse_dim_attribute(p + 1);
+    }
+
+    add_sparse_to_X(f,count,idx,value);
+}
 
 /*
  * save data for a forest
@@ -95,11 +136,11 @@ save_forest(int forest_idx,FILE *w)
     int i;
     struct forest *f = &forest[forest_idx];
 
-    if(fprintf(w,W_forest,f->category ? f->category : "",f->c,f->heigth_limit,f->X_count,(long int) f->last_updated) < 0) write_error();
+    if(fprintf(w,W_forest,f->category ? f->category : "",f->c,f->heigth_limit,f->X_count,(long int) f->last_updated,f->seen_rows) < 0) write_error();
 
     for(i = 0;i < f->X_count;i++)
     {
-        if(fprintf(w,W_sample,dim_to_csv(dimensions,f->X[i].dimension)) < 0) write_error();
+        if(fprintf(w,W_sample,sample_to_csv(&f->X[i])) < 0) write_error();
     }
 }
 
@@ -129,15 +170,70 @@ write_forest_file_csv(char *file_name,time_t delete_interval)
         if(delete_interval == (time_t) 0 || (delete_interval > (time_t) 0 && forest[i].last_updated >= now - delete_interval)) save_forest(i,fp);
     }
 
-    fclose(fp);
+    xfclose(fp);
 }
 
-/* write forest data to file. If JSON is available use JSON else CSV
+/* write forest data to file using the format selected with option -W,
+ * default is the format of the forest data read or JSON.
+ * With option -Z only the changed forests are written to delta file if possible.
+ * Forest data is split to shards if file_name is a directory
  */
 void
 write_forest_file(char *file_name,time_t delete_interval)
 {
-    if(!write_forest_file_json(file_name,delete_interval)) write_forest_file_csv(file_name,delete_interval);
+    if(strcmp(file_name,"-") != 0 && forest_dir(file_name))
+    {
+        write_forest_dir(file_name,delete_interval);
+        return;
+    }
+
+    read_forest_shards();       // all forests are written to a single file
+
+    if(delta_save && write_forest_file_delta(file_name,delete_interval)) return;
+
+    switch(save_format)
+    {
+        case FORMAT_CSV:
+            write_forest_file_csv(file_name,delete_interval);
+            break;
+        case FORMAT_BINARY:
+            write_forest_file_binary(file_name,delete_interval);
+            break;
+        default:
+            write_forest_file_json(file_name,delete_interval);
+            break;
+    }
+
+    remove_forest_delta(file_name);
+}
+
+/* parse forest data format given with option -W
+ */
+void
+parse_save_format(char *s)
+{
+    if(strcmp(s,"json") == 0)
+    {
+        save_format = FORMAT_JSON;
+    } else if(strcmp(s,"csv") == 0)
+    {
+        save_format = FORMAT_CSV;
+    } else if(strcmp(s,"binary") == 0)
+    {
+        save_format = FORMAT_BINARY;
+        save_encoding = ENCODING_DOUBLE;
+    } else if(strcmp(s,"binary32") == 0)
+    {
+        save_format = FORMAT_BINARY;
+        save_encoding = ENCODING_FLOAT;
+    } else if(strcmp(s,"binary16") == 0)
+    {
+        save_format = FORMAT_BINARY;
+        save_encoding = ENCODING_Q16;
+    } else
+    {
+        panic("Unknown forest data format",s,"give json, csv, binary, binary32 or binary16");
+    }
 }
 
 /*
@@ -154,7 +250,15 @@ int parse_G(char *l)
 
     if(value_count == 23) // change this too if parameter count changes
     {
+        if(merge_read)         // global variables in memory are used
+        {
+            check_merge_globals(atoi(v[1]),v[6],v[22]);
+            forest_count = atoi(v[13]);
+            return 1;
+        }
+
         dimensions = atoi(v[1]);
+        set_dim_max(dimensions);
         label_dims = xstrdup(v[2]);
         label_idx_count = parse_dims(v[2],label_idx);
         print_string = xstrdup(v[3]);
@@ -186,6 +290,7 @@ int parse_G(char *l)
         aggregate = atoi(v[20]);
         text_dims = xstrdup(v[21]);
         text_idx_count = parse_dims(v[21],text_idx);
+        parse_projection_string(v[22]);     // empty if no projection
 
         samples_total = max_total_samples ?  max_total_samples : tree_count * samples_max;   // total samples count is trees * samples/tree, this can be limited using config MAX_SAMPLES
         return 1;
@@ -209,11 +314,11 @@ int parse_F(int forest_idx,char *l)
 
     value_count = parse_csv_line(v,100,l,';');
 
-    if(value_count == 6)
+    if(value_count == 6 || value_count == 7)     // row count is not in older files
     {
         f->category = xstrdup(v[1]);
-        f->c = atof(v[2]);
-        f->heigth_limit = atof(v[3]);
+        f->c = parse_double(v[2],NULL);
+        f->heigth_limit = atoi(v[3]);
         f->X = NULL;
         f->X_count = 0;
         f->X_cap = 0;
@@ -222,6 +327,8 @@ int parse_F(int forest_idx,char *l)
         f->min = NULL;
         f->max = NULL;
         f->scale_range_idx = -1;
+        f->scale_factor = NULL;
+        f->scale_offset = NULL;
         f->avg = NULL;
         f->summary = NULL;
         f->dim_density = NULL;
@@ -235,6 +342,7 @@ int parse_F(int forest_idx,char *l)
         f->analyzed_rows = 0;
         f->high_analyzed_rows = 0;
         f->extra_rows = 0;
+        f->seen_rows = value_count == 7 ? atol(v[6]) : atol(v[4]);
         f->percentage_score = 0.0;
         f->min_score = 1.0;
         f->test_average_score = 0.0;
@@ -242,6 +350,7 @@ int parse_F(int forest_idx,char *l)
         add_forest_hash(forest_idx,f->category);
 
         f->last_updated = (time_t) atol(v[5]);
+        f->dirty = 0;
 
         return 1;
     }
@@ -270,10 +379,14 @@ read_forest_file_csv(char *file_name)
     int f_count,line,value_count;
     int ln = 0;
     int retval = 0;
-    static char *values[DIM_MAX];
-    static double new[DIM_MAX];
+    static char **values = NULL;
+    static double *new = NULL;
+    static int values_cap = 0,new_cap = 0;
     FILE *fp;
 
+    DIM_BUFFER(values,values_cap);
+    DIM_BUFFER(new,new_cap);
+
     fp = xfopen(file_name,"r",'a');
 
     do
@@ -337,9 +450,21 @@ read_forest_file_csv(char *file_name)
                 if(input_line[0] == 'S' && input_line[1] && input_line[2])
                 {
                     line++;
-                    value_count = parse_csv_line(values,dimensions,&input_line[2],'|');
-                    parse_values(new,values,value_count,1);
-                    add_to_X(&forest[f_count],new,value_count,1);
+
+                    if(strchr(&input_line[2],':') != NULL)
+                    {
+                        if(!sparse_fields) panic("Forest data has sparse samples, give option -x before reading it",file_name,NULL);
+                        value_count = parse_csv_line(values,dimensions,&input_line[2],'|');
+                        read_sparse_sample(&forest[f_count],values,value_count);
+                    } else if(sparse_fields && input_line[2] == '\n')
+                    {
+                        read_sparse_sample(&forest[f_count],values,0);
+                    } else
+                    {
+                        value_count = parse_csv_line(values,dimensions,&input_line[2],'|');
+                        parse_values(new,values,value_count,1);
+                        add_to_X(&forest[f_count],new,value_count,1);
+                    }
                 }
             } while(input_line[0] == 'S');
             f_count++;
@@ -352,7 +477,7 @@ read_forest_file_csv(char *file_name)
 
     end:
 
-    fclose(fp);
+    xfclose(fp);
 
     return retval;
 }
@@ -369,18 +494,21 @@ int check_forest_file_type(char *file_name)
 
     first = fgetc(fp);
 
-    fclose(fp);
+    xfclose(fp);
 
     switch(first)
     {
         case '{':
-            return FILE_JSON;
+            return FORMAT_JSON;
             break;
         case 'G':
-            return FILE_CSV;
+            return FORMAT_CSV;
+            break;
+        case 0211:
+            return FORMAT_BINARY;
             break;
     }
-    return FILE_UNKNOWN;
+    return 0;
 }
 
 
@@ -393,20 +521,37 @@ int check_forest_file_type(char *file_name)
 int 
 read_forest_file(char *file_name)
 {
-    int file_type = check_forest_file_type(file_name);
+    int file_type;
+    int ret = 0;
+
+    if(strcmp(file_name,"-") != 0 && forest_dir(file_name))
+    {
+        if(!save_format) save_format = FORMAT_BINARY;
+        return read_forest_dir(file_name);
+    }
+
+    file_type = check_forest_file_type(file_name);
 
     switch(file_type)
     {
-        case FILE_JSON:
-            return read_forest_file_json(file_name);
+        case FORMAT_JSON:
+            ret = read_forest_file_json(file_name);
+            break;
+        case FORMAT_CSV:
+            ret = read_forest_file_csv(file_name);
             break;
-        case FILE_CSV:
-            return read_forest_file_csv(file_name);
+        case FORMAT_BINARY:
+            ret = read_forest_file_binary(file_name);
             break;
         default:
             panic("Unknown file format: ", file_name,"");
             break;
     }
-    return 0;
+
+    if(!save_format) save_format = file_type;      // save in the same format by default
+
+    read_forest_delta(file_name,file_type);
+    drop_other_shards(0);
+    return ret;
 }
  
@@ -0,0 +1,349 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+
+/* Forest data directory
+ *
+ * Forest data saved to a directory (an existing directory or a name ending with '/') is split to shard files
+ * using the hash of the category string. DIR/index has the global variables and the number of forests in each shard,
+ * shards are saved in files DIR/shard-NNNN. Both are in binary forest data format, see binary.c.
+ *
+ * Only the index is read when forest data is read from a directory. A shard is read when a category belonging to it is
+ * not found in memory (search_forest_hash), so a run reads only the shards having the categories found in input.
+ * Operations using all forests read all shards first.
+ *
+ * When forest data is saved back to the same directory only the shards having changed forests are written.
+ * Shards are written in parallel.
+ */
+#include "ceif.h"
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHARD_INDEX "index"
+#define SHARD_COUNT_MIN 256     // shards in a new forest data directory
+#define SHARD_FORESTS 64        // shard count is increased for large forest counts to keep this many forests in a shard
+
+int forest_shards_pending = 0;          // number of shards not read from forest data directory
+
+static char *shard_dir = NULL;          // forest data directory read or written
+static int shard_count = 0;
+static int *shard_forests = NULL;       // number of forests in each shard
+static char *shard_loaded = NULL;       // shard is read to memory
+
+/* Data for writing shards in parallel
+ */
+struct shard_write_job
+{
+    char *dir;
+    int *shards;            // shards to be written
+    int *first;             // index of the first forest of each shard in forests
+    int *count;             // number of forests in each shard
+    int *forests;           // forest indexes ordered by shard
+};
+
+/* number of shards for given number of forests, shard count is doubled to keep about SHARD_FORESTS forests in a shard
+ */
+static
+int shard_count_for(int forests)
+{
+    int shards = SHARD_COUNT_MIN;
+
+    while(shards < forests / SHARD_FORESTS) shards *= 2;
+    return shards;
+}
+
+/* check if forest data file name is a directory
+ */
+int forest_dir(char *name)
+{
+    struct stat st;
+    size_t len = strlen(name);
+
+    if(len && name[len - 1] == '/') return 1;
+    return stat(name,&st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static
+int shard_of(char *category,int shards)
+{
+    return (int) (category_hash(category) % (unsigned int) shards);
+}
+
+/* name of file in forest data directory, shard -1 is the index
+ */
+static
+char *shard_file_name(char *dir,int shard)
+{
+    char *name = xmalloc(strlen(dir) + 20);
+    size_t len = strlen(dir);
+
+    strcpy(name,dir);
+    if(len && name[len - 1] == '/') name[len - 1] = '\000';
+
+    if(shard < 0)
+    {
+        strcat(name,"/" SHARD_INDEX);
+    } else
+    {
+        sprintf(&name[strlen(name)],"/shard-%04d",shard);
+    }
+    return name;
+}
+
+/* read one shard and train the forests read if forests are already trained
+ */
+static
+void read_shard(int shard)
+{
+    char *name;
+    int first = forest_count;
+
+    if(shard_loaded[shard]) return;
+
+    if(shard_forests[shard] > 0)
+    {
+        // room for the shard is reserved when the index is read, this is needed only if forests are added while learning
+        if(forest_count + shard_forests[shard] >= forest_cap)
+        {
+            forest_cap = forest_count + shard_forests[shard] + 1;
+            forest = xrealloc(forest,forest_cap * sizeof(struct forest));
+        }
+
+        name = shard_file_name(shard_dir,shard);
+        DEBUG("*** Reading forest data shard %s\n",name);
+        read_forest_segment(name);
+        free(name);
+
+        drop_other_shards(first);
+        train_shard_forests(first);
+    }
+
+    shard_loaded[shard] = 1;
+    __atomic_store_n(&forest_shards_pending,forest_shards_pending - 1,__ATOMIC_RELEASE);
+}
+
+/* read the shard of a category if it is not read yet, returns 1 if the shard was read
+ */
+int read_forest_shard(char *category)
+{
+    int shard;
+
+    if(!forest_shards_pending) return 0;
+
+    shard = shard_of(category,shard_count);
+    if(shard_loaded[shard]) return 0;
+
+    read_shard(shard);
+    return 1;
+}
+
+/* read all shards not read yet
+ */
+void read_forest_shards()
+{
+    int i;
+
+    for(i = 0;i < shard_count && forest_shards_pending;i++) read_shard(i);
+}
+
+/* read the index of forest data directory, forests are read later when needed
+ * returns 1 in case read was ok
+ */
+int read_forest_dir(char *dir)
+{
+    char *name = shard_file_name(dir,-1);
+    int i,total = 0;
+
+    if(shard_dir != NULL) free(shard_dir);
+    if(shard_forests != NULL) free(shard_forests);
+    if(shard_loaded != NULL) free(shard_loaded);
+
+    shard_count = read_forest_index(name,&shard_forests);
+    free(name);
+
+    shard_dir = xstrdup(dir);
+    shard_loaded = xcalloc(shard_count,sizeof(char));
+
+    for(i = 0;i < shard_count;i++) total += shard_forests[i];
+
+    // table is allocated for all forests, so it is not moved when shards are read while analyzing in several threads
+    forest_cap = total + 1;
+    forest_count = 0;
+    forest = xmalloc(forest_cap * sizeof(struct forest));
+
+    __atomic_store_n(&forest_shards_pending,shard_count,__ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/* write one shard, called by run_parallel. Shard is written to a temporary file which is renamed,
+ * an empty shard is removed
+ */
+static
+void write_shard(int i,void *arg)
+{
+    struct shard_write_job *j = arg;
+    int shard = j->shards[i];
+    char *name = shard_file_name(j->dir,shard);
+    char *tmp;
+
+    if(j->count[shard] == 0)
+    {
+        if(unlink(name) != 0 && errno != ENOENT) panic("Cannot remove file",name,strerror(errno));
+        free(name);
+        return;
+    }
+
+    tmp = xmalloc(strlen(name) + 5);
+    strcpy(tmp,name);
+    strcat(tmp,".tmp");
+
+    write_forest_segment(tmp,&j->forests[j->first[shard]],j->count[shard]);
+
+    if(rename(tmp,name) != 0) panic("Cannot rename file",tmp,strerror(errno));
+
+    free(tmp);
+    free(name);
+}
+
+/* Save forest data to directory dir. If forest data was read from the same directory
+ * only the shards read having changed forests are written, otherwise all forests are read and written
+ */
+void write_forest_dir(char *dir,time_t delete_interval)
+{
+    struct shard_write_job j;
+    int i,shard,shards,write_count,total;
+    int same = shard_dir != NULL && strcmp(shard_dir,dir) == 0;
+    char *changed;
+    char *name;
+    time_t now = time(NULL);
+
+    // forests of other category shards are not in memory, they would be lost when shards are rewritten
+    if(same && category_shards) panic("Forest data directory read using --shard cannot be saved to the same directory",dir,NULL);
+
+    if(!same || delete_interval != (time_t) 0) read_forest_shards();
+
+    if(mkdir(dir,0777) != 0 && errno != EEXIST) panic("Cannot create directory",dir,strerror(errno));
+
+    if(same)
+    {
+        // forests of shards not read are counted from the index
+        total = forest_count;
+        for(i = 0;i < shard_count;i++) if(!shard_loaded[i]) total += shard_forests[i];
+
+        shards = shard_count_for(total);
+
+        if(shards > shard_count)
+        {
+            // forests move to other shards when the shard count grows, all shards are read and written
+            DEBUG("*** Forest data directory %s grows from %d to %d shards\n",dir,shard_count,shards);
+            read_forest_shards();
+            same = 0;
+        } else
+        {
+            shards = shard_count;
+        }
+    } else
+    {
+        shards = shard_count_for(forest_count);
+    }
+
+    j.dir = dir;
+    j.shards = xmalloc(shards * sizeof(int));
+    j.first = xcalloc(shards,sizeof(int));
+    j.count = xcalloc(shards,sizeof(int));
+    j.forests = xmalloc((forest_count + 1) * sizeof(int));
+    changed = xcalloc(shards,sizeof(char));
+
+    for(i = 0;i < forest_count;i++)
+    {
+        if(delete_interval == (time_t) 0 || (delete_interval > (time_t) 0 && forest[i].last_updated >= now - delete_interval))
+        {
+            shard = shard_of(forest[i].category,shards);
+            j.count[shard]++;
+            if(forest[i].dirty) changed[shard] = 1;
+        }
+    }
+
+    for(i = 1;i < shards;i++) j.first[i] = j.first[i - 1] + j.count[i - 1];
+
+    memset(j.count,0,shards * sizeof(int));
+
+    for(i = 0;i < forest_count;i++)
+    {
+        if(delete_interval == (time_t) 0 || (delete_interval > (time_t) 0 && forest[i].last_updated >= now - delete_interval))
+        {
+            shard = shard_of(forest[i].category,shards);
+            j.forests[j.first[shard] + j.count[shard]] = i;
+            j.count[shard]++;
+        }
+    }
+
+    write_count = 0;
+    total = 0;
+
+    for(i = 0;i < shards;i++)
+    {
+        if(same && !shard_loaded[i])
+        {
+            j.count[i] = shard_forests[i];       // shard is not read, it is kept as it is
+        } else if(!same || delete_interval != (time_t) 0 || changed[i] || j.count[i] != shard_forests[i])
+        {
+            j.shards[write_count++] = i;
+        }
+        total += j.count[i];
+    }
+
+    DEBUG("*** Writing %d shards to forest data directory %s\n",write_count,dir);
+
+    run_parallel(write_count,write_shard,&j);
+
+    name = shard_file_name(dir,-1);
+    write_forest_index(name,total,shards,j.count);
+    free(name);
+
+    for(i = 0;i < forest_count;i++) forest[i].dirty = 0;
+
+    if(!same)
+    {
+        if(shard_dir != NULL) free(shard_dir);
+        if(shard_forests != NULL) free(shard_forests);
+        if(shard_loaded != NULL) free(shard_loaded);
+
+        shard_dir = xstrdup(dir);
+        shard_count = shards;
+        shard_forests = xmalloc(shards * sizeof(int));
+        shard_loaded = xmalloc(shards * sizeof(char));
+        memset(shard_loaded,1,shards);
+    }
+
+    memcpy(shard_forests,j.count,shards * sizeof(int));
+
+    free(j.shards);
+    free(j.first);
+    free(j.count);
+    free(j.forests);
+    free(changed);
+}
@@ -0,0 +1,364 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+#include "ceif.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdint.h>
+#endif
+
+int thread_count = 1;           // number of threads used in parallel sections, 1 = no extra threads
+
+#define ITEMS_PER_THREAD 4      // work is split to ITEMS_PER_THREAD chunks for each thread, evens out the load between threads
+
+/* A job for the worker pool
+ * items are processed in chunks, next chunk to be processed is in next
+ */
+struct thread_job
+{
+    int items;                  // number of items in job
+    int next;                   // next item to be processed, updated atomically
+    int chunk;                  // number of items taken at once
+    void (*work)(int,void *);   // function processing one item
+    void *arg;                  // user data for work
+};
+
+/* process job items until all are taken
+ */
+static
+void run_items(struct thread_job *j)
+{
+    int i,end;
+
+    while((i = __sync_fetch_and_add(&j->next,j->chunk)) < j->items)
+    {
+        end = i + j->chunk;
+        if(end > j->items) end = j->items;
+
+        for(;i < end;i++) j->work(i,j->arg);
+    }
+}
+
+#ifdef HAVE_PTHREAD_H
+
+static pthread_t *workers = NULL;
+static int worker_count = 0;             // number of threads in pool, caller thread is not included
+static int busy_workers = 0;             // workers still running current job
+static unsigned long generation = 0;     // incremented for every new job
+static struct thread_job *current_job = NULL;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+/* worker thread main loop, wait for a new job and process it
+ */
+static
+void *worker_main(void *unused)
+{
+    unsigned long seen = 0;
+    struct thread_job *j;
+
+    pthread_mutex_lock(&pool_lock);
+
+    for(;;)
+    {
+        while(generation == seen) pthread_cond_wait(&pool_start,&pool_lock);
+
+        seen = generation;
+        j = current_job;
+
+        pthread_mutex_unlock(&pool_lock);
+
+        run_items(j);
+
+        pthread_mutex_lock(&pool_lock);
+
+        if(--busy_workers == 0) pthread_cond_signal(&pool_done);
+    }
+
+    return NULL;
+}
+
+/* Start worker threads. count is the total number of threads including the main thread
+ */
+void init_threads(int count)
+{
+    int i;
+
+    if(count < 2 || workers != NULL) return;
+
+    workers = xmalloc((count - 1) * sizeof(pthread_t));
+
+    for(i = 0;i < count - 1;i++)
+    {
+        if(pthread_create(&workers[i],NULL,worker_main,NULL) != 0)
+        {
+            info("Cannot create thread",NULL,strerror(errno));
+            break;
+        }
+        worker_count++;
+    }
+
+    DEBUG("Started %d worker threads\n",worker_count);
+}
+
+/* Call work for every item 0..items-1, items are processed in parallel by worker threads and the caller.
+ * Returns when all items are processed. Items are independent and can be processed in any order
+ */
+void run_parallel(int items, void (*work)(int,void *), void *arg)
+{
+    struct thread_job j;
+
+    j.items = items;
+    j.next = 0;
+    j.work = work;
+    j.arg = arg;
+    j.chunk = items / ((worker_count + 1) * ITEMS_PER_THREAD);
+    if(j.chunk < 1) j.chunk = 1;
+
+    if(worker_count == 0 || items < 2)
+    {
+        run_items(&j);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    current_job = &j;
+    busy_workers = worker_count;
+    generation++;
+    pthread_cond_broadcast(&pool_start);
+    pthread_mutex_unlock(&pool_lock);
+
+    run_items(&j);
+
+    pthread_mutex_lock(&pool_lock);
+    while(busy_workers) pthread_cond_wait(&pool_done,&pool_lock);
+    pthread_mutex_unlock(&pool_lock);
+}
+
+/* return the number of threads available for run_parallel, including the caller
+ */
+int parallel_threads()
+{
+    return worker_count + 1;
+}
+
+/* Lock protecting rare updates to shared forest data from several threads
+ */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void lock_shared()
+{
+    pthread_mutex_lock(&shared_lock);
+}
+
+void unlock_shared()
+{
+    pthread_mutex_unlock(&shared_lock);
+}
+
+/* Start a new thread running start(arg)
+ */
+void *start_thread(void *(*start)(void *),void *arg)
+{
+    pthread_t *t = xmalloc(sizeof(pthread_t));
+
+    if(pthread_create(t,NULL,start,arg) != 0) panic("Cannot create thread",NULL,strerror(errno));
+
+    return t;
+}
+
+/* Wait for a thread started with start_thread
+ */
+void join_thread(void *t)
+{
+    pthread_join(*(pthread_t *) t,NULL);
+    free(t);
+}
+
+/* Bounded multi producer multi consumer queue.
+ * Items are passed through a lock free ring buffer where every cell has a sequence number
+ * telling if the cell is free for the producer or ready for the consumer.
+ * Semaphores are used only to block a producer when the queue is full or a consumer when the queue is empty.
+ */
+struct queue_cell
+{
+    size_t sequence;
+    void *data;
+};
+
+struct queue
+{
+    struct queue_cell *cell;
+    size_t mask;                // queue size - 1, size is a power of two
+    size_t enqueue_pos;
+    size_t dequeue_pos;
+    sem_t items;                // number of items in queue
+    sem_t slots;                // number of free cells in queue
+};
+
+/* make a new queue having space at least for size items
+ */
+struct queue *queue_new(int size)
+{
+    struct queue *q = xmalloc(sizeof(struct queue));
+    size_t i,cap = 2;
+
+    while(cap < (size_t) size) cap <<= 1;
+
+    q->cell = xmalloc(cap * sizeof(struct queue_cell));
+    q->mask = cap - 1;
+    q->enqueue_pos = 0;
+    q->dequeue_pos = 0;
+
+    for(i = 0;i < cap;i++) q->cell[i].sequence = i;
+
+    sem_init(&q->items,0,0);
+    sem_init(&q->slots,0,cap);
+
+    return q;
+}
+
+static
+void sem_wait_intr(sem_t *s)
+{
+    while(sem_wait(s) != 0 && errno == EINTR);
+}
+
+/* add an item to queue, blocks if the queue is full
+ */
+void queue_push(struct queue *q,void *data)
+{
+    struct queue_cell *c;
+    size_t pos;
+    intptr_t dif;
+
+    sem_wait_intr(&q->slots);
+
+    pos = __atomic_load_n(&q->enqueue_pos,__ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        c = &q->cell[pos & q->mask];
+        dif = (intptr_t) __atomic_load_n(&c->sequence,__ATOMIC_ACQUIRE) - (intptr_t) pos;
+
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&q->enqueue_pos,&pos,pos + 1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+        } else 
+        {
+            if(dif < 0) sched_yield();   // consumer of this cell has not yet released it
+            pos = __atomic_load_n(&q->enqueue_pos,__ATOMIC_RELAXED);
+        }
+    }
+
+    c->data = data;
+    __atomic_store_n(&c->sequence,pos + 1,__ATOMIC_RELEASE);
+
+    sem_post(&q->items);
+}
+
+/* take an item from queue, blocks if the queue is empty
+ */
+void *queue_pop(struct queue *q)
+{
+    struct queue_cell *c;
+    size_t pos;
+    intptr_t dif;
+    void *data;
+
+    sem_wait_intr(&q->items);
+
+    pos = __atomic_load_n(&q->dequeue_pos,__ATOMIC_RELAXED);
+
+    for(;;)
+    {
+        c = &q->cell[pos & q->mask];
+        dif = (intptr_t) __atomic_load_n(&c->sequence,__ATOMIC_ACQUIRE) - (intptr_t) (pos + 1);
+
+        if(dif == 0)
+        {
+            if(__atomic_compare_exchange_n(&q->dequeue_pos,&pos,pos + 1,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED)) break;
+        } else 
+        {
+            if(dif < 0) sched_yield();   // producer of this cell has not yet written it
+            pos = __atomic_load_n(&q->dequeue_pos,__ATOMIC_RELAXED);
+        }
+    }
+
+    data = c->data;
+    __atomic_store_n(&c->sequence,pos + q->mask + 1,__ATOMIC_RELEASE);
+
+    sem_post(&q->slots);
+
+    return data;
+}
+
+void queue_free(struct queue *q)
+{
+    sem_destroy(&q->items);
+    sem_destroy(&q->slots);
+    free(q->cell);
+    free(q);
+}
+
+#else
+
+/* no thread support, everything is run by the caller
+ */
+void init_threads(int count)
+{
+    if(count > 1) info("Threads are not supported, using one thread",NULL,NULL);
+}
+
+void run_parallel(int items, void (*work)(int,void *), void *arg)
+{
+    struct thread_job j;
+
+    j.items = items;
+    j.next = 0;
+    j.chunk = 1;
+    j.work = work;
+    j.arg = arg;
+
+    run_items(&j);
+}
+
+int parallel_threads()
+{
+    return 1;
+}
+
+void lock_shared()
+{
+}
+
+void unlock_shared()
+{
+}
+
+#endif
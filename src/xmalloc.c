@@ -119,6 +119,29 @@ xstrdup (const char *str)
   return p;
 }
 
+/* Grow buffer p to have space for dim_max items of given size, cap has the current item count of the buffer.
+ */
+VOID *
+dim_buffer(VOID *p,int *cap,size_t size)
+{
+    if(*cap < dim_max)
+    {
+        p = xrealloc(p,(size_t) dim_max * size);
+        *cap = dim_max;
+    }
+    return p;
+}
+
+/* Compressed files are read and written through a compression thread, see compress.c
+ */
+static FILE *
+compress_stream(FILE *fp, char *name, char *mode)
+{
+    if(mode[0] == 'r' && mode[1] != '+') return compress_open_read(fp,name);
+    if((mode[0] == 'w' || mode[0] == 'a') && mode[1] != '+') return compress_open_write(fp,name);
+    return fp;
+}
+
 FILE *
 xfopen(char *name, char *mode, char bin_asc)
 {
@@ -132,7 +155,7 @@ xfopen(char *name, char *mode, char bin_asc)
         {
             if(stdin_opened) panic("stdin allready open",NULL,NULL);
             stdin_opened = 1;
-            return stdin;
+            return compress_open_read(stdin,name);
         } else 
         {
             if(stdout_opened) panic("stdout allready open",NULL,NULL);
@@ -150,7 +173,7 @@ xfopen(char *name, char *mode, char bin_asc)
    if(bin_asc == 'a') setmode(fileno(ret),O_TEXT);
    if(bin_asc == 'b') setmode(fileno(ret),O_BINARY);
 #endif
-   return ret;
+   return compress_stream(ret,name,mode);
 }
 
 FILE *
@@ -165,7 +188,21 @@ xfopen_test(char *name, char *mode, char bin_asc)
    if(bin_asc == 'a') setmode(fileno(ret),O_TEXT);
    if(bin_asc == 'b') setmode(fileno(ret),O_BINARY);
 #endif
-   return ret;
+   return compress_stream(ret,name,mode);
+}
+
+/* Close a stream opened with xfopen or xfopen_test
+ */
+int
+xfclose(FILE *fp)
+{
+    unsigned char peeked[4];
+    int ret;
+
+    compress_peeked(fp,peeked);       // forget bytes not used by the caller
+
+    if(compress_close(fp,&ret)) return ret;
+    return fclose(fp);
 }
 
 void
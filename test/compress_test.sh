@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Check reading plain and compressed input from files, pipes and stdin, and reading forest data
+# directories which are opened the same way.
+#
+# usage: compress_test.sh [CEIF]
+#
+dir=`dirname "$0"`
+ceif=${1:-$dir/../src/ceif}
+data=$dir/2blob.csv
+categories=$dir/3cat_samples.csv
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+status=0
+
+# forests of json forest data, one forest on each line in sorted order
+forests()
+{
+    tr '{' '\n' < "$1" | sed 's/[]},]*$//' | sort
+}
+
+check()
+{
+    if cmp -s "$tmp/expected" "$tmp/out"
+    then
+        echo "$1: ok"
+    else
+        echo "$1: FAILED"
+        status=1
+    fi
+}
+
+# compressed input is skipped if the format is not supported in this build
+compressed()
+{
+    if cat "$2" | "$ceif" -r "$tmp/forest.json" -O 0 -p "%v" -a - > "$tmp/out" 2> "$tmp/err"
+    then
+        check "$1"
+    elif grep -q "not supported" "$tmp/err"
+    then
+        echo "$1: skipped"
+    else
+        cat "$tmp/err"
+        echo "$1: FAILED"
+        status=1
+    fi
+}
+
+"$ceif" -l "$data" -W json -w "$tmp/forest.json" || exit 1
+"$ceif" -r "$tmp/forest.json" -O 0 -p "%v" -a "$data" > "$tmp/expected" || exit 1
+test -s "$tmp/expected" || { echo "no rows printed for $data"; exit 1; }
+
+cat "$data" | "$ceif" -r "$tmp/forest.json" -O 0 -p "%v" -a - > "$tmp/out"
+check "plain pipe"
+
+"$ceif" -r "$tmp/forest.json" -O 0 -p "%v" -a - < "$data" > "$tmp/out"
+check "plain stdin"
+
+gzip -c "$data" > "$tmp/data.gz" 2>/dev/null && compressed "gzip pipe" "$tmp/data.gz"
+zstd -q -c "$data" > "$tmp/data.zst" 2>/dev/null && compressed "zstd pipe" "$tmp/data.zst"
+
+# forest data directory written with -w DIR/ is read back with -r DIR/ and -z DIR/
+"$ceif" -C 1 -l "$categories" -W json -w "$tmp/forest.json" || exit 1
+forests "$tmp/forest.json" > "$tmp/expected"
+
+"$ceif" -r "$tmp/forest.json" -w "$tmp/forests/" && "$ceif" -r "$tmp/forests/" -W json -w "$tmp/dir.json" && forests "$tmp/dir.json" > "$tmp/out"
+check "forest directory -r"
+
+"$ceif" -z "$tmp/forests/" && "$ceif" -r "$tmp/forests/" -W json -w "$tmp/dir.json" && forests "$tmp/dir.json" > "$tmp/out"
+check "forest directory -z"
+
+exit $status
@@ -0,0 +1,123 @@
+/*
+ *    ceif - categorized extended isolation forest
+ *
+ *    Copyright (C) 2024 Timo Savinen
+ *    This file is part of ceif.
+ *
+ *    ceif is free software; you can redistribute it and/or modify
+ *    it under the terms of the GNU General Public License as published by
+ *    the Free Software Foundation; either version 2 of the License, or
+ *    (at your option) any later version.
+ *
+ *    ceif is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *    GNU General Public License for more details.
+ *
+ *    You should have received a copy of the GNU General Public License
+ *    along with ceif; if not, write to the Free Software
+ *    Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *    F607480034
+ *    HJ9004-2
+ *
+ */
+
+/* Equivalence test of parse_csv_line, run using csv_parse_test.sh
+ *
+ * find_char and parse_csv_line are extracted from src/file.c to csv_parse.inc. They are compared with
+ * the original parser scanning one byte at a time using random lines of separators, quotes, backslashes,
+ * line feeds and other characters. Lines start at random offsets so all alignments are tested.
+ * Field count, field positions and the modified line must be the same.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "csv_parse.inc"
+
+#define LINE_MAX_LEN 80
+#define FIELDS_MAX 16
+
+/* the parser before find_char was added
+ */
+static
+int old_parse_csv_line(char *values[],int max_values,char *line,char separator)
+{
+    int n = 0;
+    int in_quote;
+    char *new_line;
+    char *start = line;
+
+    if(line == NULL || max_values < 1) return 0;
+
+    while(*line != '\000' && n < max_values)
+    {
+        if(*line == '"') 
+        {
+            in_quote = 1;
+            line++;
+        } else
+        {
+            in_quote = 0;
+        }
+
+        values[n++] = line;
+        while(*line != '\000' && ((!in_quote && (*line != separator || (*line == separator && line > start && line[-1] == '\\'))) || (in_quote && *line != '"'))) line++;
+        if (in_quote && *line == '"') *line++ = '\000';
+        while(*line != '\000' && *line != separator) line++;
+        if (*line == separator) *line++ = '\000';
+    }
+
+    if(n) {
+        new_line = strchr(values[n - 1],'\n');
+        if(new_line != NULL) *new_line = '\000';
+    }
+
+    return n;
+}
+
+int main(int argc,char **argv)
+{
+    static const char chars[] = ",;\"\\\nab 1";
+    long rounds = argc > 1 ? atol(argv[1]) : 1000000;
+    long r,errors = 0;
+    char *old_buf = malloc(LINE_MAX_LEN + 64);
+    char *new_buf = malloc(LINE_MAX_LEN + 64);
+    char *old_values[FIELDS_MAX],*new_values[FIELDS_MAX];
+    char separator,*old_line,*new_line;
+    int i,len,offset,max_values,old_n,new_n;
+
+    srand(argc > 2 ? atoi(argv[2]) : 1);
+
+    for(r = 0;r < rounds;r++)
+    {
+        len = rand() % LINE_MAX_LEN;
+        offset = rand() % 32;
+        max_values = 1 + rand() % FIELDS_MAX;
+        separator = rand() % 2 ? ',' : ';';
+
+        memset(old_buf,'X',LINE_MAX_LEN + 64);
+        old_line = &old_buf[offset];
+        for(i = 0;i < len;i++) old_line[i] = chars[rand() % (sizeof(chars) - 1)];
+        old_line[len] = '\000';
+
+        memcpy(new_buf,old_buf,LINE_MAX_LEN + 64);
+        new_line = &new_buf[offset];
+
+        old_n = old_parse_csv_line(old_values,max_values,old_line,separator);
+        new_n = parse_csv_line(new_values,max_values,new_line,separator);
+
+        if(old_n != new_n || memcmp(old_buf,new_buf,LINE_MAX_LEN + 64) != 0) goto fail;
+        for(i = 0;i < old_n;i++) if(old_values[i] - old_buf != new_values[i] - new_buf) goto fail;
+        continue;
+fail:
+        if(errors++ < 10) fprintf(stderr,"Mismatch in round %ld, separator %c, %d fields vs %d\n",r,separator,old_n,new_n);
+    }
+
+    printf("%ld lines, %ld mismatches\n",rounds,errors);
+    return errors != 0;
+}
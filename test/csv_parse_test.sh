@@ -0,0 +1,37 @@
+#!/bin/sh
+#
+# Compare parse_csv_line of src/file.c with the original parser, see csv_parse_test.c
+# Both the SSE2 and the byte loop versions of find_char are tested.
+#
+# usage: csv_parse_test.sh [LINES]
+#
+dir=`dirname "$0"`
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+CC=${CC:-cc}
+
+# find_char and parse_csv_line are copied from file.c, the copy ends with the end of parse_csv_line
+awk '/^\/\* return pointer to the first c or NUL/ { copy = 1 }
+     copy { print }
+     /^parse_csv_line\(/ { parser = 1 }
+     parser && /^}/ { exit }' "$dir/../src/file.c" > "$tmp/csv_parse.inc"
+
+grep -q '^parse_csv_line(' "$tmp/csv_parse.inc" || { echo "parse_csv_line not found in src/file.c"; exit 1; }
+
+status=0
+
+for build in sse2 bytes
+do
+    if [ $build = sse2 ]
+    then
+        flags=
+    else
+        flags=-U__SSE2__
+    fi
+
+    $CC -O2 $flags -I"$tmp" -o "$tmp/csv_parse_test" "$dir/csv_parse_test.c" || exit 1
+    printf '%s: ' $build
+    "$tmp/csv_parse_test" ${1:-1000000} || status=1
+done
+
+exit $status
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Check that merged forest data (-J) has samples in proportion to the rows seen by each forest.
+# Forest a is learned from 2000 rows having the first value below 1000, forest b from 64 rows
+# having the first value 1000 or more. Both are merged in both orders. Forest data a4 has the samples
+# of a with room for 256 samples, so all samples of a and b would fit to the merged table.
+#
+# usage: merge_test.sh [CEIF]
+#
+dir=`dirname "$0"`
+ceif=${1:-$dir/../src/ceif}
+tmp=`mktemp -d` || exit 1
+trap 'rm -rf "$tmp"' 0
+
+status=0
+
+awk 'BEGIN { srand(1); for(i = 0;i < 2000;i++) printf "%d,%d\n",rand() * 100,rand() * 100 }' > "$tmp/a.csv"
+awk 'BEGIN { srand(2); for(i = 0;i < 64;i++) printf "%d,%d\n",1000 + rand() * 100,rand() * 100 }' > "$tmp/b.csv"
+
+"$ceif" -t 2 -s 64 -l "$tmp/a.csv" -W json -w "$tmp/a.json" || exit 1
+"$ceif" -t 2 -s 64 -l "$tmp/b.csv" -W json -w "$tmp/b.json" || exit 1
+"$ceif" -r "$tmp/a.json" -t 4 -w "$tmp/a4.json" || exit 1
+
+for order in "a b" "b a" "a4 b"
+do
+    set -- $order
+
+    "$ceif" -r "$tmp/$1.json" -J "$tmp/$2.json" -W json -w "$tmp/merged.json" || exit 1
+
+    # samples of b should be count * 64 / 2064 of the merged samples
+    tr '[' '\n' < "$tmp/merged.json" | awk -F, -v order="$order" '
+        /"seenRows"/ { split($0,a,"\"seenRows\":"); seen = a[2] + 0 }
+        /^[0-9]/ { count++; if($1 + 0 >= 1000) b++ }
+        END {
+            expected = count * 64 / 2064
+            ok = seen == 2064 && count > 0 && b >= expected - 1 && b <= expected + 1
+            printf "merge %s: %d samples, %d from b (expected %.1f), seen rows %d: %s\n",order,count,b,expected,seen,ok ? "ok" : "FAILED"
+            exit !ok
+        }' || status=1
+done
+
+exit $status